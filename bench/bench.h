@@ -0,0 +1,62 @@
+#ifndef CODECRAFTER_BENCH_H
+#define CODECRAFTER_BENCH_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base.h"
+
+// Runs argv with its output thrown away. Returns the time taken, negative
+// when it failed.
+internal double bench_run(char **argv) {
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  double ms = now_ms() - start;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? ms : -1;
+}
+
+internal double bench_run_script(const char *shell, const char *script) {
+  char *argv[] = {(char *)shell, (char *)script, NULL};
+  return bench_run(argv);
+}
+
+// Points the shell's cache directory into dir, so the scripts it compiles
+// are cached there rather than in the user's cache.
+internal void bench_cache_in(const char *dir) {
+  setenv("XDG_CACHE_HOME", dir, 1);
+}
+
+// Removes what the shell cached after bench_cache_in(dir).
+internal void bench_cache_remove(const char *dir) {
+  char cache[PATH_MAX_LEN];
+  snprintf(cache, sizeof(cache), "%s/codecrafters-shell", dir);
+  DIR *d = opendir(cache);
+  struct dirent *entry = NULL;
+  while (d != NULL && (entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      char path[PATH_MAX_LEN];
+      snprintf(path, sizeof(path), "%s/%s", cache, entry->d_name);
+      unlink(path);
+    }
+  }
+  if (d != NULL) {
+    closedir(d);
+  }
+  rmdir(cache);
+}
+
+#endif
@@ -0,0 +1,76 @@
+// Glob expansion over a directory with many files, compared to glob(3).
+//
+//   bench_glob [file_count] [iterations]
+
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "wildcard.h"
+
+int main(int argc, char *argv[]) {
+  int file_count = argc > 1 ? atoi(argv[1]) : 100000;
+  int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+  char dir[] = "/tmp/bench_glob_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  chdir(dir);
+
+  double start = now_ms();
+  for (int i = 0; i < file_count; i += 1) {
+    char name[64];
+    snprintf(name, sizeof(name), "file_%07d.%s", i, i % 2 ? "log" : "txt");
+    close(creat(name, 0644));
+  }
+  printf("created %d files in %.1f ms\n", file_count, now_ms() - start);
+
+  size_t arena_size = 256 * MB;
+  Arena arena = {0};
+  arena_init(&arena, malloc(arena_size), arena_size);
+
+  const char *patterns[] = {"*.log", "file_*1*.txt", "*[0-4].log", "*", NULL};
+  for (int p = 0; patterns[p] != NULL; p += 1) {
+    String pattern = str_init(patterns[p], strlen(patterns[p]));
+
+    uint64_t count = 0;
+    start = now_ms();
+    for (int i = 0; i < iterations; i += 1) {
+      TempArenaMemory temp = temp_arena_memory_begin(&arena);
+      count = glob_expand(&arena, pattern).count;
+      temp_arena_memory_end(temp);
+    }
+    double ours = (now_ms() - start) / iterations;
+
+    size_t libc_count = 0;
+    start = now_ms();
+    for (int i = 0; i < iterations; i += 1) {
+      glob_t g = {0};
+      glob(patterns[p], 0, NULL, &g);
+      libc_count = g.gl_pathc;
+      globfree(&g);
+    }
+    double libc = (now_ms() - start) / iterations;
+
+    printf("%-14s %7llu matches  glob_expand %8.2f ms  glob(3) %8.2f ms"
+           " (%zu)\n",
+           patterns[p], (unsigned long long)count, ours, libc, libc_count);
+  }
+
+  for (int i = 0; i < file_count; i += 1) {
+    char name[64];
+    snprintf(name, sizeof(name), "file_%07d.%s", i, i % 2 ? "log" : "txt");
+    unlink(name);
+  }
+  chdir("/");
+  rmdir(dir);
+  free(arena.buf);
+  return 0;
+}
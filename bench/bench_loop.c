@@ -0,0 +1,59 @@
+// A for loop calling a builtin every iteration, which the shell runs
+// without forking, compared to the same loop calling an external command,
+// with /bin/sh running both as a reference.
+//
+//   bench_loop [iterations] [shell]    defaults to 100000 and ./shell
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  const char *shell = argc > 2 ? argv[2] : "./shell";
+
+  char dir[] = "/tmp/bench_loop_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  bench_cache_in(dir);
+
+  const char *bodies[] = {"echo", "/bin/echo"};
+  char scripts[2][PATH_MAX_LEN];
+  for (int i = 0; i < 2; i += 1) {
+    snprintf(scripts[i], sizeof(scripts[i]), "%s/loop%d.sh", dir, i);
+    FILE *f = fopen(scripts[i], "w");
+    if (f == NULL) {
+      perror(scripts[i]);
+      return 1;
+    }
+    fprintf(f, "for i in $(seq %d); do %s $i; done\n", iterations, bodies[i]);
+    fclose(f);
+  }
+
+  printf("%d iterations\n", iterations);
+  printf("%-12s %14s %14s %12s\n", "body", "shell ms", "/bin/sh ms",
+         "us/iter");
+  for (int i = 0; i < 2; i += 1) {
+    double ours = bench_run_script(shell, scripts[i]);
+    double reference = bench_run_script("/bin/sh", scripts[i]);
+    if (ours < 0) {
+      fprintf(stderr, "%s failed on %s\n", shell, scripts[i]);
+      return 1;
+    }
+    printf("%-12s %14.1f %14.1f %12.2f\n", bodies[i], ours, reference,
+           ours * 1000.0 / iterations);
+  }
+
+  for (int i = 0; i < 2; i += 1) {
+    unlink(scripts[i]);
+  }
+  bench_cache_remove(dir);
+  rmdir(dir);
+  return 0;
+}
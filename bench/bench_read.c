@@ -0,0 +1,69 @@
+// A while read loop over a large file, compared to cat reading the same
+// file and to /bin/sh running the same loop.
+//
+//   bench_read [lines] [shell]    defaults to 2000000 and ./shell
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+  int lines = argc > 1 ? atoi(argv[1]) : 2000000;
+  char *shell = argc > 2 ? argv[2] : "./shell";
+
+  char dir[] = "/tmp/bench_read_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  bench_cache_in(dir);
+  char input[PATH_MAX_LEN];
+  char script[PATH_MAX_LEN];
+  snprintf(input, sizeof(input), "%s/input.txt", dir);
+  snprintf(script, sizeof(script), "%s/read.sh", dir);
+
+  FILE *f = fopen(input, "w");
+  if (f == NULL) {
+    perror(input);
+    return 1;
+  }
+  for (int i = 0; i < lines; i += 1) {
+    fprintf(f, "%d some words on line %d\n", i, i);
+  }
+  fclose(f);
+  f = fopen(script, "w");
+  if (f == NULL) {
+    perror(script);
+    return 1;
+  }
+  fprintf(f, "while read -r line; do :; done < %s\n", input);
+  fclose(f);
+
+  char *cat[] = {"/bin/cat", input, NULL};
+  char *ours[] = {shell, script, NULL};
+  char *reference[] = {"/bin/sh", script, NULL};
+  double cat_ms = bench_run(cat);
+  double ours_ms = bench_run(ours);
+  double reference_ms = bench_run(reference);
+  if (ours_ms < 0) {
+    fprintf(stderr, "%s failed on %s\n", shell, script);
+    return 1;
+  }
+
+  printf("%d lines\n", lines);
+  printf("%-10s %12s %12s\n", "", "ms", "ns/line");
+  printf("%-10s %12.1f %12.1f\n", "cat", cat_ms, cat_ms * 1e6 / lines);
+  printf("%-10s %12.1f %12.1f\n", "shell", ours_ms, ours_ms * 1e6 / lines);
+  printf("%-10s %12.1f %12.1f\n", "/bin/sh", reference_ms,
+         reference_ms * 1e6 / lines);
+
+  unlink(script);
+  unlink(input);
+  bench_cache_remove(dir);
+  rmdir(dir);
+  return 0;
+}
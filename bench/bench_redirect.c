@@ -0,0 +1,114 @@
+// A loop appending a line to a log every iteration: reopening the log with
+// >> each time, writing to a descriptor exec opened once with >&3, and the
+// same with exec -b buffering what the builtin writes. /bin/sh runs the
+// first two as a reference. Before timing, checks that what exec -b holds
+// for stdout is written out before a builtin writes to stdout directly.
+//
+//   bench_redirect [iterations] [shell]    defaults to 200000 and ./shell
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "bench.h"
+
+// Runs exec -b on stdout with plain and >&1 builtins mixed. Returns false
+// after printing what the log got when the lines are out of order.
+internal bool bench_check_order(const char *shell, const char *dir) {
+  char script[PATH_MAX_LEN];
+  char log[PATH_MAX_LEN];
+  snprintf(script, sizeof(script), "%s/order.sh", dir);
+  snprintf(log, sizeof(log), "%s/order", dir);
+  FILE *f = fopen(script, "w");
+  if (f == NULL) {
+    perror(script);
+    return false;
+  }
+  fprintf(f, "exec -b 1> %s\necho first\necho second >&1\necho third\n",
+          log);
+  fclose(f);
+
+  const char *expected = "first\nsecond\nthird\n";
+  char text[64] = {0};
+  bool ok = bench_run_script(shell, script) >= 0;
+  f = ok ? fopen(log, "r") : NULL;
+  if (f != NULL) {
+    fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+  }
+  ok = ok && strcmp(text, expected) == 0;
+  if (!ok) {
+    fprintf(stderr, "exec -b 1>: expected\n%sgot\n%s", expected, text);
+  }
+  unlink(script);
+  unlink(log);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+  const char *shell = argc > 2 ? argv[2] : "./shell";
+
+  char dir[] = "/tmp/bench_redirect_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  bench_cache_in(dir);
+  char log[PATH_MAX_LEN];
+  snprintf(log, sizeof(log), "%s/log", dir);
+
+  if (!bench_check_order(shell, dir)) {
+    return 1;
+  }
+
+  const char *names[] = {">> log", "exec 3>>", "exec -b 3>>"};
+  const char *setups[] = {"", "exec 3>> %s\n", "exec -b 3>> %s\n"};
+  const char *targets[] = {">> %s", ">&3", ">&3"};
+  bool posix[] = {true, true, false};
+  char scripts[3][PATH_MAX_LEN];
+  for (int i = 0; i < 3; i += 1) {
+    snprintf(scripts[i], sizeof(scripts[i]), "%s/redirect%d.sh", dir, i);
+    FILE *f = fopen(scripts[i], "w");
+    if (f == NULL) {
+      perror(scripts[i]);
+      return 1;
+    }
+    fprintf(f, setups[i], log);
+    fprintf(f, "for i in $(seq %d); do echo line $i ", iterations);
+    fprintf(f, targets[i], log);
+    fprintf(f, "; done\n");
+    fclose(f);
+  }
+
+  printf("%d iterations\n", iterations);
+  printf("%-14s %14s %14s %12s\n", "redirect", "shell ms", "/bin/sh ms",
+         "us/iter");
+  for (int i = 0; i < 3; i += 1) {
+    unlink(log);
+    double ours = bench_run_script(shell, scripts[i]);
+    unlink(log);
+    double reference = posix[i] ? bench_run_script("/bin/sh", scripts[i]) : -1;
+    if (ours < 0) {
+      fprintf(stderr, "%s failed on %s\n", shell, scripts[i]);
+      return 1;
+    }
+    char reference_ms[32] = "-";
+    if (reference >= 0) {
+      snprintf(reference_ms, sizeof(reference_ms), "%.1f", reference);
+    }
+    printf("%-14s %14.1f %14s %12.2f\n", names[i], ours, reference_ms,
+           ours * 1000.0 / iterations);
+  }
+
+  for (int i = 0; i < 3; i += 1) {
+    unlink(scripts[i]);
+  }
+  unlink(log);
+  bench_cache_remove(dir);
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Spawn latency of /bin/true as the process grows: fork from the process
+// itself, compared to asking a zygote forked while the process was small.
+//
+//   bench_spawn [iterations] [max_mb]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "zygote.h"
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  int max_mb = argc > 2 ? atoi(argv[2]) : 1024;
+
+  Zygote zygote = {0};
+  if (!zygote_start(&zygote)) {
+    perror("zygote_start");
+    return 1;
+  }
+
+  char *path = "/bin/true";
+  char *args[] = {path, NULL};
+  char *envp[] = {NULL};
+
+  printf("%8s %14s %14s\n", "size MB", "fork us", "zygote us");
+  for (int mb = 0; mb <= max_mb; mb = mb == 0 ? 64 : mb * 2) {
+    // touched memory standing in for history, arenas and readline state
+    uint64_t size = (uint64_t)mb * MB;
+    char *ballast = size > 0 ? (char *)malloc(size) : NULL;
+    if (size > 0 && ballast == NULL) {
+      perror("malloc");
+      break;
+    }
+    for (uint64_t i = 0; i < size; i += 4 * KB) {
+      ballast[i] = (char)i;
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < iterations; i += 1) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        execve(path, args, envp);
+        _exit(127);
+      }
+      waitpid(pid, NULL, 0);
+    }
+    double direct = (now_ms() - start) * 1000.0 / iterations;
+
+    start = now_ms();
+    for (int i = 0; i < iterations; i += 1) {
+      int status = 0;
+      pid_t pid = zygote_spawn(&zygote, path, args, envp);
+      if (pid < 0 || !zygote_wait(&zygote, pid, &status)) {
+        fprintf(stderr, "zygote spawn failed\n");
+        return 1;
+      }
+    }
+    double served = (now_ms() - start) * 1000.0 / iterations;
+
+    printf("%8d %14.1f %14.1f\n", mb, direct, served);
+    free(ballast);
+  }
+
+  zygote_stop(&zygote);
+  return 0;
+}
@@ -0,0 +1,218 @@
+// Differential test of word evaluation against /bin/sh: every line of the
+// corpus is compiled as the arguments of a command by the shell's script
+// compiler and evaluated, both from the compiled image and from the image
+// loaded back from its cache file form, and by `sh -c 'set -- LINE'`, and
+// the resulting words are compared.
+//
+//   diff_parser [CORPUS]      defaults to fuzz/corpus/words.txt
+//
+// Lines starting with # are comments. Both sides see the same variables
+// and run in a directory with the same files for globs, and substitutions
+// run through sh on both sides. Exits with 1 when any line differs.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "parser.h"
+#include "script.h"
+#include "script_cache.h"
+#include "vars.h"
+
+#define DIFF_ARENA_SIZE (64 * MB)
+#define DIFF_OUTPUT_MAX (1 * MB)
+
+// Reads all of a command's output, NULL when it does not fit.
+internal char *diff_run(const char *command, uint64_t *size) {
+  FILE *p = popen(command, "r");
+  if (p == NULL) {
+    return NULL;
+  }
+  char *out = (char *)malloc(DIFF_OUTPUT_MAX);
+  *size = fread(out, 1, DIFF_OUTPUT_MAX, p);
+  pclose(p);
+  return out;
+}
+
+// Command substitution done by sh, trailing newlines removed as the shell
+// does.
+internal String diff_substitute(Arena *a, String text) {
+  char *command = (char *)arena_alloc(a, text.size + 1);
+  memcpy(command, text.str, text.size);
+  uint64_t size = 0;
+  char *out = diff_run(command, &size);
+  if (out == NULL) {
+    return (String){0};
+  }
+  for (; size > 0 && out[size - 1] == '\n'; size -= 1)
+    ;
+  String result = str_clone_from_cstring(a, out, size);
+  free(out);
+  return result;
+}
+
+// The reference words: sh prints each as "<length>:<bytes>".
+internal StringList diff_reference(Arena *a, const char *line) {
+  StringList result = {0};
+  uint64_t command_size = strlen(line) + 128;
+  char *command = (char *)arena_alloc(a, command_size);
+  snprintf(command, command_size,
+           "set -- %s\nfor w in \"$@\"; do printf '%%d:%%s' ${#w} \"$w\"; done",
+           line);
+
+  uint64_t size = 0;
+  char *out = diff_run(command, &size);
+  if (out == NULL) {
+    return result;
+  }
+  for (uint64_t i = 0; i < size;) {
+    char *colon = memchr(out + i, ':', size - i);
+    if (colon == NULL) {
+      break;
+    }
+    uint64_t length = strtoull(out + i, NULL, 10);
+    uint64_t start = colon + 1 - out;
+    if (start + length > size) {
+      break;
+    }
+    str_list_push(a, &result, str_clone_from_cstring(a, out + start, length));
+    i = start + length;
+  }
+  free(out);
+  return result;
+}
+
+// The words of the first command of image after "set --".
+internal StringList diff_words(Arena *a, ParseContext *ctx,
+                               ScriptImage *image) {
+  StringList words = {0};
+  if (image->command_count == 0) {
+    return words;
+  }
+  ScriptCommand *cmd = &image->commands[0];
+  for (uint32_t w = 2; w < cmd->word_count; w += 1) {
+    script_eval_word(a, ctx, image, &image->words[cmd->word_first + w],
+                     &words);
+  }
+  return words;
+}
+
+// The same words from image saved as a cache file and loaded back.
+internal StringList diff_cached_words(Arena *a, ParseContext *ctx,
+                                      ScriptImage *image) {
+  StringList words = {0};
+  char *bytes = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&bytes, &size);
+  bool saved = script_image_save(f, image);
+  fclose(f);
+  // a mapping is page aligned, malloc is aligned enough
+  ScriptImage loaded = {0};
+  if (saved && script_image_load((uint8_t *)bytes, size, &loaded)) {
+    words = diff_words(a, ctx, &loaded);
+    for (StringNode *w = words.first; w != NULL; w = w->next) {
+      w->string = str_clone_from_cstring(a, (char *)w->string.str,
+                                         w->string.size);
+    }
+  }
+  free(bytes);
+  return words;
+}
+
+internal bool diff_same(StringList *x, StringList *y) {
+  bool same = x->node_count == y->node_count;
+  StringNode *a = x->first;
+  StringNode *b = y->first;
+  for (; same && a != NULL; a = a->next, b = b->next) {
+    same = str_equal(a->string, b->string);
+  }
+  return same;
+}
+
+internal void diff_print_words(const char *label, StringList *words) {
+  printf("  %-4s", label);
+  for (StringNode *w = words->first; w != NULL; w = w->next) {
+    printf(" [%.*s]", (int)w->string.size, w->string.str);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *corpus_path = argc > 1 ? argv[1] : "fuzz/corpus/words.txt";
+  FILE *corpus = fopen(corpus_path, "r");
+  if (corpus == NULL) {
+    perror(corpus_path);
+    return 2;
+  }
+
+  // both sides see the same variables and files
+  setenv("LC_ALL", "C", 1);
+  setenv("A", "a", 1);
+  setenv("B", "two  words", 1);
+  setenv("E", "", 1);
+  setenv("G", "*.txt", 1);
+  char dir[] = "/tmp/diff_parser_XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror(dir);
+    return 2;
+  }
+  const char *names[] = {"a", "ab", "b c", "x.txt", "y.txt", "z.log"};
+  for (int i = 0; i < 6; i += 1) {
+    fclose(fopen(names[i], "w"));
+  }
+
+  Arena arena = {0};
+  arena_init(&arena, malloc(DIFF_ARENA_SIZE), DIFF_ARENA_SIZE);
+  ShellVars vars = {0};
+  extern char **environ;
+  vars_init(&vars, environ);
+  int status = 0;
+  ParseContext ctx = {
+      .vars = &vars,
+      .last_exit_status = &status,
+      .substitute = diff_substitute,
+  };
+
+  char line[4096];
+  uint64_t count = 0;
+  uint64_t failed = 0;
+  while (fgets(line, sizeof(line), corpus) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    arena_free_all(&arena);
+    count += 1;
+
+    // "set --" in front so the words are arguments, as they are for sh
+    String source = str_concat(&arena, str_init("set -- ", 7),
+                               str_init(line, strlen(line)));
+    ScriptBuilder builder = {0};
+    script_compile(&arena, &ctx, &builder, source);
+    StringList words = diff_words(&arena, &ctx, &builder.image);
+    StringList cached = diff_cached_words(&arena, &ctx, &builder.image);
+    StringList reference = diff_reference(&arena, line);
+
+    if (!diff_same(&words, &reference) || !diff_same(&cached, &reference)) {
+      failed += 1;
+      printf("%s\n", line);
+      diff_print_words("ours", &words);
+      diff_print_words("shc", &cached);
+      diff_print_words("sh", &reference);
+    }
+    script_builder_free(&builder);
+  }
+  fclose(corpus);
+
+  for (int i = 0; i < 6; i += 1) {
+    unlink(names[i]);
+  }
+  rmdir(dir);
+  printf("%lu lines, %lu differ\n", count, failed);
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+// Fuzz target for the command line parser and the script compiler:
+// lexing, compiling, evaluation of the compiled words and pipeline
+// building, with command substitution replaced by a stub so nothing runs.
+// Every compiled image also goes through the cache file format and is
+// loaded back, whole and with bytes of it changed, since a cache file is
+// as untrusted as the script. Inputs starting with the cache file magic
+// are loaded as an image directly.
+//
+// Built for libFuzzer with clang, where LLVMFuzzerTestOneInput is the
+// entry point. Elsewhere a standalone driver takes its place:
+//
+//   fuzz_parser FILE|DIR...    run each input, as for replaying crashes
+//   fuzz_parser -r N [SEED]    run N random inputs
+//   fuzz_parser < FILE         run one input from stdin, for AFL
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "parser.h"
+#include "script.h"
+#include "script_cache.h"
+#include "vars.h"
+
+#define FUZZ_INPUT_MAX (64 * KB)
+#define FUZZ_ARENA_SIZE (256 * MB)
+// bytes changed in each copy of a compiled image, and copies per input
+#define FUZZ_IMAGE_FLIPS 4
+#define FUZZ_IMAGE_COPIES 4
+
+global Arena fuzz_arena = {0};
+global ShellVars fuzz_vars = {0};
+global ParseContext fuzz_parse = {0};
+global int fuzz_status = 0;
+global FILE *fuzz_null = NULL;
+
+// Stands in for running the command: its text comes back as the output,
+// which is then split and globbed like real output would be.
+internal String fuzz_substitute(Arena *a, String text) {
+  (void)a;
+  return text;
+}
+
+internal bool fuzz_is_builtin(String name) {
+  return str_equal_cstr(name, "echo") || str_equal_cstr(name, "cd");
+}
+
+// Evaluated words live in the arena, literal ones in the image's pool.
+internal bool fuzz_in_memory(ScriptImage *image, String s) {
+  uint8_t *end = fuzz_arena.buf + fuzz_arena.buf_size;
+  uint8_t *pool_end = image->pool + image->pool_size;
+  return s.size == 0 || (s.str >= fuzz_arena.buf && s.str + s.size <= end) ||
+         (s.str >= image->pool && s.str + s.size <= pool_end);
+}
+
+// Variables with spaces and glob characters in them, and a directory with
+// a few files for globs to match, the same on every run.
+internal void fuzz_init(void) {
+  arena_init(&fuzz_arena, malloc(FUZZ_ARENA_SIZE), FUZZ_ARENA_SIZE);
+  fuzz_null = fopen("/dev/null", "w");
+
+  char *env[] = {"A=a", "B=two words", "E=", "G=*", "Q='\"", "PATH=/bin",
+                 NULL};
+  vars_init(&fuzz_vars, env);
+  fuzz_parse = (ParseContext){
+      .vars = &fuzz_vars,
+      .last_exit_status = &fuzz_status,
+      .is_builtin = fuzz_is_builtin,
+      .substitute = fuzz_substitute,
+  };
+
+  char dir[] = "/tmp/fuzz_parser_XXXXXX";
+  if (mkdtemp(dir) != NULL && chdir(dir) == 0) {
+    const char *names[] = {"a", "ab", "b c", "*", "x.txt", "y.log"};
+    for (int i = 0; i < 6; i += 1) {
+      fclose(fopen(names[i], "w"));
+    }
+  }
+}
+
+// Builds every pipeline and evaluates every other word of image, as
+// running it would. compiled is false for an image loaded from changed
+// bytes, whose assignments can be any word.
+internal void fuzz_check_image(ScriptImage *image, bool compiled) {
+  for (uint32_t p = 0; p < image->pipeline_count; p += 1) {
+    TempArenaMemory temp = temp_arena_memory_begin(&fuzz_arena);
+    PipedShellCommandList list = script_build_pipeline(
+        &fuzz_arena, &fuzz_parse, image, &image->pipelines[p]);
+
+    uint64_t count = 0;
+    for (PipedShellCommandNode *node = list.first; node != NULL;
+         node = node->next, count += 1) {
+      ShellCommand *cmd = &node->cmd;
+      assert(cmd->args.count <= cmd->args.capacity);
+      assert(cmd->args.count == 0 || str_equal(cmd->exe, cmd->args.items[0]));
+      for (uint64_t i = 0; i < cmd->args.count; i += 1) {
+        assert(fuzz_in_memory(image, cmd->args.items[i]));
+      }
+      for (uint64_t i = 0; compiled && i < cmd->assigns.count; i += 1) {
+        assert(is_assignment_word(cmd->assigns.items[i]));
+      }
+      RedirectInfo *redir = &cmd->redir_info;
+      assert(redir->source_fd >= 0 && redir->source_fd <= 9);
+      assert(!redir->dup || (redir->dup_fd >= -1 && redir->dup_fd <= 9));
+    }
+    assert(count == list.node_count);
+    assert(count == image->pipelines[p].command_count);
+    temp_arena_memory_end(temp);
+  }
+
+  for (uint32_t n = 0; n < image->node_count; n += 1) {
+    TempArenaMemory temp = temp_arena_memory_begin(&fuzz_arena);
+    ScriptNode *node = &image->nodes[n];
+    RedirectInfo redir = script_eval_redirect(
+        &fuzz_arena, &fuzz_parse, image, node->redir_word, node->redir_fd,
+        node->redir_flag, node->redir_dup);
+    assert(redir.source_fd >= 0 && redir.source_fd <= 9);
+    if (node->kind == SCRIPT_NODE_FOR) {
+      StringList items = {0};
+      for (uint32_t w = 0; w < node->word_count; w += 1) {
+        script_eval_word(&fuzz_arena, &fuzz_parse, image,
+                         &image->words[node->word_first + w], &items);
+      }
+      assert(script_string(image, node->arg).size > 0 || !compiled);
+    }
+    temp_arena_memory_end(temp);
+  }
+}
+
+// Loads size bytes as a cache file, from a copy aligned as a mapping is.
+internal void fuzz_load_image(const uint8_t *data, size_t size) {
+  uint64_t *copy = (uint64_t *)malloc(size / 8 * 8 + 8);
+  memcpy(copy, data, size);
+  ScriptImage image = {0};
+  if (script_image_load((uint8_t *)copy, size, &image)) {
+    fuzz_check_image(&image, false);
+  }
+  free(copy);
+}
+
+// The compiled image saved as a cache file must load back as it was, and a
+// copy with a few bytes changed must load or be rejected, never more.
+internal void fuzz_round_trip(ScriptImage *image, uint64_t seed) {
+  char *bytes = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&bytes, &size);
+  bool saved = script_image_save(f, image);
+  fclose(f);
+  assert(saved);
+
+  ScriptImage loaded = {0};
+  uint64_t *copy = (uint64_t *)malloc(size / 8 * 8 + 8);
+  memcpy(copy, bytes, size);
+  assert(script_image_load((uint8_t *)copy, size, &loaded));
+  assert(loaded.node_count == image->node_count &&
+         loaded.word_count == image->word_count &&
+         loaded.root == image->root);
+  free(copy);
+
+  for (int c = 0; c < FUZZ_IMAGE_COPIES && size > 0; c += 1) {
+    for (int i = 0; i < FUZZ_IMAGE_FLIPS; i += 1) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      bytes[(seed >> 33) % size] ^= (uint8_t)(seed >> 56) | 1;
+    }
+    fuzz_load_image((uint8_t *)bytes, size);
+  }
+  free(bytes);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (fuzz_arena.buf == NULL) {
+    fuzz_init();
+  }
+  if (size > FUZZ_INPUT_MAX) {
+    return 0;
+  }
+  arena_free_all(&fuzz_arena);
+
+  if (size >= 8 && memcmp(data, SCRIPT_CACHE_MAGIC, 8) == 0) {
+    fuzz_load_image(data, size);
+    return 0;
+  }
+
+  char *line = (char *)arena_alloc(&fuzz_arena, size + 1);
+  memcpy(line, data, size);
+  line[size] = '\0';
+
+  // the memo of unterminated $( must agree with scanning each one
+  String text = str_init(line, size);
+  SubstEnds ends = {.s = text};
+  for (uint64_t i = 0; i < size; i += 1) {
+    if (is_subst_start(text, i)) {
+      assert(subst_end_cached(&fuzz_arena, &ends, i) == subst_end(text, i));
+    }
+  }
+
+  // syntax errors are expected, keep them out of the output
+  FILE *err = stderr;
+  stderr = fuzz_null;
+  ScriptBuilder builder = {0};
+  int result = script_compile(&fuzz_arena, &fuzz_parse, &builder, text);
+  stderr = err;
+
+  assert(result == SCRIPT_COMPILE_OK || result == SCRIPT_COMPILE_INCOMPLETE ||
+         result == SCRIPT_COMPILE_ERROR);
+  if (result == SCRIPT_COMPILE_OK) {
+    assert(script_image_validate(&builder.image));
+    fuzz_check_image(&builder.image, true);
+    fuzz_round_trip(&builder.image, str_hash(text));
+  }
+  script_builder_free(&builder);
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+internal void fuzz_run_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  local_persist uint8_t buf[FUZZ_INPUT_MAX];
+  size_t size = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  LLVMFuzzerTestOneInput(buf, size);
+}
+
+internal uint64_t fuzz_run_path(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fuzz_run_file(path);
+    return 1;
+  }
+
+  uint64_t count = 0;
+  DIR *dir = opendir(path);
+  for (struct dirent *entry; dir != NULL && (entry = readdir(dir)) != NULL;) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char child[PATH_MAX_LEN];
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    count += fuzz_run_path(child);
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  return count;
+}
+
+// Random scripts made of the pieces the parser and the compiler treat
+// specially.
+internal uint64_t fuzz_run_random(uint64_t n, unsigned seed) {
+  const char *pieces[] = {
+      " ",  "\t", "'",   "\"", "\\", "$",  "${", "}",  "$(", ")",   "`",
+      "|",  ";",  ">",   ">>", "2>", "1>", "*",  "?",  "[",  "]",   "[!",
+      "a",  "bc", "=",   "X=", "$A", "$B", "$G", "$?", "$$", "$Q", "${B}",
+      "-",  "<",  "3>",  ">&", ">&3", "2>&-", "<&",
+      "\n", "for", "in", "do", "done", "while", "until", "if", "then",
+      "elif", "else", "fi", "break", "continue", "2", "#",
+  };
+  uint64_t piece_count = sizeof(pieces) / sizeof(pieces[0]);
+  local_persist uint8_t buf[FUZZ_INPUT_MAX];
+
+  srand(seed);
+  for (uint64_t i = 0; i < n; i += 1) {
+    size_t size = 0;
+    int length = rand() % 64;
+    for (int p = 0; p < length; p += 1) {
+      const char *piece = pieces[rand() % piece_count];
+      size_t piece_size = strlen(piece);
+      memcpy(buf + size, piece, piece_size);
+      size += piece_size;
+    }
+    LLVMFuzzerTestOneInput(buf, size);
+  }
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  uint64_t count = 0;
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    unsigned seed = argc > 3 ? (unsigned)atoi(argv[3]) : (unsigned)time(NULL);
+    printf("seed %u\n", seed);
+    count = fuzz_run_random(strtoull(argv[2], NULL, 10), seed);
+  } else if (argc > 1) {
+    for (int i = 1; i < argc; i += 1) {
+      count += fuzz_run_path(argv[i]);
+    }
+  } else {
+    local_persist uint8_t buf[FUZZ_INPUT_MAX];
+    size_t size = fread(buf, 1, sizeof(buf), stdin);
+    LLVMFuzzerTestOneInput(buf, size);
+    count = 1;
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%lu inputs in %.2f s\n", count, seconds);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,179 @@
+// Worst case inputs for the command line parser: deep quoting, long escape
+// runs, unterminated expansions, compound commands nested past
+// SCRIPT_DEPTH_MAX, where compiling stops with an error. Each shape is
+// compiled and its pipelines built, which evaluates every word, at doubling
+// sizes and flagged when the time grows faster than the input.
+//
+//   gen_parser_worst [-o DIR] [max_size]
+//
+// With -o the largest input of every shape is also written to DIR, as
+// seeds for fuzz_parser. Exits with 1 when any shape looks superlinear.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "parser.h"
+#include "script.h"
+#include "script_cache.h"
+#include "vars.h"
+
+#define WORST_ARENA_SIZE (1024 * MB)
+// doubling the input may cost this much more before it counts as
+// superlinear, which leaves room for timer noise on a linear parse
+#define WORST_RATIO_LIMIT 3.0
+// a shape stops growing once a parse takes this long
+#define WORST_TIME_LIMIT_MS 2000.0
+
+typedef struct WorstShape WorstShape;
+struct WorstShape {
+  const char *name;
+  const char *prefix;
+  const char *repeat;
+  const char *suffix;
+};
+
+global WorstShape worst_shapes[] = {
+    {"words", "", "a ", ""},
+    {"alternating quotes", "", "'a'\"b\"", ""},
+    {"escaped backslashes", "", "\\\\", ""},
+    {"escaped spaces", "", "a\\ ", ""},
+    {"escaped quotes in quotes", "\"", "\\\"", "\""},
+    {"variables", "", "$A", ""},
+    {"quoted variables", "\"", "$A${A}", "\""},
+    {"long variable name", "$", "a", ""},
+    {"unterminated ${", "", "${", ""},
+    {"unterminated $(", "", "$(", ""},
+    {"unterminated backtick", "`", "\\`", ""},
+    {"nested $(", "", "$(", ")"},
+    {"nested while", "", "while a; do ", "a; done; "},
+    {"nested if", "", "if a; then ", "a; fi; "},
+    {"glob brackets", "", "[a", ""},
+    {"pipes", "", "a | ", "a"},
+    {"separators", "", "a;", ""},
+};
+
+// prefix, repeat until the size is reached, suffix. The nested shapes
+// repeat their suffix as often as their opening so every level is closed.
+internal char *worst_build(WorstShape *shape, uint64_t size, bool nested) {
+  uint64_t repeat_size = strlen(shape->repeat);
+  uint64_t suffix_size = strlen(shape->suffix);
+  uint64_t count = size / (repeat_size + (nested ? suffix_size : 0));
+
+  char *line = (char *)malloc(size + strlen(shape->prefix) + suffix_size + 1);
+  char *p = stpcpy(line, shape->prefix);
+  for (uint64_t i = 0; i < count; i += 1) {
+    p = stpcpy(p, shape->repeat);
+  }
+  for (uint64_t i = 0; i < (nested ? count : 1); i += 1) {
+    p = stpcpy(p, shape->suffix);
+  }
+  return line;
+}
+
+// What running line would parse: compiling it and building its pipelines.
+internal void worst_parse(Arena *a, ParseContext *ctx, char *line) {
+  ScriptBuilder builder = {0};
+  String source = str_init(line, strlen(line));
+  if (script_compile(a, ctx, &builder, source) == SCRIPT_COMPILE_OK) {
+    ScriptImage *image = &builder.image;
+    for (uint32_t p = 0; p < image->pipeline_count; p += 1) {
+      script_build_pipeline(a, ctx, image, &image->pipelines[p]);
+    }
+  }
+  script_builder_free(&builder);
+}
+
+int main(int argc, char *argv[]) {
+  const char *out_dir = NULL;
+  int arg = 1;
+  if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+    out_dir = argv[2];
+    arg = 3;
+  }
+  uint64_t max_size = argc > arg ? strtoull(argv[arg], NULL, 10) : 1 * MB;
+
+  Arena arena = {0};
+  arena_init(&arena, malloc(WORST_ARENA_SIZE), WORST_ARENA_SIZE);
+  ShellVars vars = {0};
+  char *env[] = {"A=a", NULL};
+  vars_init(&vars, env);
+  // substitutions are left out, only the parser is timed, and globs run
+  // in an empty directory
+  ParseContext ctx = {.vars = &vars};
+  // the nested shapes end in a syntax error every time, left unprinted
+  FILE *null = fopen("/dev/null", "w");
+  FILE *err = stderr;
+  char dir[] = "/tmp/gen_parser_worst_XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror(dir);
+    return 1;
+  }
+
+  bool flagged = false;
+  uint64_t shape_count = sizeof(worst_shapes) / sizeof(worst_shapes[0]);
+  for (uint64_t s = 0; s < shape_count; s += 1) {
+    WorstShape *shape = &worst_shapes[s];
+    bool nested = strncmp(shape->name, "nested ", 7) == 0;
+    double prev_ms = 0;
+    double worst_ratio = 0;
+    uint64_t size = 1 * KB;
+    char *line = NULL;
+
+    printf("%-26s", shape->name);
+    for (; size <= max_size; size *= 2) {
+      free(line);
+      line = worst_build(shape, size, nested);
+
+      // best of three
+      double best = 0;
+      for (int r = 0; r < 3; r += 1) {
+        arena_free_all(&arena);
+        stderr = null != NULL ? null : err;
+        double start = now_ms();
+        worst_parse(&arena, &ctx, line);
+        double ms = now_ms() - start;
+        stderr = err;
+        best = r == 0 || ms < best ? ms : best;
+      }
+
+      // too fast to time reliably below 0.05 ms
+      if (prev_ms > 0.05) {
+        double ratio = best / prev_ms;
+        worst_ratio = ratio > worst_ratio ? ratio : worst_ratio;
+      }
+      prev_ms = best;
+      if (best > WORST_TIME_LIMIT_MS) {
+        break;
+      }
+    }
+
+    bool superlinear = worst_ratio > WORST_RATIO_LIMIT;
+    flagged = flagged || superlinear;
+    printf(" %8lu bytes %10.2f ms  x%.1f per doubling%s\n", strlen(line),
+           prev_ms, worst_ratio, superlinear ? "  SUPERLINEAR" : "");
+
+    if (out_dir != NULL) {
+      char path[PATH_MAX_LEN];
+      snprintf(path, sizeof(path), "%s/worst-%02lu", out_dir, s);
+      FILE *f = fopen(path, "w");
+      if (f != NULL) {
+        fputs(line, f);
+        fclose(f);
+      }
+    }
+    free(line);
+  }
+
+  if (null != NULL) {
+    fclose(null);
+  }
+  free(arena.buf);
+  rmdir(dir);
+  return flagged ? 1 : 0;
+}
@@ -12,6 +12,18 @@
 #define DEFAULT_ALIGNMENT (2 * sizeof(void *))
 #endif
 
+#ifdef ARENA_STATS
+// Allocation counters, compiled in with ARENA_STATS. Like high_water they
+// survive resets, so they add up over the whole session.
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats {
+  uint64_t allocs;
+  uint64_t padding;   // bytes skipped to align allocations
+  uint64_t abandoned; // bytes left behind by resizes that had to move
+  uint64_t failures;  // allocations that did not fit
+};
+#endif
+
 // Arena
 typedef struct Arena Arena;
 struct Arena {
@@ -19,6 +31,10 @@ struct Arena {
   size_t buf_size;
   size_t prev_offset;
   size_t curr_offset;
+  size_t high_water; // largest curr_offset ever reached, survives resets
+#ifdef ARENA_STATS
+  ArenaStats stats;
+#endif
 };
 
 // align will be 2's power
@@ -41,6 +57,16 @@ internal void arena_init(Arena *a, void *backing_buffer,
   a->buf_size = backing_buffer_size;
   a->curr_offset = 0;
   a->prev_offset = 0;
+  a->high_water = 0;
+#ifdef ARENA_STATS
+  a->stats = (ArenaStats){0};
+#endif
+}
+
+internal void arena_note_high_water(Arena *a) {
+  if (a->curr_offset > a->high_water) {
+    a->high_water = a->curr_offset;
+  }
 }
 
 internal void *arena_alloc_align(Arena *a, size_t size, size_t align) {
@@ -49,13 +75,21 @@ internal void *arena_alloc_align(Arena *a, size_t size, size_t align) {
   uintptr_t aligned_offset = aligned_ptr - (uintptr_t)a->buf;
 
   if (aligned_offset + size <= a->buf_size) {
+#ifdef ARENA_STATS
+    a->stats.allocs += 1;
+    a->stats.padding += aligned_offset - a->curr_offset;
+#endif
     a->prev_offset = aligned_offset;
     a->curr_offset = aligned_offset + size;
+    arena_note_high_water(a);
 
     // Zero memory
     memset((void *)aligned_ptr, 0, size);
     return (void *)aligned_ptr;
   }
+#ifdef ARENA_STATS
+  a->stats.failures += 1;
+#endif
   return NULL;
 }
 
@@ -63,6 +97,50 @@ internal void *arena_alloc(Arena *a, size_t size) {
   return arena_alloc_align(a, size, DEFAULT_ALIGNMENT);
 }
 
+// Grows or shrinks old_memory in place when it is the last allocation,
+// otherwise moves it to a new allocation. The old contents are kept and any
+// new space is zeroed.
+internal void *arena_resize_align(Arena *a, void *old_memory, size_t old_size,
+                                  size_t new_size, size_t align) {
+  uint8_t *old_mem = (uint8_t *)old_memory;
+
+  assert((align & (align - 1)) == 0);
+
+  if (old_mem == NULL || old_size == 0) {
+    return arena_alloc_align(a, new_size, align);
+  }
+
+  assert(a->buf <= old_mem && old_mem < a->buf + a->buf_size);
+  if (a->buf + a->prev_offset == old_mem) {
+    if (a->prev_offset + new_size > a->buf_size) {
+      return NULL;
+    }
+    a->curr_offset = a->prev_offset + new_size;
+    arena_note_high_water(a);
+    if (new_size > old_size) {
+      memset(&a->buf[a->prev_offset + old_size], 0, new_size - old_size);
+    }
+    return old_memory;
+  }
+
+  void *new_memory = arena_alloc_align(a, new_size, align);
+#ifdef ARENA_STATS
+  if (new_memory != NULL) {
+    a->stats.abandoned += old_size;
+  }
+#endif
+  if (new_memory != NULL) {
+    memmove(new_memory, old_memory, old_size < new_size ? old_size : new_size);
+  }
+  return new_memory;
+}
+
+internal void *arena_resize(Arena *a, void *old_memory, size_t old_size,
+                            size_t new_size) {
+  return arena_resize_align(a, old_memory, old_size, new_size,
+                            DEFAULT_ALIGNMENT);
+}
+
 internal void arena_free_all(Arena *a) {
   a->curr_offset = 0;
   a->prev_offset = 0;
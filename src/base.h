@@ -1,6 +1,8 @@
 #ifndef CODECRAFTER_BASE_H
 #define CODECRAFTER_BASE_H
 
+#include <time.h>
+
 #define global static
 #define local_persist static
 #define internal static
@@ -9,8 +11,17 @@
 #define MB (1024 * KB)
 #define PATH_MAX_LEN 4096
 
+#define ArrayCount(a) (sizeof(a) / sizeof((a)[0]))
+
 #define SINGLE_QUOTE '\''
 #define DOUBLE_QUOTE '"'
 #define BACKSLASH '\\'
 
+// Monotonic time in milliseconds, for measuring how long something took.
+internal double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 #endif
@@ -1,6 +1,7 @@
 #ifndef CODECRAFTER_STRING_H
 #define CODECRAFTER_STRING_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,14 +36,14 @@ struct StringArray {
   uint64_t capacity;
 };
 
+// Grows in place while the array is the arena's last allocation, otherwise
+// the old items are left behind in the arena.
 internal void str_array_push(Arena *a, StringArray *arr, String str) {
   if (arr->count >= arr->capacity) {
     uint64_t new_cap = arr->capacity == 0 ? 8 : arr->capacity * 2;
-    String *new_items = (String *)arena_alloc(a, sizeof(String) * new_cap);
-    if (arr->items) {
-      memcpy(new_items, arr->items, sizeof(String) * arr->count);
-    }
-    arr->items = new_items;
+    arr->items = (String *)arena_resize(a, arr->items,
+                                        sizeof(String) * arr->capacity,
+                                        sizeof(String) * new_cap);
     arr->capacity = new_cap;
   }
   arr->items[arr->count++] = str;
@@ -83,6 +84,30 @@ internal bool str_equal(String a, String b) {
   return equal;
 }
 
+// FNV-1a
+internal uint64_t str_hash(String s) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint64_t i = 0; i < s.size; i += 1) {
+    hash ^= s.str[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// memcmp ordering, a proper prefix sorts first
+internal int str_compare(String a, String b) {
+  uint64_t size = a.size < b.size ? a.size : b.size;
+  int cmp = size > 0 ? memcmp(a.str, b.str, size) : 0;
+  if (cmp != 0) {
+    return cmp;
+  }
+  return a.size < b.size ? -1 : (a.size > b.size ? 1 : 0);
+}
+
+internal int str_compare_qsort(const void *a, const void *b) {
+  return str_compare(*(const String *)a, *(const String *)b);
+}
+
 internal bool str_is_posnum(String s) {
   bool result = true;
   for (int i = 0; i < s.size; i += 1) {
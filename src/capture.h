@@ -0,0 +1,94 @@
+#ifndef CODECRAFTER_CAPTURE_H
+#define CODECRAFTER_CAPTURE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+
+#define CAPTURE_INITIAL_CAPACITY (4 * KB)
+#define CAPTURE_READ_SIZE (64 * KB)
+
+// Output collected into one growable buffer in an arena. While the buffer
+// is the last allocation it grows in place.
+typedef struct ArenaStream ArenaStream;
+struct ArenaStream {
+  Arena *arena;
+  uint8_t *buf;
+  uint64_t size;
+  uint64_t capacity;
+};
+
+internal bool arena_stream_reserve(ArenaStream *s, uint64_t extra) {
+  if (s->size + extra <= s->capacity) {
+    return true;
+  }
+
+  uint64_t capacity =
+      s->capacity == 0 ? CAPTURE_INITIAL_CAPACITY : s->capacity * 2;
+  for (; capacity < s->size + extra; capacity *= 2)
+    ;
+  uint8_t *buf =
+      (uint8_t *)arena_resize(s->arena, s->buf, s->capacity, capacity);
+  if (buf == NULL) {
+    return false;
+  }
+  s->buf = buf;
+  s->capacity = capacity;
+  return true;
+}
+
+internal ssize_t arena_stream_write(void *cookie, const char *data,
+                                    size_t size) {
+  ArenaStream *s = (ArenaStream *)cookie;
+  if (!arena_stream_reserve(s, size)) {
+    errno = ENOSPC;
+    return -1;
+  }
+  memcpy(s->buf + s->size, data, size);
+  s->size += size;
+  return (ssize_t)size;
+}
+
+// A write-only FILE appending to s, for code that prints through stdio.
+internal FILE *arena_stream_open(ArenaStream *s) {
+  cookie_io_functions_t io = {.write = arena_stream_write};
+  return fopencookie(s, "w", io);
+}
+
+// Reads fd until end of file straight into the buffer, at least
+// CAPTURE_READ_SIZE bytes at a time.
+internal bool arena_stream_read_fd(ArenaStream *s, int fd) {
+  for (;;) {
+    if (!arena_stream_reserve(s, CAPTURE_READ_SIZE)) {
+      return false;
+    }
+    ssize_t n = read(fd, s->buf + s->size, s->capacity - s->size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    s->size += n;
+  }
+}
+
+// The captured text, without trailing newlines as command substitution
+// wants it.
+internal String arena_stream_trimmed(ArenaStream *s) {
+  uint64_t size = s->size;
+  for (; size > 0 && s->buf[size - 1] == '\n'; size -= 1)
+    ;
+  String result = {.str = s->buf, .size = size};
+  return result;
+}
+
+#endif
@@ -0,0 +1,810 @@
+#ifndef CODECRAFTER_CMD_INDEX_H
+#define CODECRAFTER_CMD_INDEX_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "cmd_snapshot.h"
+#include "intern.h"
+
+// Number of ranked candidates cached at every trie node. Completion returns
+// these first, so a lookup costs O(prefix + k) before falling back to the
+// alphabetical walk of the remaining matches.
+#define CMD_RANK_TOP_K 8
+#define CMD_NAME_MAX_LEN 256
+#define CMD_DIR_NONE UINT32_MAX
+
+#define CMD_INDEX_SCAN_THREADS 8
+
+#define CMD_INDEX_TRIE_SIZE (32 * MB)
+#define CMD_INDEX_RANK_SIZE (256 * KB)
+// Power of two, at least twice the ranks that fit in CMD_INDEX_RANK_SIZE.
+#define CMD_INDEX_RANK_SLOTS 16384
+#define CMD_INDEX_SCRATCH_SIZE (4 * MB)
+
+// Usage statistics for one command, kept for the whole session and persisted
+// between sessions.
+typedef struct CmdRank CmdRank;
+struct CmdRank {
+  String name;
+  uint64_t count;
+  uint64_t last_used;
+  CmdRank *next;
+  uint64_t pending; // uses counted while no trie knew the name, part of count
+};
+
+typedef struct CmdTrieNode CmdTrieNode;
+struct CmdTrieNode {
+  CmdTrieNode *first_child; // sorted by ch
+  CmdTrieNode *next_sibling;
+  CmdRank **top; // best ranked commands below this node, NULL if none
+  String name;   // interned, set on terminal nodes only
+  CmdRank *rank; // set once the command has been run
+  uint32_t dir;  // first PATH directory holding it, CMD_DIR_NONE if none
+  uint8_t top_count;
+  uint8_t ch;
+  bool terminal;
+};
+
+// One generation of the index. Two of them are kept so a new one can be
+// built in the background while completion keeps reading the current one.
+typedef struct CmdTrie CmdTrie;
+struct CmdTrie {
+  Arena arena;
+  CmdTrieNode *root;
+  uint64_t command_count;
+
+  // PATH directories (interned) and their mtimes seen by the build
+  String *dirs;
+  struct timespec *dir_mtimes;
+  uint64_t dir_count;
+};
+
+// Executables found in one PATH directory by a scan worker.
+typedef struct CmdDirScan CmdDirScan;
+struct CmdDirScan {
+  struct timespec mtime;
+  char *names; // NUL separated
+  uint64_t size;
+  uint64_t capacity;
+  bool borrowed; // names point into the snapshot mapping
+};
+
+typedef struct CmdIndexBuild CmdIndexBuild;
+struct CmdIndexBuild {
+  pthread_t thread;
+  bool running;
+  atomic_bool done;
+  atomic_uint_fast64_t next_dir;
+  CmdTrie *trie; // the spare generation being filled
+  InternTable *strings;
+  const char **builtins;
+  CmdDirScan *scans;
+  const char *snapshot_path;
+  CmdSnapshot snapshot;
+  atomic_bool rescanned;
+};
+
+typedef struct CmdIndex CmdIndex;
+struct CmdIndex {
+  CmdTrie tries[2];
+  CmdTrie *trie; // current generation, NULL until the first build finishes
+  CmdIndexBuild build;
+  InternTable *strings; // command names, shared by every generation
+
+  Arena rank_arena;    // usage counts, lives for the whole session
+  Arena scratch_arena; // matches for the completion in progress
+  CmdRank *ranks;
+  CmdRank **rank_slots; // ranks by name, open addressing
+};
+
+// snapshot_path is where PATH scans are cached between sessions, NULL to
+// always scan every directory.
+internal void cmd_index_init(CmdIndex *idx, InternTable *strings,
+                             const char *snapshot_path) {
+  *idx = (CmdIndex){0};
+  idx->strings = strings;
+  idx->build.strings = strings;
+  idx->build.snapshot_path = snapshot_path;
+  for (int i = 0; i < 2; i += 1) {
+    arena_init(&idx->tries[i].arena, malloc(CMD_INDEX_TRIE_SIZE),
+               CMD_INDEX_TRIE_SIZE);
+  }
+  arena_init(&idx->rank_arena, malloc(CMD_INDEX_RANK_SIZE),
+             CMD_INDEX_RANK_SIZE);
+  idx->rank_slots = (CmdRank **)calloc(CMD_INDEX_RANK_SLOTS, sizeof(CmdRank *));
+  arena_init(&idx->scratch_arena, malloc(CMD_INDEX_SCRATCH_SIZE),
+             CMD_INDEX_SCRATCH_SIZE);
+}
+
+// more uses first, ties broken by the most recent use
+internal bool cmd_rank_better(CmdRank *a, CmdRank *b) {
+  if (a->count != b->count) {
+    return a->count > b->count;
+  }
+  return a->last_used > b->last_used;
+}
+
+// Re-insert rank into the node's top list. Scores only ever grow, so moving
+// the updated entry towards the front keeps the list ordered.
+internal void cmd_trie_node_promote(Arena *a, CmdTrieNode *node,
+                                    CmdRank *rank) {
+  if (node->top == NULL) {
+    node->top = (CmdRank **)arena_alloc(a, sizeof(CmdRank *) * CMD_RANK_TOP_K);
+  }
+
+  int pos = -1;
+  for (int i = 0; i < node->top_count; i += 1) {
+    if (node->top[i] == rank) {
+      pos = i;
+      break;
+    }
+  }
+
+  if (pos < 0) {
+    if (node->top_count < CMD_RANK_TOP_K) {
+      pos = node->top_count;
+      node->top_count += 1;
+    } else if (cmd_rank_better(rank, node->top[CMD_RANK_TOP_K - 1])) {
+      pos = CMD_RANK_TOP_K - 1;
+    } else {
+      return;
+    }
+  }
+
+  for (; pos > 0 && cmd_rank_better(rank, node->top[pos - 1]); pos -= 1) {
+    node->top[pos] = node->top[pos - 1];
+  }
+  node->top[pos] = rank;
+}
+
+internal CmdTrieNode *cmd_trie_child(CmdTrieNode *node, uint8_t ch) {
+  CmdTrieNode *child = node->first_child;
+  for (; child != NULL && child->ch < ch; child = child->next_sibling)
+    ;
+  if (child != NULL && child->ch == ch) {
+    return child;
+  }
+  return NULL;
+}
+
+// dir is the index of name's directory in trie->dirs, CMD_DIR_NONE for a
+// builtin. The first insertion of a name wins, as in a PATH search.
+internal void cmd_trie_insert(CmdTrie *trie, InternTable *strings,
+                              String name, uint32_t dir) {
+  if (name.size == 0 || name.size >= CMD_NAME_MAX_LEN) {
+    return;
+  }
+
+  Arena *a = &trie->arena;
+  CmdTrieNode *node = trie->root;
+  for (uint64_t i = 0; i < name.size; i += 1) {
+    uint8_t ch = name.str[i];
+    CmdTrieNode **link = &node->first_child;
+    for (; *link != NULL && (*link)->ch < ch; link = &(*link)->next_sibling)
+      ;
+
+    if (*link == NULL || (*link)->ch != ch) {
+      CmdTrieNode *child = (CmdTrieNode *)arena_alloc(a, sizeof(CmdTrieNode));
+      child->ch = ch;
+      child->next_sibling = *link;
+      *link = child;
+    }
+    node = *link;
+  }
+
+  if (!node->terminal) {
+    node->terminal = true;
+    node->name = intern(strings, name);
+    node->dir = dir;
+    trie->command_count += 1;
+  }
+}
+
+// Walks name through the trie, filling path with every node visited (root
+// included). Returns the number of nodes on the path, 0 when name is not a
+// known command.
+internal int cmd_trie_find_path(CmdTrie *trie, String name,
+                                CmdTrieNode **path) {
+  if (trie == NULL || name.size == 0 || name.size >= CMD_NAME_MAX_LEN) {
+    return 0;
+  }
+
+  CmdTrieNode *node = trie->root;
+  path[0] = node;
+  for (uint64_t i = 0; i < name.size; i += 1) {
+    node = cmd_trie_child(node, name.str[i]);
+    if (node == NULL) {
+      return 0;
+    }
+    path[i + 1] = node;
+  }
+
+  return node->terminal ? (int)name.size + 1 : 0;
+}
+
+// Returns false when the trie does not know the command.
+internal bool cmd_trie_link_rank(CmdTrie *trie, CmdRank *rank) {
+  CmdTrieNode *path[CMD_NAME_MAX_LEN + 1];
+  int depth = cmd_trie_find_path(trie, rank->name, path);
+  if (depth == 0) {
+    return false;
+  }
+
+  path[depth - 1]->rank = rank;
+  if (rank->count > 0) {
+    for (int i = 0; i < depth; i += 1) {
+      cmd_trie_node_promote(&trie->arena, path[i], rank);
+    }
+  }
+  return true;
+}
+
+// The slot of the rank of name (interned), empty when it has none.
+internal CmdRank **cmd_index_rank_slot(CmdIndex *idx, String name) {
+  uint64_t mask = CMD_INDEX_RANK_SLOTS - 1;
+  for (uint64_t i = str_hash(name) & mask;; i = (i + 1) & mask) {
+    CmdRank **slot = &idx->rank_slots[i];
+    if (*slot == NULL || intern_equal((*slot)->name, name)) {
+      return slot;
+    }
+  }
+}
+
+internal int cmd_rank_compare_qsort(const void *a, const void *b) {
+  CmdRank *x = *(CmdRank *const *)a;
+  CmdRank *y = *(CmdRank *const *)b;
+  return cmd_rank_better(x, y) ? -1 : cmd_rank_better(y, x) ? 1 : 0;
+}
+
+internal void cmd_trie_unlink_ranks(CmdTrieNode *node) {
+  for (; node != NULL; node = node->next_sibling) {
+    node->rank = NULL;
+    node->top_count = 0;
+    cmd_trie_unlink_ranks(node->first_child);
+  }
+}
+
+// Makes room in a full rank arena by forgetting the less used half of the
+// commands. The rest are copied into the emptied arena and the current
+// generation is linked to the copies.
+internal void cmd_index_compact_ranks(CmdIndex *idx) {
+  uint64_t count = 0;
+  for (CmdRank *rank = idx->ranks; rank != NULL; rank = rank->next) {
+    count += 1;
+  }
+  CmdRank **sorted = (CmdRank **)malloc(sizeof(CmdRank *) * (count + 1));
+  CmdRank *kept = (CmdRank *)malloc(sizeof(CmdRank) * (count / 2 + 1));
+  uint64_t i = 0;
+  for (CmdRank *rank = idx->ranks; rank != NULL; rank = rank->next, i += 1) {
+    sorted[i] = rank;
+  }
+  qsort(sorted, count, sizeof(CmdRank *), cmd_rank_compare_qsort);
+  uint64_t kept_count = count / 2;
+  for (i = 0; i < kept_count; i += 1) {
+    kept[i] = *sorted[i];
+  }
+
+  arena_free_all(&idx->rank_arena);
+  memset(idx->rank_slots, 0, sizeof(CmdRank *) * CMD_INDEX_RANK_SLOTS);
+  idx->ranks = NULL;
+  if (idx->trie != NULL) {
+    cmd_trie_unlink_ranks(idx->trie->root);
+  }
+  // least used first, so the list keeps its most used at the front
+  for (i = kept_count; i > 0; i -= 1) {
+    CmdRank *rank =
+        (CmdRank *)arena_alloc(&idx->rank_arena, sizeof(CmdRank));
+    *rank = kept[i - 1];
+    rank->next = idx->ranks;
+    idx->ranks = rank;
+    *cmd_index_rank_slot(idx, rank->name) = rank;
+    if (idx->trie != NULL) {
+      cmd_trie_link_rank(idx->trie, rank);
+    }
+  }
+
+  free(sorted);
+  free(kept);
+}
+
+// Adds count uses of name, the last at last_used, to its rank, creating it
+// on first sight. A full rank arena is compacted first.
+internal CmdRank *cmd_index_add_rank(CmdIndex *idx, String name,
+                                     uint64_t count, uint64_t last_used) {
+  name = intern(idx->strings, name);
+  CmdRank **slot = cmd_index_rank_slot(idx, name);
+  if (*slot == NULL) {
+    CmdRank *rank = (CmdRank *)arena_alloc(&idx->rank_arena, sizeof(CmdRank));
+    if (rank == NULL) {
+      cmd_index_compact_ranks(idx);
+      slot = cmd_index_rank_slot(idx, name);
+      rank = (CmdRank *)arena_alloc(&idx->rank_arena, sizeof(CmdRank));
+      if (rank == NULL) {
+        return NULL;
+      }
+    }
+    rank->name = name;
+    rank->next = idx->ranks;
+    idx->ranks = rank;
+    *slot = rank;
+  }
+
+  CmdRank *rank = *slot;
+  rank->count += count;
+  if (last_used > rank->last_used) {
+    rank->last_used = last_used;
+  }
+  return rank;
+}
+
+internal struct timespec cmd_index_dir_mtime(const char *dirpath) {
+  struct stat st;
+  if (stat(dirpath, &st) == 0) {
+    return st.st_mtim;
+  }
+  return (struct timespec){0};
+}
+
+internal void cmd_dir_scan_push(CmdDirScan *scan, const char *name) {
+  uint64_t len = strlen(name) + 1;
+  if (scan->size + len > scan->capacity) {
+    scan->capacity = scan->capacity == 0 ? 4 * KB : scan->capacity;
+    for (; scan->size + len > scan->capacity; scan->capacity *= 2)
+      ;
+    scan->names = (char *)realloc(scan->names, scan->capacity);
+  }
+  memcpy(scan->names + scan->size, name, len);
+  scan->size += len;
+}
+
+// Collects the executables of one directory. The dirent type saves a stat
+// for regular files; only symlinks and unknown types need fstatat.
+internal void cmd_dir_scan(String dirpath, CmdDirScan *scan) {
+  char path[PATH_MAX_LEN];
+  snprintf(path, sizeof(path), "%.*s", (int)dirpath.size, dirpath.str);
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+
+  // take the mtime before reading so a concurrent change marks us stale
+  int dfd = dirfd(dir);
+  struct stat st;
+  if (fstat(dfd, &st) == 0) {
+    scan->mtime = st.st_mtim;
+  }
+
+  struct dirent *de = NULL;
+  while ((de = readdir(dir)) != NULL) {
+    bool regular = de->d_type == DT_REG;
+    if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+      regular = fstatat(dfd, de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode);
+    }
+
+    if (regular && faccessat(dfd, de->d_name, X_OK, 0) == 0) {
+      cmd_dir_scan_push(scan, de->d_name);
+    }
+  }
+
+  closedir(dir);
+}
+
+// Reuses the snapshot's names for a directory whose mtime is unchanged,
+// otherwise reads the directory.
+internal void cmd_index_scan_dir(CmdIndexBuild *build, uint64_t i) {
+  String dirpath = build->trie->dirs[i];
+  CmdDirScan *scan = &build->scans[i];
+
+  CmdSnapshotDir *cached = cmd_snapshot_find(&build->snapshot, dirpath);
+  if (cached != NULL) {
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%.*s", (int)dirpath.size, dirpath.str);
+    struct timespec mtime = cmd_index_dir_mtime(path);
+    if (mtime.tv_sec == cached->mtime_sec &&
+        mtime.tv_nsec == cached->mtime_nsec) {
+      scan->mtime = mtime;
+      scan->names = (char *)cmd_snapshot_names(&build->snapshot, cached);
+      scan->size = cached->names_size;
+      scan->borrowed = true;
+      return;
+    }
+  }
+
+  cmd_dir_scan(dirpath, scan);
+  atomic_store(&build->rescanned, true);
+}
+
+internal void *cmd_index_scan_worker(void *arg) {
+  CmdIndexBuild *build = (CmdIndexBuild *)arg;
+  for (;;) {
+    uint64_t i = atomic_fetch_add(&build->next_dir, 1);
+    if (i >= build->trie->dir_count) {
+      break;
+    }
+    cmd_index_scan_dir(build, i);
+  }
+  return NULL;
+}
+
+internal void cmd_index_save_snapshot(CmdIndexBuild *build) {
+  CmdTrie *trie = build->trie;
+  CmdSnapshotEntry *entries =
+      (CmdSnapshotEntry *)calloc(trie->dir_count + 1, sizeof(CmdSnapshotEntry));
+  for (uint64_t i = 0; i < trie->dir_count; i += 1) {
+    entries[i] = (CmdSnapshotEntry){
+        .path = trie->dirs[i],
+        .mtime = build->scans[i].mtime,
+        .names = build->scans[i].names,
+        .names_size = build->scans[i].size,
+    };
+  }
+  cmd_snapshot_write(build->snapshot_path, entries, trie->dir_count);
+  free(entries);
+}
+
+// Scans every PATH directory on a small pool of workers, one task per
+// directory, then merges the results into the spare trie in PATH order.
+internal void *cmd_index_build_main(void *arg) {
+  CmdIndexBuild *build = (CmdIndexBuild *)arg;
+  CmdTrie *trie = build->trie;
+
+  if (build->snapshot_path != NULL) {
+    cmd_snapshot_open(build->snapshot_path, &build->snapshot);
+  }
+
+  uint64_t n_workers = trie->dir_count;
+  if (n_workers > CMD_INDEX_SCAN_THREADS) {
+    n_workers = CMD_INDEX_SCAN_THREADS;
+  }
+
+  pthread_t workers[CMD_INDEX_SCAN_THREADS];
+  uint64_t started = 0;
+  for (; started < n_workers; started += 1) {
+    if (pthread_create(&workers[started], NULL, cmd_index_scan_worker,
+                       build) != 0) {
+      break;
+    }
+  }
+  // no thread could be started, scan on this one
+  if (started == 0) {
+    cmd_index_scan_worker(build);
+  }
+  for (uint64_t i = 0; i < started; i += 1) {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (int i = 0; build->builtins[i] != NULL; i += 1) {
+    const char *name = build->builtins[i];
+    cmd_trie_insert(trie, build->strings, str_init(name, strlen(name)),
+                    CMD_DIR_NONE);
+  }
+  for (uint64_t i = 0; i < trie->dir_count; i += 1) {
+    CmdDirScan *scan = &build->scans[i];
+    trie->dir_mtimes[i] = scan->mtime;
+    for (uint64_t off = 0; off < scan->size;) {
+      String name = str_init(scan->names + off, strlen(scan->names + off));
+      cmd_trie_insert(trie, build->strings, name, (uint32_t)i);
+      off += name.size + 1;
+    }
+  }
+
+  // only write when something had to be read from disk
+  if (build->snapshot_path != NULL &&
+      (atomic_load(&build->rescanned) ||
+       build->snapshot.dir_count != trie->dir_count)) {
+    cmd_index_save_snapshot(build);
+  }
+
+  for (uint64_t i = 0; i < trie->dir_count; i += 1) {
+    if (!build->scans[i].borrowed) {
+      free(build->scans[i].names);
+    }
+  }
+  free(build->scans);
+  cmd_snapshot_close(&build->snapshot);
+
+  atomic_store(&build->done, true);
+  return NULL;
+}
+
+// Makes the finished build current and re-attaches usage counts to it.
+// Uses counted while it was running are kept for the commands it found and
+// taken back for the others, as cmd_index_record would have ignored them.
+internal void cmd_index_adopt(CmdIndex *idx) {
+  CmdIndexBuild *build = &idx->build;
+  build->running = false;
+  idx->trie = build->trie;
+
+  for (CmdRank *rank = idx->ranks; rank != NULL; rank = rank->next) {
+    bool known = cmd_trie_link_rank(idx->trie, rank);
+    if (!known) {
+      rank->count -= rank->pending;
+    }
+    rank->pending = 0;
+  }
+}
+
+// Starts building a new generation from the current PATH in the background.
+// Does nothing if a build is already running. The directories of
+// env_path_list must be interned, the build keeps them.
+internal void cmd_index_rebuild(CmdIndex *idx, const char **builtins,
+                                StringList *env_path_list) {
+  assert(env_path_list != NULL);
+
+  CmdIndexBuild *build = &idx->build;
+  if (build->running) {
+    return;
+  }
+
+  CmdTrie *trie = idx->trie == &idx->tries[0] ? &idx->tries[1] : &idx->tries[0];
+  Arena *a = &trie->arena;
+  arena_free_all(a);
+  trie->root = (CmdTrieNode *)arena_alloc(a, sizeof(CmdTrieNode));
+  trie->command_count = 0;
+  trie->dir_count = env_path_list->node_count;
+  trie->dirs = (String *)arena_alloc(a, sizeof(String) * (trie->dir_count + 1));
+  trie->dir_mtimes = (struct timespec *)arena_alloc(
+      a, sizeof(struct timespec) * (trie->dir_count + 1));
+
+  uint64_t i = 0;
+  for (StringNode *ptr = env_path_list->first; ptr != NULL;
+       ptr = ptr->next, i += 1) {
+    trie->dirs[i] = ptr->string;
+  }
+
+  build->trie = trie;
+  build->builtins = builtins;
+  build->scans =
+      (CmdDirScan *)calloc(trie->dir_count + 1, sizeof(CmdDirScan));
+  atomic_store(&build->next_dir, 0);
+  atomic_store(&build->done, false);
+  atomic_store(&build->rescanned, false);
+
+  // signals stay with the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  build->running =
+      pthread_create(&build->thread, NULL, cmd_index_build_main, build) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (!build->running) {
+    cmd_index_build_main(build);
+    cmd_index_adopt(idx);
+  }
+}
+
+// Switches to a finished build without blocking. Returns true if it did.
+internal bool cmd_index_poll(CmdIndex *idx) {
+  if (idx->build.running && atomic_load(&idx->build.done)) {
+    pthread_join(idx->build.thread, NULL);
+    cmd_index_adopt(idx);
+    return true;
+  }
+  return false;
+}
+
+// Waits for a running build, for callers that need the complete index.
+internal void cmd_index_wait(CmdIndex *idx) {
+  if (idx->build.running) {
+    pthread_join(idx->build.thread, NULL);
+    cmd_index_adopt(idx);
+  }
+}
+
+internal void cmd_index_release(CmdIndex *idx) {
+  cmd_index_wait(idx);
+  for (int i = 0; i < 2; i += 1) {
+    free(idx->tries[i].arena.buf);
+  }
+  free(idx->rank_arena.buf);
+  free(idx->rank_slots);
+  free(idx->scratch_arena.buf);
+  *idx = (CmdIndex){0};
+}
+
+// True when PATH changed or any of its directories was modified since the
+// current generation was built (executables added or removed). A build in
+// progress is never stale.
+internal bool cmd_index_is_stale(CmdIndex *idx, StringList *env_path_list) {
+  if (idx->build.running) {
+    return false;
+  }
+
+  CmdTrie *trie = idx->trie;
+  if (trie == NULL || trie->dir_count != env_path_list->node_count) {
+    return true;
+  }
+
+  char dirpath[PATH_MAX_LEN];
+  uint64_t i = 0;
+  for (StringNode *ptr = env_path_list->first; ptr != NULL;
+       ptr = ptr->next, i += 1) {
+    if (!intern_equal(ptr->string, trie->dirs[i])) {
+      return true;
+    }
+
+    snprintf(dirpath, sizeof(dirpath), "%.*s", (int)ptr->string.size,
+             ptr->string.str);
+    struct timespec mtime = cmd_index_dir_mtime(dirpath);
+    if (mtime.tv_sec != trie->dir_mtimes[i].tv_sec ||
+        mtime.tv_nsec != trie->dir_mtimes[i].tv_nsec) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Counts one use of a command. Names that are not in the index (typos,
+// relative paths) are ignored since they can never be completion candidates.
+// Never waits for a build: while one runs, a name the current generation
+// does not know is counted as pending and settled when the build is
+// adopted.
+internal void cmd_index_record(CmdIndex *idx, String name) {
+  cmd_index_poll(idx);
+
+  CmdTrieNode *path[CMD_NAME_MAX_LEN + 1];
+  int depth = cmd_trie_find_path(idx->trie, name, path);
+  if (depth == 0) {
+    if (idx->build.running && name.size > 0 &&
+        name.size < CMD_NAME_MAX_LEN) {
+      CmdRank *rank = cmd_index_add_rank(idx, name, 1, (uint64_t)time(NULL));
+      if (rank != NULL) {
+        rank->pending += 1;
+      }
+    }
+    return;
+  }
+
+  CmdTrieNode *terminal = path[depth - 1];
+  if (terminal->rank == NULL) {
+    terminal->rank = cmd_index_add_rank(idx, terminal->name, 0, 0);
+    if (terminal->rank == NULL) {
+      return;
+    }
+  }
+
+  CmdRank *rank = terminal->rank;
+  rank->count += 1;
+  rank->last_used = (uint64_t)time(NULL);
+  for (int i = 0; i < depth; i += 1) {
+    cmd_trie_node_promote(&idx->trie->arena, path[i], rank);
+  }
+}
+
+// The PATH directory the current generation found name in, empty for a
+// builtin or a name it does not know. Never waits for a build, so it is
+// cheap enough to call while a line is being typed.
+internal String cmd_index_dir(CmdIndex *idx, String name) {
+  CmdTrieNode *path[CMD_NAME_MAX_LEN + 1];
+  int depth = cmd_trie_find_path(idx->trie, name, path);
+  if (depth == 0 || path[depth - 1]->dir == CMD_DIR_NONE) {
+    return (String){0};
+  }
+  return idx->trie->dirs[path[depth - 1]->dir];
+}
+
+internal void cmd_index_collect(Arena *a, CmdTrieNode *node,
+                                CmdTrieNode *prefix_node, StringArray *out) {
+  for (; node != NULL; node = node->next_sibling) {
+    if (node->terminal) {
+      bool ranked = false;
+      for (int i = 0; node->rank != NULL && i < prefix_node->top_count;
+           i += 1) {
+        if (prefix_node->top[i] == node->rank) {
+          ranked = true;
+          break;
+        }
+      }
+      if (!ranked) {
+        str_array_push(a, out, node->name);
+      }
+    }
+    cmd_index_collect(a, node->first_child, prefix_node, out);
+  }
+}
+
+// All commands starting with prefix: the top ranked ones first, then the rest
+// in alphabetical order. The result lives in the index scratch arena until
+// the next call. While a build runs the previous generation answers, or
+// nothing before the first one is done.
+internal StringArray cmd_index_matches(CmdIndex *idx, String prefix) {
+  StringArray result = {0};
+  Arena *a = &idx->scratch_arena;
+  arena_free_all(a);
+
+  cmd_index_poll(idx);
+  if (idx->trie == NULL) {
+    return result;
+  }
+
+  CmdTrieNode *node = idx->trie->root;
+  for (uint64_t i = 0; node != NULL && i < prefix.size; i += 1) {
+    node = cmd_trie_child(node, prefix.str[i]);
+  }
+  if (node == NULL) {
+    return result;
+  }
+
+  for (int i = 0; i < node->top_count; i += 1) {
+    str_array_push(a, &result, node->top[i]->name);
+  }
+  if (node->terminal) {
+    bool ranked = false;
+    for (int i = 0; node->rank != NULL && i < node->top_count; i += 1) {
+      ranked = ranked || node->top[i] == node->rank;
+    }
+    if (!ranked) {
+      str_array_push(a, &result, node->name);
+    }
+  }
+  cmd_index_collect(a, node->first_child, node, &result);
+
+  return result;
+}
+
+// Rank file format, one command per line: "<count> <last_used> <name>"
+internal bool cmd_index_load_ranks(CmdIndex *idx, const char *rankfile) {
+  FILE *f = fopen(rankfile, "r");
+  if (f == NULL) {
+    return false;
+  }
+
+  char line[CMD_NAME_MAX_LEN + 64];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long count = 0;
+    unsigned long long last_used = 0;
+    int name_start = 0;
+    if (sscanf(line, "%llu %llu %n", &count, &last_used, &name_start) < 2) {
+      continue;
+    }
+
+    String name = str_init(line + name_start, strlen(line + name_start));
+    if (name.size > 0 && name.str[name.size - 1] == '\n') {
+      name.size -= 1;
+    }
+    if (name.size > 0 && count > 0) {
+      CmdRank *rank = cmd_index_add_rank(idx, name, count, last_used);
+      if (rank != NULL && idx->trie != NULL) {
+        cmd_trie_link_rank(idx->trie, rank);
+      }
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+internal void cmd_index_save_ranks(CmdIndex *idx, const char *rankfile) {
+  FILE *f = fopen(rankfile, "w");
+  if (f == NULL) {
+    return;
+  }
+
+  for (CmdRank *rank = idx->ranks; rank != NULL; rank = rank->next) {
+    if (rank->count > 0) {
+      fprintf(f, "%llu %llu %.*s\n", (unsigned long long)rank->count,
+              (unsigned long long)rank->last_used, (int)rank->name.size,
+              rank->name.str);
+    }
+  }
+  fclose(f);
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef CODECRAFTER_CMD_SNAPSHOT_H
+#define CODECRAFTER_CMD_SNAPSHOT_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "base_string.h"
+
+// On-disk copy of the executables found in every PATH directory, so a new
+// shell only rescans the directories whose mtime changed. The file is
+// position independent and used straight from the mapping:
+//
+//   CmdSnapshotHeader
+//   CmdSnapshotDir[dir_count]
+//   directory paths and NUL separated name lists, addressed by offset
+#define CMD_SNAPSHOT_MAGIC "CCSHIDX1"
+#define CMD_SNAPSHOT_VERSION 1
+
+typedef struct CmdSnapshotHeader CmdSnapshotHeader;
+struct CmdSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dir_count;
+  uint64_t file_size;
+};
+
+typedef struct CmdSnapshotDir CmdSnapshotDir;
+struct CmdSnapshotDir {
+  uint64_t path_offset;
+  uint64_t path_size;
+  uint64_t names_offset;
+  uint64_t names_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+typedef struct CmdSnapshot CmdSnapshot;
+struct CmdSnapshot {
+  uint8_t *base;
+  uint64_t size;
+  CmdSnapshotDir *dirs;
+  uint64_t dir_count;
+};
+
+// What the writer needs to know about one directory.
+typedef struct CmdSnapshotEntry CmdSnapshotEntry;
+struct CmdSnapshotEntry {
+  String path;
+  struct timespec mtime;
+  const char *names;
+  uint64_t names_size;
+};
+
+internal void cmd_snapshot_close(CmdSnapshot *snap) {
+  if (snap->base != NULL) {
+    munmap(snap->base, snap->size);
+  }
+  *snap = (CmdSnapshot){0};
+}
+
+// size bytes at offset lie inside the file. Compared without adding the
+// two, which a crafted file could make wrap around.
+internal bool cmd_snapshot_range_ok(CmdSnapshot *snap, uint64_t offset,
+                                    uint64_t size) {
+  return offset <= snap->size && size <= snap->size - offset;
+}
+
+// Maps the snapshot and checks that every offset stays inside the file.
+// Returns false, leaving snap empty, for a missing or malformed file.
+internal bool cmd_snapshot_open(const char *path, CmdSnapshot *snap) {
+  *snap = (CmdSnapshot){0};
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CmdSnapshotHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+
+  snap->base = (uint8_t *)base;
+  snap->size = st.st_size;
+
+  CmdSnapshotHeader *header = (CmdSnapshotHeader *)snap->base;
+  bool valid = memcmp(header->magic, CMD_SNAPSHOT_MAGIC, 8) == 0 &&
+               header->version == CMD_SNAPSHOT_VERSION &&
+               header->file_size == snap->size &&
+               sizeof(CmdSnapshotHeader) +
+                       sizeof(CmdSnapshotDir) * (uint64_t)header->dir_count <=
+                   snap->size;
+
+  if (valid) {
+    snap->dirs = (CmdSnapshotDir *)(snap->base + sizeof(CmdSnapshotHeader));
+    snap->dir_count = header->dir_count;
+    for (uint64_t i = 0; valid && i < snap->dir_count; i += 1) {
+      CmdSnapshotDir *dir = &snap->dirs[i];
+      valid = cmd_snapshot_range_ok(snap, dir->path_offset, dir->path_size) &&
+              cmd_snapshot_range_ok(snap, dir->names_offset,
+                                    dir->names_size) &&
+              (dir->names_size == 0 ||
+               snap->base[dir->names_offset + dir->names_size - 1] == '\0');
+    }
+  }
+
+  if (!valid) {
+    cmd_snapshot_close(snap);
+  }
+  return valid;
+}
+
+internal CmdSnapshotDir *cmd_snapshot_find(CmdSnapshot *snap, String path) {
+  for (uint64_t i = 0; i < snap->dir_count; i += 1) {
+    CmdSnapshotDir *dir = &snap->dirs[i];
+    String dir_path =
+        str_init((const char *)snap->base + dir->path_offset, dir->path_size);
+    if (str_equal(dir_path, path)) {
+      return dir;
+    }
+  }
+  return NULL;
+}
+
+internal const char *cmd_snapshot_names(CmdSnapshot *snap,
+                                        CmdSnapshotDir *dir) {
+  return (const char *)snap->base + dir->names_offset;
+}
+
+// Writes a new snapshot next to path and renames it over, so readers only
+// ever map a complete file.
+internal bool cmd_snapshot_write(const char *path, CmdSnapshotEntry *entries,
+                                 uint64_t count) {
+  char tmp_path[PATH_MAX_LEN];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+
+  uint64_t offset =
+      sizeof(CmdSnapshotHeader) + sizeof(CmdSnapshotDir) * count;
+  CmdSnapshotHeader header = {
+      .magic = CMD_SNAPSHOT_MAGIC,
+      .version = CMD_SNAPSHOT_VERSION,
+      .dir_count = (uint32_t)count,
+  };
+  header.file_size = offset;
+  for (uint64_t i = 0; i < count; i += 1) {
+    header.file_size += entries[i].path.size + entries[i].names_size;
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  for (uint64_t i = 0; ok && i < count; i += 1) {
+    CmdSnapshotDir dir = {
+        .path_offset = offset,
+        .path_size = entries[i].path.size,
+        .names_offset = offset + entries[i].path.size,
+        .names_size = entries[i].names_size,
+        .mtime_sec = entries[i].mtime.tv_sec,
+        .mtime_nsec = entries[i].mtime.tv_nsec,
+    };
+    offset += dir.path_size + dir.names_size;
+    ok = fwrite(&dir, sizeof(dir), 1, f) == 1;
+  }
+  for (uint64_t i = 0; ok && i < count; i += 1) {
+    CmdSnapshotEntry *entry = &entries[i];
+    ok = fwrite(entry->path.str, 1, entry->path.size, f) == entry->path.size &&
+         fwrite(entry->names, 1, entry->names_size, f) == entry->names_size;
+  }
+
+  ok = fclose(f) == 0 && ok;
+  if (ok) {
+    ok = rename(tmp_path, path) == 0;
+  }
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  return ok;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef CODECRAFTER_DIR_CACHE_H
+#define CODECRAFTER_DIR_CACHE_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+
+#define DIR_CACHE_SLOTS 8
+#define DIR_CACHE_SCRATCH_SIZE (4 * MB)
+
+// One directory read into memory. The blob holds every name NUL terminated
+// and names points at each of them, sorted.
+typedef struct DirListing DirListing;
+struct DirListing {
+  char *path; // absolute, NULL for an empty slot
+  struct timespec mtime;
+  dev_t dev;
+  ino_t ino;
+  char *blob;
+  char **names;
+  uint64_t count;
+  uint64_t last_used;
+};
+
+// Small LRU of directory listings shared between the completion code and a
+// background thread that prefetches the directory of the word being typed.
+typedef struct DirCache DirCache;
+struct DirCache {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t prefetch_thread;
+  bool running;
+
+  DirListing slots[DIR_CACHE_SLOTS];
+  uint64_t tick;
+  char pending[PATH_MAX_LEN]; // waiting to be prefetched, empty if none
+  char loading[PATH_MAX_LEN]; // being read by the prefetch thread
+
+  Arena scratch_arena; // matches for the completion in progress
+};
+
+internal int dir_listing_name_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+internal void dir_listing_free(DirListing *listing) {
+  free(listing->path);
+  free(listing->blob);
+  free(listing->names);
+  *listing = (DirListing){0};
+}
+
+internal bool dir_listing_is_fresh(DirListing *listing, struct stat *st) {
+  return listing->dev == st->st_dev && listing->ino == st->st_ino &&
+         listing->mtime.tv_sec == st->st_mtim.tv_sec &&
+         listing->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Reads path without holding the cache lock.
+internal bool dir_listing_load(const char *path, DirListing *out) {
+  *out = (DirListing){0};
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return false;
+  }
+
+  // stat before reading so a concurrent change leaves the listing stale
+  struct stat st;
+  if (fstat(dirfd(dir), &st) != 0) {
+    closedir(dir);
+    return false;
+  }
+
+  uint64_t blob_size = 0;
+  uint64_t blob_cap = 64 * KB;
+  char *blob = (char *)malloc(blob_cap);
+  uint64_t count = 0;
+
+  struct dirent *de = NULL;
+  while ((de = readdir(dir)) != NULL) {
+    uint64_t len = strlen(de->d_name);
+    if (blob_size + len + 1 > blob_cap) {
+      for (; blob_size + len + 1 > blob_cap; blob_cap *= 2)
+        ;
+      blob = (char *)realloc(blob, blob_cap);
+    }
+    memcpy(blob + blob_size, de->d_name, len + 1);
+    blob_size += len + 1;
+    count += 1;
+  }
+  closedir(dir);
+
+  char **names = (char **)malloc(sizeof(char *) * (count + 1));
+  char *ptr = blob;
+  for (uint64_t i = 0; i < count; i += 1) {
+    names[i] = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  qsort(names, count, sizeof(char *), dir_listing_name_cmp);
+
+  out->path = strdup(path);
+  out->mtime = st.st_mtim;
+  out->dev = st.st_dev;
+  out->ino = st.st_ino;
+  out->blob = blob;
+  out->names = names;
+  out->count = count;
+  return true;
+}
+
+internal DirListing *dir_cache_find_locked(DirCache *cache, const char *path) {
+  for (int i = 0; i < DIR_CACHE_SLOTS; i += 1) {
+    DirListing *slot = &cache->slots[i];
+    if (slot->path != NULL && strcmp(slot->path, path) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+// Takes ownership of listing, replacing the old copy of the same directory or
+// the least recently used slot.
+internal DirListing *dir_cache_store_locked(DirCache *cache,
+                                            DirListing *listing) {
+  DirListing *slot = dir_cache_find_locked(cache, listing->path);
+  if (slot == NULL) {
+    slot = &cache->slots[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS; i += 1) {
+      if (cache->slots[i].path == NULL) {
+        slot = &cache->slots[i];
+        break;
+      }
+      if (cache->slots[i].last_used < slot->last_used) {
+        slot = &cache->slots[i];
+      }
+    }
+  }
+
+  dir_listing_free(slot);
+  *slot = *listing;
+  cache->tick += 1;
+  slot->last_used = cache->tick;
+  return slot;
+}
+
+// Fresh listing of path, reading the directory only when it is missing from
+// the cache or differs from st, which the caller took without the lock.
+// Called and returns with the lock held.
+internal DirListing *dir_cache_acquire_locked(DirCache *cache,
+                                              const char *path,
+                                              struct stat *st) {
+  // the prefetch thread is already reading it, wait instead of reading twice
+  while (strcmp(cache->loading, path) == 0) {
+    pthread_cond_wait(&cache->cond, &cache->lock);
+  }
+
+  DirListing *slot = dir_cache_find_locked(cache, path);
+  if (slot != NULL && dir_listing_is_fresh(slot, st)) {
+    cache->tick += 1;
+    slot->last_used = cache->tick;
+    return slot;
+  }
+
+  DirListing listing = {0};
+  pthread_mutex_unlock(&cache->lock);
+  bool loaded = dir_listing_load(path, &listing);
+  pthread_mutex_lock(&cache->lock);
+  if (!loaded) {
+    return NULL;
+  }
+  return dir_cache_store_locked(cache, &listing);
+}
+
+internal void *dir_cache_prefetch_main(void *arg) {
+  DirCache *cache = (DirCache *)arg;
+  pthread_mutex_lock(&cache->lock);
+  while (cache->running) {
+    if (cache->pending[0] == '\0') {
+      pthread_cond_wait(&cache->cond, &cache->lock);
+      continue;
+    }
+
+    memcpy(cache->loading, cache->pending, PATH_MAX_LEN);
+    cache->pending[0] = '\0';
+
+    // only this thread writes loading, it can be read unlocked
+    pthread_mutex_unlock(&cache->lock);
+    struct stat st;
+    bool exists = stat(cache->loading, &st) == 0;
+    pthread_mutex_lock(&cache->lock);
+
+    DirListing *slot = dir_cache_find_locked(cache, cache->loading);
+    bool fresh = !exists || (slot != NULL && dir_listing_is_fresh(slot, &st));
+
+    if (!fresh) {
+      DirListing listing = {0};
+      pthread_mutex_unlock(&cache->lock);
+      bool loaded = dir_listing_load(cache->loading, &listing);
+      pthread_mutex_lock(&cache->lock);
+      if (loaded) {
+        dir_cache_store_locked(cache, &listing);
+      }
+    }
+
+    cache->loading[0] = '\0';
+    pthread_cond_broadcast(&cache->cond);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+internal void dir_cache_init(DirCache *cache) {
+  *cache = (DirCache){0};
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->cond, NULL);
+  arena_init(&cache->scratch_arena, malloc(DIR_CACHE_SCRATCH_SIZE),
+             DIR_CACHE_SCRATCH_SIZE);
+
+  // signals stay with the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  cache->running = true;
+  if (pthread_create(&cache->prefetch_thread, NULL, dir_cache_prefetch_main,
+                     cache) != 0) {
+    cache->running = false;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+internal void dir_cache_release(DirCache *cache) {
+  if (cache->running) {
+    pthread_mutex_lock(&cache->lock);
+    cache->running = false;
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->prefetch_thread, NULL);
+  }
+
+  for (int i = 0; i < DIR_CACHE_SLOTS; i += 1) {
+    dir_listing_free(&cache->slots[i]);
+  }
+  free(cache->scratch_arena.buf);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->cond);
+}
+
+// Asks the background thread to read path. Never blocks on the filesystem.
+internal void dir_cache_prefetch(DirCache *cache, const char *path) {
+  if (!cache->running || strlen(path) >= PATH_MAX_LEN) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  if (strcmp(cache->loading, path) != 0) {
+    strcpy(cache->pending, path);
+    pthread_cond_broadcast(&cache->cond);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Absolute directory for the directory part of a completion word, "" meaning
+// the current directory. Returns false when the result does not fit.
+internal bool dir_cache_resolve(String dir, char *out, size_t out_size) {
+  char *home = getenv("HOME");
+  int n = 0;
+
+  if (dir.size > 0 && dir.str[0] == '/') {
+    n = snprintf(out, out_size, "%.*s", (int)dir.size, dir.str);
+  } else if (dir.size > 0 && dir.str[0] == '~' && home != NULL &&
+             (dir.size == 1 || dir.str[1] == '/')) {
+    n = snprintf(out, out_size, "%s%.*s", home, (int)dir.size - 1,
+                 dir.str + 1);
+  } else {
+    char cwd[PATH_MAX_LEN];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      return false;
+    }
+    n = snprintf(out, out_size, "%s/%.*s", cwd, (int)dir.size, dir.str);
+  }
+
+  return n > 0 && (size_t)n < out_size;
+}
+
+// Completions for word: every entry of its directory starting with its last
+// path component, prefixed with the directory part exactly as typed. The
+// result lives in the cache scratch arena until the next call.
+internal StringArray dir_cache_matches(DirCache *cache, String word) {
+  StringArray result = {0};
+  Arena *a = &cache->scratch_arena;
+  arena_free_all(a);
+
+  uint64_t base_start = word.size;
+  for (; base_start > 0 && word.str[base_start - 1] != '/'; base_start -= 1)
+    ;
+  String dir = str_substr(word, 0, base_start);
+  String base = str_substr(word, base_start, word.size);
+  char *prefix = to_cstring(a, base);
+
+  char path[PATH_MAX_LEN];
+  if (!dir_cache_resolve(dir, path, sizeof(path))) {
+    return result;
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return result;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  DirListing *listing = dir_cache_acquire_locked(cache, path, &st);
+  if (listing != NULL) {
+    // binary search for the first name >= prefix
+    uint64_t lo = 0;
+    uint64_t hi = listing->count;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (strcmp(listing->names[mid], prefix) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    for (uint64_t i = lo; i < listing->count; i += 1) {
+      char *name = listing->names[i];
+      if (strncmp(name, prefix, base.size) != 0) {
+        break;
+      }
+      if (base.size == 0 &&
+          (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+        continue;
+      }
+      String match = str_concat(a, dir, str_init(name, strlen(name)));
+      str_array_push(a, &result, match);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return result;
+}
+
+#endif
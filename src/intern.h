@@ -0,0 +1,152 @@
+#ifndef CODECRAFTER_INTERN_H
+#define CODECRAFTER_INTERN_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+
+#define INTERN_BLOCK_SIZE (1 * MB)
+#define INTERN_INITIAL_CAPACITY 1024
+
+// Every distinct string stored once for the whole session, so interned
+// strings are equal exactly when their pointers are (intern_equal). The
+// bytes live in arenas that are never reset; a full one is kept and a new
+// block started. Each copy is NUL terminated and doubles as a C string.
+//
+// The lock is there for the command index, which interns from its build
+// thread.
+typedef struct InternEntry InternEntry;
+struct InternEntry {
+  String str; // str.str == NULL for a free slot
+  uint64_t hash;
+};
+
+typedef struct InternTable InternTable;
+struct InternTable {
+  pthread_mutex_t lock;
+  Arena arena;
+  uint8_t **full_blocks;
+  uint64_t full_block_count;
+
+  InternEntry *slots;
+  uint64_t capacity; // power of two
+  uint64_t count;
+
+  uint64_t bytes;       // stored, NULs included
+  uint64_t hits;        // lookups answered by an existing copy
+  uint64_t bytes_saved; // what those lookups would have copied
+};
+
+internal void intern_init(InternTable *t) {
+  *t = (InternTable){0};
+  pthread_mutex_init(&t->lock, NULL);
+  arena_init(&t->arena, malloc(INTERN_BLOCK_SIZE), INTERN_BLOCK_SIZE);
+  t->capacity = INTERN_INITIAL_CAPACITY;
+  t->slots = (InternEntry *)calloc(t->capacity, sizeof(InternEntry));
+}
+
+internal void intern_release(InternTable *t) {
+  for (uint64_t i = 0; i < t->full_block_count; i += 1) {
+    free(t->full_blocks[i]);
+  }
+  free(t->full_blocks);
+  free(t->arena.buf);
+  free(t->slots);
+  pthread_mutex_destroy(&t->lock);
+  *t = (InternTable){0};
+}
+
+internal bool intern_equal(String a, String b) {
+  return a.str == b.str && a.size == b.size;
+}
+
+internal InternEntry *intern_probe(InternTable *t, String s, uint64_t hash) {
+  uint64_t mask = t->capacity - 1;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    InternEntry *entry = &t->slots[i];
+    if (entry->str.str == NULL ||
+        (entry->hash == hash && str_equal(entry->str, s))) {
+      return entry;
+    }
+  }
+}
+
+internal void intern_grow_locked(InternTable *t) {
+  InternEntry *old_slots = t->slots;
+  uint64_t old_capacity = t->capacity;
+  t->capacity *= 2;
+  t->slots = (InternEntry *)calloc(t->capacity, sizeof(InternEntry));
+  for (uint64_t i = 0; i < old_capacity; i += 1) {
+    if (old_slots[i].str.str != NULL) {
+      *intern_probe(t, old_slots[i].str, old_slots[i].hash) = old_slots[i];
+    }
+  }
+  free(old_slots);
+}
+
+internal uint8_t *intern_copy_locked(InternTable *t, String s) {
+  uint8_t *buf = (uint8_t *)arena_alloc_align(&t->arena, s.size + 1, 1);
+  if (buf == NULL) {
+    t->full_blocks = (uint8_t **)realloc(
+        t->full_blocks, sizeof(uint8_t *) * (t->full_block_count + 1));
+    t->full_blocks[t->full_block_count] = t->arena.buf;
+    t->full_block_count += 1;
+
+    uint64_t size = s.size + 1 > INTERN_BLOCK_SIZE ? s.size + 1
+                                                   : INTERN_BLOCK_SIZE;
+    arena_init(&t->arena, malloc(size), size);
+    buf = (uint8_t *)arena_alloc_align(&t->arena, s.size + 1, 1);
+  }
+  if (s.size > 0) {
+    memcpy(buf, s.str, s.size);
+  }
+  buf[s.size] = '\0';
+  return buf;
+}
+
+// The session's copy of s, made on first sight.
+internal String intern(InternTable *t, String s) {
+  uint64_t hash = str_hash(s);
+
+  pthread_mutex_lock(&t->lock);
+  // at most half full
+  if ((t->count + 1) * 2 > t->capacity) {
+    intern_grow_locked(t);
+  }
+
+  InternEntry *entry = intern_probe(t, s, hash);
+  if (entry->str.str != NULL) {
+    t->hits += 1;
+    t->bytes_saved += s.size + 1;
+  } else {
+    entry->str = (String){.str = intern_copy_locked(t, s), .size = s.size};
+    entry->hash = hash;
+    t->count += 1;
+    t->bytes += s.size + 1;
+  }
+  String result = entry->str;
+  pthread_mutex_unlock(&t->lock);
+  return result;
+}
+
+// The session's copy of s if there is one, empty otherwise. Unlike intern
+// it never stores anything, for strings that may be thrown away.
+internal String intern_find(InternTable *t, String s) {
+  uint64_t hash = str_hash(s);
+  pthread_mutex_lock(&t->lock);
+  String result = intern_probe(t, s, hash)->str;
+  pthread_mutex_unlock(&t->lock);
+  return result;
+}
+
+internal String intern_cstr(InternTable *t, const char *cstr) {
+  return intern(t, str_init(cstr, strlen(cstr)));
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CODECRAFTER_LINE_READER_H
+#define CODECRAFTER_LINE_READER_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "base.h"
+
+#define LINE_READER_SIZE (64 * KB)
+
+// Input of the read builtin. A shell reading a line must not consume more
+// than the line, since whatever runs next may read the same descriptor.
+// For a regular file it still reads ahead a whole buffer, and gives back
+// the unused part by seeking before anything else can see the descriptor,
+// in line_reader_sync. Pipes and terminals cannot seek, so they are read
+// one byte at a time.
+typedef struct LineReader LineReader;
+struct LineReader {
+  int fd;
+  bool checked;  // whether fd was looked at since the last sync
+  bool seekable; // fd is a regular file, read ahead
+  uint64_t pos;
+  uint64_t len;
+  uint8_t buf[LINE_READER_SIZE];
+};
+
+// Next byte of fd, -1 at the end or on an error.
+internal int line_reader_getc(LineReader *r) {
+  if (r->pos == r->len) {
+    if (!r->checked) {
+      struct stat st;
+      r->seekable = fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode);
+      r->checked = true;
+    }
+    ssize_t n = 0;
+    do {
+      n = read(r->fd, r->buf, r->seekable ? sizeof(r->buf) : 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return -1;
+    }
+    r->pos = 0;
+    r->len = (uint64_t)n;
+  }
+  int result = r->buf[r->pos];
+  r->pos += 1;
+  return result;
+}
+
+// Moves the offset of fd back to right after the last byte handed out, as
+// if it had been read one byte at a time, and forgets the buffer. Needed
+// before anything else reads fd, and before fd is replaced.
+internal void line_reader_sync(LineReader *r) {
+  if (r->pos < r->len) {
+    lseek(r->fd, -(off_t)(r->len - r->pos), SEEK_CUR);
+  }
+  r->pos = 0;
+  r->len = 0;
+  r->checked = false;
+}
+
+#endif
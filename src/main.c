@@ -1,6 +1,11 @@
+// fopencookie, for capturing builtin output
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -9,83 +14,119 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "arena.h"
 #include "base.h"
 #include "base_string.h"
+#include "capture.h"
+#include "cmd_index.h"
+#include "dir_cache.h"
+#include "intern.h"
+#include "line_reader.h"
+#include "parser.h"
+#include "path_cache.h"
+#include "placement.h"
+#include "script.h"
+#include "script_cache.h"
+#include "vars.h"
+#include "wildcard.h"
+#include "zygote.h"
 
 #include "readline_compat.h"
 
+#define SESSION_ARENA_SIZE (1 * MB)
+// Room for a glob over a directory with 100k+ files. Pages are only touched
+// as far as the arena has been used.
+#define PROMPT_ARENA_SIZE (64 * MB)
+#define STAGE_ARENA_SIZE (8 * MB)
+#define SHELL_PATH_ARENA_SIZE (64 * KB)
+
+// Memory by lifetime. The session arena is never reset. The prompt arena
+// holds the parse and expansion of one command line and is reset before the
+// next prompt. Every stage of a pipeline gets its own scratch arena, reset
+// when the next pipeline starts; stage buffers are kept once allocated.
+typedef struct ShellArenas ShellArenas;
+struct ShellArenas {
+  Arena session;
+  Arena prompt;
+  Arena *stages;
+  int stage_count;
+};
+
+global ShellArenas shell_arenas = {0};
+// command names, PATH directories and resolved paths, each stored once
+global InternTable shell_strings = {0};
 // include builtin and executables in PATH
-global StringList existing_commands = {0};
-global const char *builtin_commands[] = {"type", "echo",    "exit", "pwd",
-                                         "cd",   "history", "jobs", NULL};
+global CmdIndex cmd_index = {0};
+// directory listings for argument completion
+global DirCache dir_cache = {0};
+global const char *builtin_commands[] = {
+    "type", "echo", "exit", "pwd", "cd", "history", "jobs", "export",
+    "unset", "parallel", "memstats", "true", "false", ":", "break",
+    "continue", "read", "place", "exec", NULL};
+
+// shell variables, the exported ones make up the environment of commands
+global ShellVars shell_vars = {0};
+global int last_exit_status = 0;
+// how command lines see the shell, filled in by main
+global ParseContext shell_parse = {0};
+// $PATH split into directories, re-split whenever PATH changes
+global StringList shell_path_list = {0};
+global Arena shell_path_arena = {0};
+global uint64_t shell_path_generation = 0;
+// commands already found in PATH, filled ahead of time while typing
+global PathCache path_cache = {0};
+// spawns external commands when SHELL_ZYGOTE=1
+global Zygote zygote = {.sock = -1};
+// what the read builtin has read ahead of stdin
+global LineReader stdin_reader = {.fd = STDIN_FILENO};
+
+// Streams over the descriptors exec opened for writing, which builtins
+// redirected to them write into: one write per command instead of moving
+// descriptors around it. The ones opened with exec -b are only written out
+// when something else could write to the descriptor. exec only takes
+// single digit descriptors.
+#define EXEC_FD_COUNT 10
+#define EXEC_FD_BUFFER_SIZE (64 * KB)
+global FILE *exec_fd_streams[EXEC_FD_COUNT] = {0};
+global uint32_t exec_fd_buffered = 0; // by descriptor, opened with exec -b
+// descriptors above 2 that exec left open, which the zygote cannot hand on
+global uint32_t exec_fd_mask = 0;
 
 // history
 global int last_append_cmd_idx = -1;
 global bool shell_running = true;
+// set by ^C, stops running loops
+global volatile sig_atomic_t shell_interrupted = 0;
 
 // Signal handler for SIGINT - just prints a newline for clean prompt
 internal void sigint_handler(int sig) {
   (void)sig;
+  shell_interrupted = 1;
   printf("\n");
   rl_on_new_line();
   rl_redisplay();
 }
 
-typedef struct RedirectInfo RedirectInfo;
-struct RedirectInfo {
-  int source_fd;
-  String output_file_name;
-  int flag;
-};
-
-typedef struct ShellCommand ShellCommand;
-struct ShellCommand {
-  String exe;
-  StringArray args;
-  RedirectInfo redir_info;
-};
-
-typedef struct PipedShellCommandNode PipedShellCommandNode;
-struct PipedShellCommandNode {
-  ShellCommand cmd;
-  PipedShellCommandNode *next;
-};
-
-typedef struct PipedShellCommandList PipedShellCommandList;
-struct PipedShellCommandList {
-  PipedShellCommandNode *first;
-  PipedShellCommandNode *last;
-  uint64_t node_count;
-};
-
 typedef struct {
   int fds[2];
 } Pipe;
 
-internal PipedShellCommandNode *piped_cmd_list_push(Arena *a,
-                                                    PipedShellCommandList *list,
-                                                    ShellCommand shell_cmd) {
-  PipedShellCommandNode *node =
-      (PipedShellCommandNode *)arena_alloc(a, sizeof(PipedShellCommandNode));
-  node->cmd = shell_cmd;
-
-  if (list->first == NULL) {
-    list->first = node;
-  }
-  if (list->last != NULL) {
-    list->last->next = node;
-  }
-  list->last = node;
-  list->node_count += 1;
-
-  return node;
-}
+// What a pipeline stage execs, prepared in the stage's arena before any
+// fork so the children only read it. path is NULL for builtins.
+typedef struct PipelineStage PipelineStage;
+struct PipelineStage {
+  Arena *arena;
+  char *path;
+  char **argv;
+  char **envp;
+};
 
 internal void echo(ShellCommand *cmd) {
   assert(cmd->args.count > 0);
@@ -97,10 +138,22 @@ internal void echo(ShellCommand *cmd) {
   }
 }
 
+// builtin_commands, interned
+global String builtin_names[32] = {0};
+
+internal void intern_builtins(void) {
+  for (int i = 0; builtin_commands[i] != NULL; i += 1) {
+    assert(i < ArrayCount(builtin_names));
+    builtin_names[i] = intern_cstr(&shell_strings, builtin_commands[i]);
+  }
+}
+
 internal bool is_builtin(String cmd) {
+  // a name never interned cannot be a builtin
+  String name = intern_find(&shell_strings, cmd);
   bool result = false;
-  for (int i = 0; builtin_commands[i] != NULL; i += 1) {
-    if (str_equal_cstr(cmd, builtin_commands[i])) {
+  for (int i = 0; builtin_names[i].str != NULL; i += 1) {
+    if (intern_equal(name, builtin_names[i])) {
       result = true;
       break;
     }
@@ -108,27 +161,57 @@ internal bool is_builtin(String cmd) {
   return result;
 }
 
+// Words the builtins that assert how many they get take, their name
+// included. -1 for every other command.
+internal int builtin_arity(String cmd) {
+  if (str_equal_cstr(cmd, "pwd")) {
+    return 1;
+  }
+  if (str_equal_cstr(cmd, "cd") || str_equal_cstr(cmd, "type")) {
+    return 2;
+  }
+  return -1;
+}
+
+internal bool is_directory(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    return S_ISDIR(st.st_mode);
+  }
+  return false;
+}
+
+// Full path of cmd in the first PATH directory that has it, or cmd itself
+// when it has a slash, interned so it is also a C string. Empty when there
+// is none.
 internal String search_path(Arena *a, String cmd, StringList *env_path_list) {
   assert(env_path_list != NULL);
   String result = {0};
-  String sep = {.str = (uint8_t *)"/", .size = 1};
 
   char buffer[PATH_MAX_LEN];
 
+  // a name with a slash in it is a path already
+  if (memchr(cmd.str, '/', cmd.size) != NULL) {
+    int n = snprintf(buffer, sizeof(buffer), "%.*s", (int)cmd.size, cmd.str);
+    if (n > 0 && n < (int)sizeof(buffer) && access(buffer, X_OK) == 0 &&
+        !is_directory(buffer)) {
+      result = intern(&shell_strings, str_init(buffer, n));
+    }
+    return result;
+  }
+
   StringNode *ptr = env_path_list->first;
   for (; ptr != NULL; ptr = ptr->next) {
-    String file_path = {0};
-    if (ptr->string.str[ptr->string.size - 1] == '/') {
-      file_path = str_concat(a, ptr->string, cmd);
-    } else {
-      file_path = str_concat_sep(a, ptr->string, cmd, sep);
+    String dir = ptr->string;
+    bool slash = dir.size > 0 && dir.str[dir.size - 1] == '/';
+    int n = snprintf(buffer, sizeof(buffer), "%.*s%s%.*s", (int)dir.size,
+                     dir.str, slash ? "" : "/", (int)cmd.size, cmd.str);
+    if (n <= 0 || n >= (int)sizeof(buffer)) {
+      continue;
     }
 
-    memcpy(buffer, file_path.str, file_path.size);
-    buffer[file_path.size] = '\0';
-
     if (access(buffer, X_OK) == 0) {
-      result = file_path;
+      result = intern(&shell_strings, str_init(buffer, n));
       break;
     }
   }
@@ -136,12 +219,35 @@ internal String search_path(Arena *a, String cmd, StringList *env_path_list) {
   return result;
 }
 
+// search_path through the path cache. A cached path is still checked, so a
+// command removed since falls back to a full search.
+internal String resolve_command(Arena *a, String cmd,
+                                StringList *env_path_list) {
+  path_cache_sync(&path_cache, shell_path_generation);
+  String result = path_cache_get(&path_cache, cmd);
+  if (result.size > 0 && access((char *)result.str, X_OK) == 0) {
+    return result;
+  }
+
+  result = search_path(a, cmd, env_path_list);
+  if (result.size > 0) {
+    path_cache_put(&path_cache, intern(&shell_strings, cmd), result);
+  }
+  return result;
+}
+
 internal void type(Arena *a, ShellCommand *shell_cmd,
                    StringList *env_path_list) {
   assert(shell_cmd->args.count == 2);
 
   String exe = shell_cmd->args.items[1];
-  if (is_builtin(exe)) {
+  bool keyword = false;
+  for (int i = 0; script_keywords[i] != NULL; i += 1) {
+    keyword = keyword || str_equal_cstr(exe, script_keywords[i]);
+  }
+  if (keyword) {
+    printf("%.*s is a shell keyword\n", (int)exe.size, exe.str);
+  } else if (is_builtin(exe)) {
     // TODO: improve printing for String
     str_print(exe);
     printf(" is a shell builtin\n");
@@ -152,10 +258,21 @@ internal void type(Arena *a, ShellCommand *shell_cmd,
              exe_path.str);
     } else {
       printf("%.*s not found\n", (int)exe.size, exe.str);
+      last_exit_status = 1;
     }
   }
 }
 
+// $? for a waitpid status
+internal int exit_status(int status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return 1;
+}
+
 internal void cmd_to_execvp_args(Arena *a, ShellCommand *shell_cmd,
                                  char ***execvp_args) {
   *execvp_args =
@@ -170,21 +287,122 @@ internal void cmd_to_execvp_args(Arena *a, ShellCommand *shell_cmd,
   (*execvp_args)[shell_cmd->args.count] = NULL;
 }
 
+// Environment for an external command: the exported variables, overridden
+// by the command's own NAME=value prefixes.
+internal char **cmd_envp(Arena *a, ShellCommand *shell_cmd) {
+  char **envp = vars_envp(&shell_vars);
+  if (shell_cmd->assigns.count == 0) {
+    return envp;
+  }
+
+  uint64_t n = 0;
+  for (; envp[n] != NULL; n += 1)
+    ;
+  uint64_t capacity = n + shell_cmd->assigns.count + 1;
+  char **result = (char **)arena_alloc(a, sizeof(char *) * capacity);
+  memcpy(result, envp, sizeof(char *) * n);
+
+  for (uint64_t i = 0; i < shell_cmd->assigns.count; i += 1) {
+    String assign = shell_cmd->assigns.items[i];
+    uint64_t name_size = 0;
+    for (; assign.str[name_size] != '='; name_size += 1)
+      ;
+
+    uint64_t slot = 0;
+    for (; slot < n; slot += 1) {
+      if (strncmp(result[slot], (const char *)assign.str, name_size + 1) == 0) {
+        break;
+      }
+    }
+    result[slot] = to_cstring(a, assign);
+    if (slot == n) {
+      n += 1;
+    }
+  }
+  result[n] = NULL;
+  return result;
+}
+
+internal void exec_fds_flush(void) {
+  for (int i = 0; i < EXEC_FD_COUNT; i += 1) {
+    if (exec_fd_streams[i] != NULL) {
+      fflush(exec_fd_streams[i]);
+    }
+  }
+}
+
+// Writes out what exec holds for stdout and stderr, other than in keep,
+// before a builtin writes to them through the stdio streams, which are
+// not the exec ones.
+internal void exec_fds_flush_std(FILE *keep) {
+  for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd += 1) {
+    if (exec_fd_streams[fd] != NULL && exec_fd_streams[fd] != keep) {
+      fflush(exec_fd_streams[fd]);
+    }
+  }
+}
+
+// Drops the stream over fd, writing out what it holds, before fd changes.
+internal void exec_fd_release(int fd) {
+  if (fd >= 0 && fd < EXEC_FD_COUNT && exec_fd_streams[fd] != NULL) {
+    fclose(exec_fd_streams[fd]);
+    exec_fd_streams[fd] = NULL;
+    exec_fd_buffered &= ~(1u << fd);
+  }
+}
+
+// Before anything but the shell itself can use its descriptors: gives back
+// what read took ahead on stdin, and writes out what builtins buffered
+// for exec -b descriptors.
+internal void shell_io_sync(void) {
+  line_reader_sync(&stdin_reader);
+  exec_fds_flush();
+}
+
+// Ends a forked child that ran shell code rather than exec'ing: writes out
+// what its streams hold, then leaves without the exit handlers and stdio
+// teardown that belong to the shell.
+internal void child_exit(int status) {
+  fflush(NULL);
+  _exit(status);
+}
+
+// plan places the command, from a place prefix. The zygote cannot apply
+// it, nor hand on descriptors past 2, so such commands are forked here.
 internal void run_exec(Arena *a, ShellCommand *shell_cmd,
-                       StringList *env_path_list) {
+                       StringList *env_path_list, PlacementPlan *plan) {
   assert(shell_cmd->exe.size > 0);
 
   String exe = shell_cmd->exe;
-  String exe_path = search_path(a, exe, env_path_list);
+  String exe_path = resolve_command(a, exe, env_path_list);
   if (exe_path.size == 0) {
     printf("%.*s: command not found\n", (int)exe.size, exe.str);
+    last_exit_status = 127;
     return;
   }
 
   char **args = NULL;
   cmd_to_execvp_args(a, shell_cmd, &args);
+  char *path = (char *)exe_path.str;
+  char **envp = cmd_envp(a, shell_cmd);
+
+  // the command reads stdin from where read left off
+  shell_io_sync();
+  bool placed = placement_is_set(plan, 1);
+  bool direct = placed || exec_fd_mask != 0;
+  pid_t pid = direct ? -1 : zygote_spawn(&zygote, path, args, envp);
+  if (pid > 0) {
+    int status = 0;
+    if (zygote_wait(&zygote, pid, &status)) {
+      last_exit_status = exit_status(status);
+    } else {
+      // the zygote died with the command, its status is lost
+      last_exit_status = 1;
+    }
+    return;
+  }
 
-  pid_t pid = fork();
+  pid = fork();
 
   if (pid < 0) {
     perror("fork");
@@ -195,11 +413,16 @@ internal void run_exec(Arena *a, ShellCommand *shell_cmd,
   if (pid == 0) {
     signal(SIGINT, SIG_DFL);
     signal(SIGTSTP, SIG_DFL);
-    execvp(args[0], args);
-    perror("execvp");
+    if (placed && !placement_apply(plan, 0)) {
+      _exit(126);
+    }
+    execve(path, args, envp);
+    perror("execve");
     _exit(127);
   } else {
-    waitpid(pid, NULL, 0);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    last_exit_status = exit_status(status);
   }
 }
 
@@ -211,18 +434,10 @@ internal void pwd(Arena *a, ShellCommand *shell_cmd) {
   printf("%s\n", buf);
 }
 
-internal bool is_directory(const char *path) {
-  struct stat st;
-  if (stat(path, &st) == 0) {
-    return S_ISDIR(st.st_mode);
-  }
-  return false;
-}
-
 internal void cd(Arena *a, ShellCommand *shell_cmd) {
   assert(shell_cmd->args.count == 2);
 
-  char *env_home = getenv("HOME");
+  char *env_home = vars_get_cstr(&shell_vars, "HOME");
 
   TempArenaMemory temp = temp_arena_memory_begin(a);
   String dir = shell_cmd->args.items[1];
@@ -234,266 +449,183 @@ internal void cd(Arena *a, ShellCommand *shell_cmd) {
     buf = env_home;
   }
 
-  if (is_directory(buf)) {
+  if (buf != NULL && is_directory(buf)) {
     chdir(buf);
   } else {
     printf("cd: %s: No such file or directory\n", buf);
+    last_exit_status = 1;
   }
   temp_arena_memory_end(temp);
 }
 
-internal RedirectInfo parse_redirect(String s, StringNode *file_name) {
-  RedirectInfo info = {0};
-  if (file_name == NULL) {
-    return info;
-  }
+internal char *cmd_generator(const char *text, int state) {
+  local_persist StringArray matches = {0};
+  local_persist uint64_t match_idx = 0;
 
-  int source_fd = -1;
+  if (!state) {
+    matches = cmd_index_matches(&cmd_index, str_init(text, strlen(text)));
+    match_idx = 0;
+  }
 
-  if (str_equal_cstr(s, ">") || str_equal_cstr(s, "1>") ||
-      str_equal_cstr(s, "2>")) {
-    info.source_fd = s.size == 1 ? 1 : s.str[0] - '0';
-    info.output_file_name = file_name->string;
-    info.flag = O_TRUNC;
-  } else if (str_equal_cstr(s, ">>") || str_equal_cstr(s, "1>>") ||
-             str_equal_cstr(s, "2>>")) {
-    info.source_fd = s.size == 2 ? 1 : s.str[0] - '0';
-    info.output_file_name = file_name->string;
-    info.flag = O_APPEND;
+  if (match_idx < matches.count) {
+    String cmd = matches.items[match_idx];
+    match_idx += 1;
+    return strndup((const char *)cmd.str, cmd.size);
   }
 
-  return info;
+  return NULL; // No more matches
 }
 
-internal String eval_token(Arena *a, StringList *tokens) {
-  assert(tokens != NULL);
-  assert(tokens->node_count > 0);
-  assert(tokens->first != NULL);
-  assert(tokens->last != NULL);
+internal char *file_generator(const char *text, int state) {
+  local_persist StringArray matches = {0};
+  local_persist uint64_t match_idx = 0;
 
-  char *buf = (char *)arena_alloc(a, tokens->total_size);
-  char *buf_ptr = buf;
-
-  StringNode *ptr = tokens->first;
-  for (; ptr != NULL; ptr = ptr->next) {
-    char ch = ptr->string.str[0];
-    if (ch == SINGLE_QUOTE) {
-      // treated literally
-      size_t cpy_size = ptr->string.size - 2;
-      memcpy(buf_ptr, ptr->string.str + 1, cpy_size);
-      buf_ptr += cpy_size;
-    } else if (ch == DOUBLE_QUOTE) {
-      String str = ptr->string;
-      bool escape = false;
-
-      for (int i = 1; i < str.size - 1; i += 1) {
-        char ch = str.str[i];
-        if (escape) {
-          if (ch == DOUBLE_QUOTE || ch == BACKSLASH) {
-            *(buf_ptr - 1) = ch;
-          } else {
-            *buf_ptr = ch;
-            buf_ptr += 1;
-          }
-          escape = false;
-        } else {
-          *buf_ptr = ch;
-          buf_ptr += 1;
+  if (!state) {
+    matches = dir_cache_matches(&dir_cache, str_init(text, strlen(text)));
+    match_idx = 0;
+    // let readline append '/' to directories and quote special characters
+    rl_filename_completion_desired = 1;
+  }
 
-          if (ch == BACKSLASH) {
-            escape = true;
-          }
-        }
-      }
-    } else {
-      // no quote
-      String str = ptr->string;
-      bool escape = false;
-
-      for (int i = 0; i < str.size; i += 1) {
-        char ch = str.str[i];
-        if (escape) {
-          *(buf_ptr - 1) = ch;
-          escape = false;
-        } else {
-          *buf_ptr = ch;
-          buf_ptr += 1;
-
-          if (ch == BACKSLASH) {
-            escape = true;
-          }
-        }
-      }
-    }
+  if (match_idx < matches.count) {
+    String file = matches.items[match_idx];
+    match_idx += 1;
+    return strndup((const char *)file.str, file.size);
   }
 
-  size_t size = buf_ptr - buf;
-  String token = {.str = (uint8_t *)buf, .size = size};
-  return token;
+  return NULL; // No more matches
 }
 
-internal StringList tokenize_command(Arena *a, char *cmd_str) {
-  StringList tokens = {0};
-  String cmd = {.str = (uint8_t *)cmd_str, .size = strlen(cmd_str)};
-
-  int start = 0;
-  for (; start <= cmd.size; start += 1) {
-    // consume prefixing spaces
-    for (;
-         start < cmd.size && (cmd.str[start] == ' ' || cmd.str[start] == '\t');
-         start += 1)
-      ;
-
-    int end = start;
-    StringList tokens_with_quote = {0};
-    char current_quote = '\0'; // default empty: no quote, can also be " or '
-    char prev_ch = '\0';
-
-    for (; end < cmd.size; end += 1) {
-      char ch = cmd.str[end];
-
-      if ((ch == SINGLE_QUOTE || ch == DOUBLE_QUOTE) && prev_ch != BACKSLASH) {
-        if (ch == current_quote) {
-          // quote finished
-          str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end + 1));
-          current_quote = '\0';
-          start = end + 1;
-        } else if (current_quote == '\0') {
-          // starting quote, the previous token should be pushed
-          if (end > start) {
-            str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end));
-          }
-          current_quote = ch;
-          start = end;
-        }
-      } else if ((ch == ' ' || ch == '\t') && current_quote == '\0' &&
-                 prev_ch != BACKSLASH) {
-        // not in a quote, and sees a space or tab
-        str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end));
-        start = end;
-        break;
-      } else if (end + 1 == cmd.size) {
-        str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end + 1));
-        start = end + 1;
-        break;
-      }
-
-      prev_ch = ch;
-    }
-
-    if (tokens_with_quote.node_count > 0) {
-      String token = eval_token(a, &tokens_with_quote);
-      str_list_push(a, &tokens, token);
-    }
+internal char **cmd_completion(const char *text, int start, int end) {
+  if (start == 0) {
+    // keep the frequency/recency order produced by the index
+    rl_sort_completion_matches = 0;
+    return rl_completion_matches(text, cmd_generator);
+  } else {
+    rl_sort_completion_matches = 1;
+    return rl_completion_matches(text, file_generator);
   }
-
-  return tokens;
+  return NULL;
 }
 
-internal PipedShellCommandList parse_command(Arena *a, char *cmd_str) {
-  PipedShellCommandList piped_list = {0};
-
-  StringList tokens = tokenize_command(a, cmd_str);
-  StringNode *token_ptr = tokens.first;
-
-  while (token_ptr != NULL) {
-    StringArray args = {0};
-    RedirectInfo redirect_info = {0};
-    String exe = token_ptr->string;
-
-    for (; token_ptr != NULL; token_ptr = token_ptr->next) {
-      if (str_equal_cstr(token_ptr->string, "|")) {
-        token_ptr = token_ptr->next;
-        break;
-      }
-
-      RedirectInfo info = parse_redirect(token_ptr->string, token_ptr->next);
-      if (info.source_fd > 0) {
-        redirect_info = info;
-      } else {
-        if (redirect_info.source_fd <= 0) {
-          str_array_push(a, &args, token_ptr->string);
-        }
-      }
-    }
-    ShellCommand shell_cmd = {
-        .exe = exe,
-        .args = args,
-        .redir_info = redirect_info,
-    };
-    piped_cmd_list_push(a, &piped_list, shell_cmd);
+// Starts reading a file into the page cache without waiting for it.
+internal void prefetch_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
   }
-
-  return piped_list;
 }
 
-internal void preload_existing_commands(Arena *a, StringList *env_path_list) {
-  assert(env_path_list != NULL);
-
-  // Clear the list before rebuilding (handles PATH changes)
-  existing_commands = (StringList){0};
+// Starts reading the executable named by the command word of the line being
+// typed, so Enter finds it ready. The path comes from the path cache or the
+// command index, never from a PATH search: this runs between keystrokes.
+// Only words that need no expansion are looked up, once per change.
+internal void prefetch_command(const char *line, int size) {
+  local_persist char last_word[256] = {0};
+
+  String word = {0};
+  int i = 0;
+  do {
+    for (; i < size && (line[i] == ' ' || line[i] == '\t'); i += 1)
+      ;
+    int start = i;
+    for (; i < size && line[i] != ' ' && line[i] != '\t'; i += 1)
+      ;
+    word = str_init(line + start, i - start);
+  } while (word.size > 0 && is_assignment_word(word));
 
-  // existing commands
-  int index = 0;
-  while (builtin_commands[index] != NULL) {
-    str_list_push_cstr(a, &existing_commands, builtin_commands[index]);
-    index += 1;
+  if (word.size == 0 || word.size >= sizeof(last_word)) {
+    return;
   }
-
-  for (StringNode *ptr = env_path_list->first; ptr != NULL; ptr = ptr->next) {
-    char *dirpath = to_cstring(a, ptr->string);
-    DIR *dir = opendir(dirpath);
-    if (dir == NULL) {
-      continue;
+  for (uint64_t j = 0; j < word.size; j += 1) {
+    if (strchr("/$`'\"\\|;&<>(){}*?[~", word.str[j]) != NULL) {
+      return;
     }
+  }
+  if (str_equal_cstr(word, last_word)) {
+    return;
+  }
+  memcpy(last_word, word.str, word.size);
+  last_word[word.size] = '\0';
 
-    struct dirent *de = NULL;
-    while ((de = readdir(dir)) != NULL) {
-      char fullpath[PATH_MAX_LEN];
-      snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, de->d_name);
-
-      String exe = str_clone_from_cstring(a, de->d_name, strlen(de->d_name));
-
-      struct stat st;
-      if (stat(fullpath, &st) != 0) {
-        continue;
-      }
+  if (is_builtin(word)) {
+    return;
+  }
+  char path[PATH_MAX_LEN];
+  path_cache_sync(&path_cache, shell_path_generation);
+  String cached = path_cache_get(&path_cache, word);
+  String dir = cached.size > 0 ? (String){0} : cmd_index_dir(&cmd_index, word);
+  int n = 0;
+  if (cached.size > 0) {
+    n = snprintf(path, sizeof(path), "%.*s", (int)cached.size, cached.str);
+  } else if (dir.size > 0) {
+    n = snprintf(path, sizeof(path), "%.*s/%.*s", (int)dir.size, dir.str,
+                 (int)word.size, word.str);
+  }
+  if (n > 0 && n < (int)sizeof(path)) {
+    prefetch_file(path);
+  }
+}
 
-      if (S_ISREG(st.st_mode) && access(fullpath, X_OK) == 0) {
-        str_list_push(a, &existing_commands, exe);
-      }
+// Length of a redirect operator (>, >>, 2>, <) glued to the front of a
+// word, so its target is prefetched like any other path.
+internal int redirect_prefix_size(String word) {
+  uint64_t i = 0;
+  for (; i < word.size && word.str[i] >= '0' && word.str[i] <= '9'; i += 1)
+    ;
+  if (i < word.size && word.str[i] == '<') {
+    return (int)i + 1;
+  }
+  if (i < word.size && word.str[i] == '>') {
+    i += 1;
+    if (i < word.size && word.str[i] == '>') {
+      i += 1;
     }
-
-    closedir(dir);
+    return (int)i;
   }
+  return 0;
 }
 
-// TODO:: optimize the speed
-internal char *cmd_generator(const char *text, int state) {
-  local_persist StringNode *cmd_ptr = NULL;
+// Called by readline while it waits for input: starts reading the directory
+// of the argument under the cursor so a later Tab is a lookup in memory.
+internal int completion_prefetch_hook(void) {
+  local_persist char last_dir[PATH_MAX_LEN] = {0};
 
-  if (!state) {
-    cmd_ptr = existing_commands.first;
-  }
+  prefetch_command(rl_line_buffer, rl_end);
+
+  int start = rl_point;
+  for (; start > 0 && rl_line_buffer[start - 1] != ' ' &&
+         rl_line_buffer[start - 1] != '\t';
+       start -= 1)
+    ;
 
-  while (cmd_ptr != NULL) {
-    const String cmd = cmd_ptr->string;
-    cmd_ptr = cmd_ptr->next;
-    if (str_starts_with_cstr(cmd, text)) {
-      return strndup((const char *)cmd.str, cmd.size);
+  // the first word completes against the command index
+  bool first_word = true;
+  for (int i = 0; i < start; i += 1) {
+    if (rl_line_buffer[i] != ' ' && rl_line_buffer[i] != '\t') {
+      first_word = false;
+      break;
     }
   }
+  if (first_word) {
+    return 0;
+  }
 
-  return NULL; // No more matches
-}
-
-internal char **cmd_completion(const char *text, int start, int end) {
-  if (start == 0) {
-    return rl_completion_matches(text, cmd_generator);
-  } else {
-    return rl_completion_matches(text, rl_filename_completion_function);
+  start += redirect_prefix_size(
+      str_init(rl_line_buffer + start, rl_point - start));
+  int dir_end = rl_point;
+  for (; dir_end > start && rl_line_buffer[dir_end - 1] != '/'; dir_end -= 1)
+    ;
+
+  char dir[PATH_MAX_LEN];
+  String word_dir = str_init(rl_line_buffer + start, dir_end - start);
+  if (dir_cache_resolve(word_dir, dir, sizeof(dir)) &&
+      strcmp(dir, last_dir) != 0) {
+    strcpy(last_dir, dir);
+    dir_cache_prefetch(&dir_cache, dir);
   }
-  return NULL;
+  return 0;
 }
 
 internal void print_history(Arena *a, int n) {
@@ -546,90 +678,1138 @@ internal void history(Arena *a, ShellCommand *shell_cmd) {
 
 internal void jobs(Arena *a, ShellCommand *shell_cmd) {}
 
-internal void run_builtin(Arena *arena, ShellCommand *shell_cmd,
-                          StringList *env_path_list) {
-  if (str_equal_cstr(shell_cmd->exe, "echo")) {
-    echo(shell_cmd);
-  } else if (str_equal_cstr(shell_cmd->exe, "pwd")) {
-    pwd(arena, shell_cmd);
-  } else if (str_equal_cstr(shell_cmd->exe, "type")) {
-    type(arena, shell_cmd, env_path_list);
-  } else if (str_equal_cstr(shell_cmd->exe, "cd")) {
-    cd(arena, shell_cmd);
-  } else if (str_equal_cstr(shell_cmd->exe, "history")) {
-    history(arena, shell_cmd);
-  } else if (str_equal_cstr(shell_cmd->exe, "jobs")) {
-    jobs(arena, shell_cmd);
-  }
-}
-
-internal void run_shell_command(Arena *arena, ShellCommand *shell_cmd,
-                                StringList *env_path_list) {
+internal void export(Arena *a, ShellCommand *shell_cmd) {
+  uint64_t argc = shell_cmd->args.count;
+  assert(argc > 0);
 
-  if (str_equal_cstr(shell_cmd->exe, "exit")) {
-    shell_running = false;
+  if (argc == 1) {
+    StringArray names = {0};
+    for (uint64_t i = 0; i < shell_vars.capacity; i += 1) {
+      ShellVar *var = &shell_vars.slots[i];
+      if (var->name.size > 0 && !var->deleted && var->exported) {
+        str_array_push(a, &names, var->name);
+      }
+    }
+    if (names.count > 0) {
+      qsort(names.items, names.count, sizeof(String), str_compare_qsort);
+    }
+    for (uint64_t i = 0; i < names.count; i += 1) {
+      ShellVar *var = vars_get(&shell_vars, names.items[i]);
+      printf("declare -x %.*s=\"%.*s\"\n", (int)var->name.size, var->name.str,
+             (int)var->value.size, var->value.str);
+    }
     return;
   }
 
-  int saved_source_fd = 0;
-  RedirectInfo redir_info = shell_cmd->redir_info;
-  if (redir_info.source_fd > 0) {
-    char *file_name = to_cstring(arena, redir_info.output_file_name);
-    int fd = open(file_name, O_WRONLY | O_CREAT | redir_info.flag, 0644);
+  for (uint64_t i = 1; i < argc; i += 1) {
+    String arg = shell_cmd->args.items[i];
+    uint64_t eq = 0;
+    for (; eq < arg.size && arg.str[eq] != '='; eq += 1)
+      ;
+    String name = str_substr(arg, 0, eq);
+    if (!vars_is_valid_name(name)) {
+      fprintf(stderr, "export: `%.*s': not a valid identifier\n",
+              (int)arg.size, arg.str);
+      last_exit_status = 1;
+      continue;
+    }
 
-    saved_source_fd = dup(redir_info.source_fd);
-    dup2(fd, redir_info.source_fd);
-    close(fd);
+    ShellVar *var = vars_get(&shell_vars, name);
+    if (eq < arg.size) {
+      var = vars_set(&shell_vars, name, str_substr(arg, eq + 1, arg.size));
+    } else if (var == NULL) {
+      var = vars_set(&shell_vars, name, (String){0});
+    }
+    vars_export(&shell_vars, var);
   }
+}
 
-  if (is_builtin(shell_cmd->exe)) {
-    run_builtin(arena, shell_cmd, env_path_list);
-  } else if (shell_cmd->exe.size > 0) {
-    run_exec(arena, shell_cmd, env_path_list);
+internal void unset(Arena *a, ShellCommand *shell_cmd) {
+  for (uint64_t i = 1; i < shell_cmd->args.count; i += 1) {
+    vars_unset(&shell_vars, shell_cmd->args.items[i]);
   }
+}
 
-  if (saved_source_fd > 0) {
-    dup2(saved_source_fd, redir_info.source_fd);
-    close(saved_source_fd);
+// A command made only of NAME=value words sets shell variables.
+internal void run_assignments(ShellCommand *shell_cmd) {
+  for (uint64_t i = 0; i < shell_cmd->assigns.count; i += 1) {
+    String assign = shell_cmd->assigns.items[i];
+    uint64_t eq = 0;
+    for (; assign.str[eq] != '='; eq += 1)
+      ;
+    vars_set(&shell_vars, str_substr(assign, 0, eq),
+             str_substr(assign, eq + 1, assign.size));
   }
 }
 
-internal void run_piped_shell_command(Arena *a,
-                                      PipedShellCommandList *piped_cmd_list,
-                                      StringList *env_path_list) {
-  if (piped_cmd_list->node_count == 0) {
-    return;
+// A line taken by the read builtin. Bytes escaped with a backslash are
+// marked, since they never separate fields.
+typedef struct ReadLine ReadLine;
+struct ReadLine {
+  uint8_t *bytes;
+  uint8_t *escaped;
+  uint64_t size;
+  uint64_t capacity;
+};
+
+internal bool read_line_push(Arena *a, ReadLine *line, uint8_t ch,
+                             bool escaped) {
+  if (line->size == line->capacity) {
+    uint64_t capacity = line->capacity == 0 ? 256 : line->capacity * 2;
+    uint8_t *bytes = (uint8_t *)arena_alloc(a, capacity);
+    uint8_t *marks = (uint8_t *)arena_alloc(a, capacity);
+    if (bytes == NULL || marks == NULL) {
+      return false;
+    }
+    if (line->size > 0) {
+      memcpy(bytes, line->bytes, line->size);
+      memcpy(marks, line->escaped, line->size);
+    }
+    line->bytes = bytes;
+    line->escaped = marks;
+    line->capacity = capacity;
   }
+  line->bytes[line->size] = ch;
+  line->escaped[line->size] = escaped;
+  line->size += 1;
+  return true;
+}
 
-  // no pipe
-  if (piped_cmd_list->node_count == 1) {
-    run_shell_command(a, &piped_cmd_list->first->cmd, env_path_list);
-    return;
+internal bool read_is_ifs(ReadLine *line, uint64_t i, String ifs) {
+  return !line->escaped[i] &&
+         memchr(ifs.str, line->bytes[i], ifs.size) != NULL;
+}
+
+// IFS whitespace, which runs together and is trimmed at both ends.
+internal bool read_is_ifs_space(ReadLine *line, uint64_t i, String ifs) {
+  uint8_t ch = line->bytes[i];
+  return (ch == ' ' || ch == '\t' || ch == '\n') && read_is_ifs(line, i, ifs);
+}
+
+// read [-r] [NAME...]: one line of stdin split over the names by IFS, the
+// last name getting the rest of the line, or all of it in REPLY without a
+// name. A backslash escapes the next byte and joins lines unless -r is
+// given. $? is 1 at the end of the input.
+internal void read_builtin(Arena *a, ShellCommand *shell_cmd) {
+  StringArray *args = &shell_cmd->args;
+  uint64_t first = 1;
+  bool raw = args->count > 1 && str_equal_cstr(args->items[1], "-r");
+  if (raw) {
+    first = 2;
+  }
+  for (uint64_t i = first; i < args->count; i += 1) {
+    if (!vars_is_valid_name(args->items[i])) {
+      fprintf(stderr, "read: `%.*s': not a valid identifier\n",
+              (int)args->items[i].size, args->items[i].str);
+      last_exit_status = 2;
+      return;
+    }
   }
 
-  // check if all commands are valid
-  for (PipedShellCommandNode *cmd_ptr = piped_cmd_list->first; cmd_ptr != NULL;
-       cmd_ptr = cmd_ptr->next) {
-    String exe = cmd_ptr->cmd.exe;
-    if (!is_builtin(exe)) {
-      String exe_path = search_path(a, exe, env_path_list);
-      if (exe_path.size == 0) {
-        printf("%.*s: command not found\n", (int)exe.size, exe.str);
-        return;
+  ReadLine line = {0};
+  bool eof = false;
+  bool fits = true;
+  for (;;) {
+    int ch = line_reader_getc(&stdin_reader);
+    bool escaped = false;
+    if (ch == BACKSLASH && !raw) {
+      ch = line_reader_getc(&stdin_reader);
+      if (ch == '\n') {
+        continue;
       }
+      escaped = true;
     }
+    if (ch < 0) {
+      eof = true;
+      break;
+    }
+    if (ch == '\n' && !escaped) {
+      break;
+    }
+    // NUL cannot be part of a value
+    if (ch != '\0' && fits) {
+      fits = read_line_push(a, &line, (uint8_t)ch, escaped);
+    }
+  }
+  if (!fits) {
+    fprintf(stderr, "read: line too long\n");
+    last_exit_status = 2;
+    return;
   }
 
-  int n_cmds = piped_cmd_list->node_count;
-  pid_t *pids = (pid_t *)arena_alloc(a, sizeof(pid_t) * n_cmds);
-  Pipe *pipes = (Pipe *)arena_alloc(a, sizeof(Pipe) * (n_cmds - 1));
-  for (int i = 0; i < n_cmds - 1; i += 1) {
-    pipe(pipes[i].fds);
+  if (first == args->count) {
+    vars_set(&shell_vars, str_init("REPLY", 5),
+             (String){.str = line.bytes, .size = line.size});
+    last_exit_status = eof ? 1 : 0;
+    return;
   }
 
-  PipedShellCommandNode *node_ptr = piped_cmd_list->first;
-  int cmd_idx = 0;
-  for (; node_ptr != NULL; node_ptr = node_ptr->next, cmd_idx += 1) {
+  char *env_ifs = vars_get_cstr(&shell_vars, "IFS");
+  String ifs = env_ifs != NULL ? str_init(env_ifs, strlen(env_ifs))
+                               : str_init(" \t\n", 3);
+  uint64_t i = 0;
+  for (; i < line.size && read_is_ifs_space(&line, i, ifs); i += 1)
+    ;
+  for (uint64_t n = first; n < args->count; n += 1) {
+    uint64_t start = i;
+    uint64_t end = i;
+    if (n + 1 == args->count) {
+      end = line.size;
+      for (; end > start && read_is_ifs_space(&line, end - 1, ifs); end -= 1)
+        ;
+      i = line.size;
+    } else {
+      for (; i < line.size && !read_is_ifs(&line, i, ifs); i += 1)
+        ;
+      end = i;
+      // one separator: IFS whitespace around at most one other IFS byte
+      for (; i < line.size && read_is_ifs_space(&line, i, ifs); i += 1)
+        ;
+      if (i < line.size && read_is_ifs(&line, i, ifs)) {
+        i += 1;
+        for (; i < line.size && read_is_ifs_space(&line, i, ifs); i += 1)
+          ;
+      }
+    }
+    vars_set(&shell_vars, args->items[n],
+             (String){.str = line.bytes + start, .size = end - start});
+  }
+  last_exit_status = eof ? 1 : 0;
+}
+
+internal void run_builtin(Arena *arena, ShellCommand *shell_cmd,
+                          StringList *env_path_list);
+
+#define PARALLEL_READ_SIZE (64 * KB)
+// Jobs running at once, whatever -j asks for. Each holds two pipes open.
+#define PARALLEL_JOBS_MAX 256
+
+// One running job of the parallel builtin. Its stdout and stderr are
+// buffered whole and written out together once it is done, so the output
+// of concurrent jobs never interleaves. The buffers stay with the slot.
+typedef struct ParallelJob ParallelJob;
+struct ParallelJob {
+  pid_t pid; // 0 for a free slot
+  String item;
+  int fds[2]; // stdout and stderr pipes, -1 at end of file
+  bool exited;
+  int status;
+  uint8_t *buf[2];
+  uint64_t size[2];
+  uint64_t capacity[2];
+};
+
+// Whether builtin can run with words words, its name included. Says why
+// not when it cannot.
+internal bool parallel_arity_ok(String builtin, uint64_t words) {
+  int arity = builtin_arity(builtin);
+  if (arity >= 0 && words != (uint64_t)arity) {
+    fprintf(stderr,
+            "parallel: %.*s: wrong number of arguments (%lu, takes %d)\n",
+            (int)builtin.size, builtin.str, (unsigned long)(words - 1),
+            arity - 1);
+    return false;
+  }
+  return true;
+}
+
+// The number of {} in arg.
+internal uint64_t parallel_holes(String arg) {
+  uint64_t count = 0;
+  for (uint64_t i = 0; i + 1 < arg.size; i += 1) {
+    if (arg.str[i] == '{' && arg.str[i + 1] == '}') {
+      count += 1;
+      i += 1;
+    }
+  }
+  return count;
+}
+
+// arg with every {} replaced by item, counted first so the result is
+// copied once into a single allocation. Adds the number of {} to *hits.
+// NULL str when the arena is full.
+internal String parallel_fill(Arena *a, String arg, String item,
+                              uint64_t *hits) {
+  uint64_t count = parallel_holes(arg);
+  *hits += count;
+  if (count == 0) {
+    return arg;
+  }
+
+  String result = {0};
+  result.str = (uint8_t *)arena_alloc(a, arg.size + count * item.size);
+  if (result.str == NULL) {
+    return result;
+  }
+  for (uint64_t i = 0; i < arg.size; i += 1) {
+    if (i + 1 < arg.size && arg.str[i] == '{' && arg.str[i + 1] == '}') {
+      memcpy(result.str + result.size, item.str, item.size);
+      result.size += item.size;
+      i += 1;
+    } else {
+      result.str[result.size] = arg.str[i];
+      result.size += 1;
+    }
+  }
+  return result;
+}
+
+internal bool parallel_start(Arena *a, ParallelJob *jobs, int slot_count,
+                             ParallelJob *job, StringArray command,
+                             String item, bool stdin_items,
+                             StringList *env_path_list) {
+  TempArenaMemory temp = temp_arena_memory_begin(a);
+
+  // the item goes in place of {}, or last when there is none
+  StringArray args = {0};
+  uint64_t hits = 0;
+  for (uint64_t i = 0; i < command.count; i += 1) {
+    String arg = parallel_fill(a, command.items[i], item, &hits);
+    if (arg.str == NULL) {
+      fprintf(stderr, "parallel: out of memory\n");
+      temp_arena_memory_end(temp);
+      return false;
+    }
+    str_array_push(a, &args, arg);
+  }
+  if (hits == 0) {
+    str_array_push(a, &args, item);
+  }
+  ShellCommand cmd = {.exe = args.items[0], .args = args};
+  cmd.builtin = is_builtin(cmd.exe);
+  // with the item as the name, which parallel could not check up front
+  if (cmd.builtin && !parallel_arity_ok(cmd.exe, args.count)) {
+    temp_arena_memory_end(temp);
+    return false;
+  }
+
+  int out[2];
+  int err[2];
+  if (pipe(out) != 0) {
+    perror("pipe");
+    temp_arena_memory_end(temp);
+    return false;
+  }
+  if (pipe(err) != 0) {
+    perror("pipe");
+    close(out[0]);
+    close(out[1]);
+    temp_arena_memory_end(temp);
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    // parallel blocks it to wait on a signalfd, exec would pass that on
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    for (int i = 0; i < slot_count; i += 1) {
+      if (jobs[i].pid > 0) {
+        for (int f = 0; f < 2; f += 1) {
+          if (jobs[i].fds[f] >= 0) {
+            close(jobs[i].fds[f]);
+          }
+        }
+      }
+    }
+    // the items are being read from stdin, jobs must not see the rest
+    if (stdin_items) {
+      int null_fd = open("/dev/null", O_RDONLY);
+      dup2(null_fd, STDIN_FILENO);
+      close(null_fd);
+    }
+
+    if (cmd.builtin) {
+      run_builtin(a, &cmd, env_path_list);
+      child_exit(last_exit_status);
+    }
+    String exe_path = resolve_command(a, cmd.exe, env_path_list);
+    if (exe_path.size == 0) {
+      fprintf(stderr, "%.*s: command not found\n", (int)cmd.exe.size,
+              cmd.exe.str);
+      _exit(127);
+    }
+    char **argv = NULL;
+    cmd_to_execvp_args(a, &cmd, &argv);
+    execve((char *)exe_path.str, argv, cmd_envp(a, &cmd));
+    perror("execve");
+    _exit(127);
+  }
+
+  close(out[1]);
+  close(err[1]);
+  temp_arena_memory_end(temp);
+  if (pid < 0) {
+    perror("fork");
+    close(out[0]);
+    close(err[0]);
+    return false;
+  }
+
+  job->pid = pid;
+  job->item = item;
+  job->fds[0] = out[0];
+  job->fds[1] = err[0];
+  job->exited = false;
+  job->status = 0;
+  job->size[0] = 0;
+  job->size[1] = 0;
+  return true;
+}
+
+// Reads what is available on one of the job's pipes. Returns false when
+// the buffer cannot grow, with the pipe closed: the job's output stops
+// there, and writing more fails it.
+internal bool parallel_read(ParallelJob *job, int f) {
+  if (job->size[f] + PARALLEL_READ_SIZE > job->capacity[f]) {
+    uint64_t capacity = job->capacity[f] == 0 ? PARALLEL_READ_SIZE
+                                              : job->capacity[f] * 2;
+    uint8_t *buf = (uint8_t *)realloc(job->buf[f], capacity);
+    if (buf == NULL) {
+      close(job->fds[f]);
+      job->fds[f] = -1;
+      return false;
+    }
+    job->buf[f] = buf;
+    job->capacity[f] = capacity;
+  }
+
+  ssize_t n = read(job->fds[f], job->buf[f] + job->size[f],
+                   job->capacity[f] - job->size[f]);
+  if (n > 0) {
+    job->size[f] += n;
+  } else if (n == 0 || errno != EINTR) {
+    close(job->fds[f]);
+    job->fds[f] = -1;
+  }
+  return true;
+}
+
+// parallel [-j N] [-v] command [arg...] [::: item...]
+//
+// Runs command once per item, N at a time (the number of cores by
+// default). Items come after ::: or, without it, one per line from stdin.
+// {} in the command stands for the item, otherwise it is appended. Output
+// is grouped per job, failed jobs are reported (every job with -v) and a
+// summary with the throughput goes to stderr. $? is the number of failed
+// jobs, at most 101.
+internal void parallel(Arena *a, ShellCommand *shell_cmd,
+                       StringList *env_path_list) {
+  StringArray args = shell_cmd->args;
+  long slot_count = sysconf(_SC_NPROCESSORS_ONLN);
+  bool verbose = false;
+
+  uint64_t i = 1;
+  for (; i < args.count && args.items[i].size > 1; i += 1) {
+    String opt = args.items[i];
+    if (opt.str[0] != '-') {
+      break;
+    }
+    if (str_equal_cstr(opt, "-v")) {
+      verbose = true;
+      continue;
+    }
+    String n = {0};
+    if (str_equal_cstr(opt, "-j") && i + 1 < args.count) {
+      i += 1;
+      n = args.items[i];
+    } else if (opt.str[1] == 'j') {
+      n = str_substr(opt, 2, opt.size);
+    }
+    // strtol saturates, so a huge N is clamped below rather than wrapping
+    long jobs = str_is_posnum(n) ? strtol(to_cstring(a, n), NULL, 10) : 0;
+    if (jobs <= 0) {
+      fprintf(stderr, "parallel: usage: parallel [-j N] [-v] command "
+                      "[arg...] [::: item...]\n");
+      last_exit_status = 2;
+      return;
+    }
+    slot_count = jobs;
+  }
+  if (slot_count <= 0) {
+    slot_count = 1;
+  }
+
+  StringArray command = {0};
+  for (; i < args.count && !str_equal_cstr(args.items[i], ":::"); i += 1) {
+    str_array_push(a, &command, args.items[i]);
+  }
+  if (command.count == 0) {
+    fprintf(stderr, "parallel: no command given\n");
+    last_exit_status = 2;
+    return;
+  }
+  // a builtin that asserts how many words it gets would fail every job
+  uint64_t holes = 0;
+  for (uint64_t j = 0; j < command.count; j += 1) {
+    holes += parallel_holes(command.items[j]);
+  }
+  uint64_t words = command.count + (holes == 0 ? 1 : 0);
+  if (is_builtin(command.items[0]) &&
+      !parallel_arity_ok(command.items[0], words)) {
+    last_exit_status = 2;
+    return;
+  }
+
+  // jobs and the items see stdin from where read left off
+  shell_io_sync();
+  StringArray items = {0};
+  bool stdin_items = i == args.count;
+  if (stdin_items) {
+    ArenaStream input = {.arena = a};
+    arena_stream_read_fd(&input, STDIN_FILENO);
+    String text = {.str = input.buf, .size = input.size};
+    uint64_t start = 0;
+    for (uint64_t j = 0; j <= text.size; j += 1) {
+      if (j == text.size || text.str[j] == '\n') {
+        if (j > start) {
+          str_array_push(a, &items, str_substr(text, start, j));
+        }
+        start = j + 1;
+      }
+    }
+  } else {
+    for (i += 1; i < args.count; i += 1) {
+      str_array_push(a, &items, args.items[i]);
+    }
+  }
+
+  // more slots than items would only sit empty
+  if (slot_count > (long)items.count) {
+    slot_count = items.count > 0 ? (long)items.count : 1;
+  }
+  if (slot_count > PARALLEL_JOBS_MAX) {
+    slot_count = PARALLEL_JOBS_MAX;
+  }
+  ParallelJob *jobs =
+      (ParallelJob *)arena_alloc(a, sizeof(ParallelJob) * slot_count);
+  struct pollfd *pfds = (struct pollfd *)arena_alloc(
+      a, sizeof(struct pollfd) * (slot_count * 2 + 1));
+  if (jobs == NULL || pfds == NULL) {
+    fprintf(stderr, "parallel: out of memory\n");
+    last_exit_status = 1;
+    return;
+  }
+
+  // exits wake the poll below through a signalfd, as in the zygote.
+  // Without one a job whose pipes are closed is polled for every 10 ms.
+  sigset_t chld;
+  sigset_t old_mask;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &old_mask);
+  int sigfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+
+  uint64_t next = 0;
+  uint64_t done = 0;
+  uint64_t failed = 0;
+  int running = 0;
+  bool interrupted = false;
+  double start = now_ms();
+
+  while (running > 0 || (next < items.count && !interrupted)) {
+    // refill free slots
+    for (int s = 0; s < slot_count && next < items.count && !interrupted;
+         s += 1) {
+      if (jobs[s].pid != 0) {
+        continue;
+      }
+      if (parallel_start(a, jobs, slot_count, &jobs[s], command,
+                         items.items[next], stdin_items, env_path_list)) {
+        running += 1;
+      } else {
+        failed += 1;
+        done += 1;
+      }
+      next += 1;
+    }
+
+    // wait for output or for a job to exit
+    int nfds = 0;
+    bool waiting_exit = false;
+    if (sigfd >= 0) {
+      pfds[nfds] = (struct pollfd){.fd = sigfd, .events = POLLIN};
+      nfds += 1;
+    }
+    for (int s = 0; s < slot_count; s += 1) {
+      if (jobs[s].pid == 0) {
+        continue;
+      }
+      for (int f = 0; f < 2; f += 1) {
+        if (jobs[s].fds[f] >= 0) {
+          pfds[nfds] = (struct pollfd){.fd = jobs[s].fds[f], .events = POLLIN};
+          nfds += 1;
+        }
+      }
+      waiting_exit = waiting_exit ||
+                     (jobs[s].fds[0] < 0 && jobs[s].fds[1] < 0);
+    }
+    int timeout = sigfd < 0 && waiting_exit ? 10 : -1;
+    if (running > 0 && nfds > 0 && poll(pfds, nfds, timeout) > 0) {
+      struct signalfd_siginfo info;
+      while (sigfd >= 0 && read(sigfd, &info, sizeof(info)) > 0)
+        ;
+      for (int s = 0; s < slot_count; s += 1) {
+        for (int f = 0; jobs[s].pid != 0 && f < 2; f += 1) {
+          for (int p = 0; p < nfds; p += 1) {
+            if (pfds[p].fd == jobs[s].fds[f] && pfds[p].revents != 0) {
+              if (!parallel_read(&jobs[s], f)) {
+                fprintf(stderr, "parallel: [%.*s] out of memory, output cut\n",
+                        (int)jobs[s].item.size, jobs[s].item.str);
+              }
+              break;
+            }
+          }
+        }
+      }
+    } else if (nfds == 0 && running > 0) {
+      struct timespec pause = {.tv_nsec = 10 * 1000 * 1000};
+      nanosleep(&pause, NULL);
+    }
+
+    // reap without blocking, a job is done once it exited and its output
+    // is drained
+    for (int s = 0; s < slot_count; s += 1) {
+      ParallelJob *job = &jobs[s];
+      if (job->pid != 0 && !job->exited &&
+          waitpid(job->pid, &job->status, WNOHANG) == job->pid) {
+        job->exited = true;
+      }
+      if (job->pid == 0 || !job->exited || job->fds[0] >= 0 ||
+          job->fds[1] >= 0) {
+        continue;
+      }
+
+      fwrite(job->buf[0], 1, job->size[0], stdout);
+      fflush(stdout);
+      fwrite(job->buf[1], 1, job->size[1], stderr);
+      int status = exit_status(job->status);
+      if (status != 0) {
+        failed += 1;
+      }
+      if (verbose || status != 0) {
+        fprintf(stderr, "parallel: [%.*s] exited with %d\n",
+                (int)job->item.size, job->item.str, status);
+      }
+      if (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT) {
+        interrupted = true;
+      }
+      job->pid = 0;
+      running -= 1;
+      done += 1;
+    }
+  }
+
+  for (int s = 0; s < slot_count; s += 1) {
+    free(jobs[s].buf[0]);
+    free(jobs[s].buf[1]);
+  }
+  if (sigfd >= 0) {
+    close(sigfd);
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  double elapsed = (now_ms() - start) / 1000.0;
+  fprintf(stderr, "parallel: %lu jobs, %lu failed, %ld at a time, %.3f s, "
+                  "%.1f jobs/s\n",
+          (unsigned long)done, (unsigned long)failed, slot_count, elapsed,
+          elapsed > 0 ? done / elapsed : 0.0);
+  if (interrupted && next < items.count) {
+    fprintf(stderr, "parallel: interrupted, %lu items not run\n",
+            (unsigned long)(items.count - next));
+  }
+  last_exit_status = failed > 101 ? 101 : (int)failed;
+}
+
+internal void shell_arenas_init(void) {
+  arena_init(&shell_arenas.session, malloc(SESSION_ARENA_SIZE),
+             SESSION_ARENA_SIZE);
+  arena_init(&shell_arenas.prompt, malloc(PROMPT_ARENA_SIZE),
+             PROMPT_ARENA_SIZE);
+}
+
+internal void shell_arenas_release(void) {
+  for (int i = 0; i < shell_arenas.stage_count; i += 1) {
+    free(shell_arenas.stages[i].buf);
+  }
+  free(shell_arenas.stages);
+  free(shell_arenas.session.buf);
+  free(shell_arenas.prompt.buf);
+  shell_arenas = (ShellArenas){0};
+}
+
+// Scratch arenas for the n stages of a pipeline, all reset. The array may
+// move when it grows, so it is only good until the next call.
+internal Arena *shell_stage_arenas(int n) {
+  if (n > shell_arenas.stage_count) {
+    shell_arenas.stages =
+        (Arena *)realloc(shell_arenas.stages, sizeof(Arena) * n);
+    for (int i = shell_arenas.stage_count; i < n; i += 1) {
+      arena_init(&shell_arenas.stages[i], malloc(STAGE_ARENA_SIZE),
+                 STAGE_ARENA_SIZE);
+    }
+    shell_arenas.stage_count = n;
+  }
+  for (int i = 0; i < n; i += 1) {
+    arena_free_all(&shell_arenas.stages[i]);
+  }
+  return shell_arenas.stages;
+}
+
+internal void arena_report(FILE *out, const char *name, Arena *a) {
+  fprintf(out, "%-10s %12zu %12zu %12zu", name, a->curr_offset,
+          a->high_water, a->buf_size);
+#ifdef ARENA_STATS
+  fprintf(out, " %10lu %10lu %10lu %8lu", a->stats.allocs, a->stats.padding,
+          a->stats.abandoned, a->stats.failures);
+#endif
+  fprintf(out, "\n");
+}
+
+internal void arena_report_header(FILE *out) {
+  fprintf(out, "%-10s %12s %12s %12s", "arena", "used", "high-water", "size");
+#ifdef ARENA_STATS
+  fprintf(out, " %10s %10s %10s %8s", "allocs", "padding", "abandoned",
+          "failed");
+#endif
+  fprintf(out, "\n");
+}
+
+// Current use and high-water mark of every shell arena, in bytes.
+internal void shell_arenas_report(FILE *out) {
+  arena_report_header(out);
+  arena_report(out, "session", &shell_arenas.session);
+  arena_report(out, "prompt", &shell_arenas.prompt);
+  arena_report(out, "path", &shell_path_arena);
+  for (int i = 0; i < shell_arenas.stage_count; i += 1) {
+    char name[32];
+    snprintf(name, sizeof(name), "stage %d", i);
+    arena_report(out, name, &shell_arenas.stages[i]);
+  }
+}
+
+// Value in kB of a "Key:" line of /proc/self/status, 0 when missing.
+internal uint64_t proc_status_kb(const char *key) {
+  uint64_t result = 0;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL) {
+    return result;
+  }
+  char line[256];
+  size_t key_size = strlen(key);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, key, key_size) == 0 && line[key_size] == ':') {
+      result = strtoull(line + key_size + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+// memstats: where the shell's memory goes. Allocation counts, alignment
+// padding and bytes abandoned by moving resizes (str_array_push growth
+// among them) need a build with ARENA_STATS.
+internal void memstats(void) {
+  shell_arenas_report(stdout);
+  if (cmd_index.trie != NULL) {
+    arena_report(stdout, "trie", &cmd_index.trie->arena);
+  }
+  arena_report(stdout, "ranks", &cmd_index.rank_arena);
+  arena_report(stdout, "complete", &cmd_index.scratch_arena);
+  arena_report(stdout, "dirs", &dir_cache.scratch_arena);
+#ifndef ARENA_STATS
+  printf("(allocation counters not compiled in, build with ARENA_STATS)\n");
+#endif
+
+  printf("\n");
+  printf("interned   %lu strings, %lu bytes in %lu blocks, %lu hits saved "
+         "%lu bytes\n",
+         shell_strings.count, shell_strings.bytes,
+         shell_strings.full_block_count + 1, shell_strings.hits,
+         shell_strings.bytes_saved);
+  printf("index      %lu commands\n",
+         cmd_index.trie != NULL ? cmd_index.trie->command_count : 0);
+  printf("path cache %lu hits, %lu misses\n", path_cache.hits,
+         path_cache.misses);
+  printf("history    %d entries, %d bytes\n", history_length,
+         history_total_bytes());
+  printf("rss        %lu kB, peak %lu kB\n", proc_status_kb("VmRSS"),
+         proc_status_kb("VmHWM"));
+}
+
+// Strips `place [-c CPUS] [-s] [-g CGROUP] [-m MEMORY] [-q PERCENT]`
+// prefixes off cmd into place, leaving the command they run, which is then
+// placed between fork and exec. Returns false, with $? set, on a bad
+// option.
+internal bool place_take(Arena *a, ShellCommand *cmd, Placement *place) {
+  *place = (Placement){0};
+  while (cmd->builtin && str_equal_cstr(cmd->exe, "place")) {
+    StringArray args = cmd->args;
+    uint64_t i = 1;
+    bool ok = true;
+    while (ok && i < args.count) {
+      String opt = args.items[i];
+      if (str_equal_cstr(opt, "--")) {
+        i += 1;
+        break;
+      }
+      if (opt.size < 2 || opt.str[0] != '-') {
+        break;
+      }
+      if (str_equal_cstr(opt, "-s")) {
+        place->spread = true;
+        i += 1;
+        continue;
+      }
+      String value = i + 1 < args.count ? args.items[i + 1] : (String){0};
+      if (str_equal_cstr(opt, "-c")) {
+        place->has_cpus = true;
+        ok = cpu_list_parse(value, &place->cpus) && CPU_COUNT(&place->cpus);
+      } else if (str_equal_cstr(opt, "-g")) {
+        place->cgroup = value;
+        ok = value.size > 0;
+      } else if (str_equal_cstr(opt, "-m")) {
+        place->memory_max = value;
+        ok = value.size > 0;
+      } else if (str_equal_cstr(opt, "-q")) {
+        place->cpu_percent = str_is_posnum(value) && value.size < 6
+                                 ? atoi(to_cstring(a, value))
+                                 : 0;
+        ok = place->cpu_percent > 0;
+      } else {
+        ok = false;
+      }
+      i += 2;
+    }
+    if (!ok || i >= args.count) {
+      fprintf(stderr, "place: usage: place [-c CPUS] [-s] [-g CGROUP] "
+                      "[-m MEMORY] [-q PERCENT] command [arg...]\n");
+      last_exit_status = 2;
+      return false;
+    }
+
+    cmd->args = (StringArray){.items = args.items + i,
+                              .count = args.count - i,
+                              .capacity = args.count - i};
+    cmd->exe = cmd->args.items[0];
+    cmd->builtin = is_builtin(cmd->exe);
+  }
+  return true;
+}
+
+// The descriptor a redirect puts in place: the file it opens, the one
+// N>&M copies, or -1 for N>&-. Returns false, with $? set, when the file
+// cannot be opened or M is not open.
+internal bool redirect_open(Arena *a, RedirectInfo *info, int *fd) {
+  if (info->dup) {
+    *fd = info->dup_fd;
+    if (*fd >= 0 && fcntl(*fd, F_GETFD) < 0) {
+      fprintf(stderr, "%d: %s\n", *fd, strerror(errno));
+      last_exit_status = 1;
+      return false;
+    }
+    return true;
+  }
+
+  char *file_name = to_cstring(a, info->file_name);
+  int flags = info->input ? O_RDONLY : O_WRONLY | O_CREAT | info->flag;
+  *fd = open(file_name, flags, 0644);
+  if (*fd < 0) {
+    fprintf(stderr, "%s: %s\n", file_name, strerror(errno));
+    last_exit_status = 1;
+    return false;
+  }
+  return true;
+}
+
+// Puts fd from redirect_open in place of the redirected descriptor.
+internal void redirect_apply(RedirectInfo *info, int fd) {
+  exec_fds_flush();
+  if (info->source_fd == STDIN_FILENO) {
+    line_reader_sync(&stdin_reader);
+  }
+  if (fd < 0) {
+    close(info->source_fd);
+  } else if (fd != info->source_fd) {
+    dup2(fd, info->source_fd);
+    if (!info->dup) {
+      close(fd);
+    }
+  }
+}
+
+// Points the redirected descriptor at the file while one command runs.
+// saved gets the descriptor it replaced, for redirect_end. Returns false,
+// with $? set, when the redirect cannot be done.
+internal bool redirect_begin(Arena *a, RedirectInfo *info, int *saved) {
+  // kept out of the way of commands, which must not inherit it, and taken
+  // first so that open cannot hand out the redirected descriptor itself
+  *saved = fcntl(info->source_fd, F_DUPFD_CLOEXEC, 10);
+  int fd = -1;
+  if (!redirect_open(a, info, &fd)) {
+    if (*saved >= 0) {
+      close(*saved);
+    }
+    return false;
+  }
+  redirect_apply(info, fd);
+  return true;
+}
+
+// Stream a builtin redirected with >&N or 2>&N writes to instead of N,
+// when exec opened N.
+internal FILE *exec_fd_stream(RedirectInfo *info) {
+  if (!info->dup || info->dup_fd < 0 ||
+      (info->source_fd != STDOUT_FILENO && info->source_fd != STDERR_FILENO)) {
+    return NULL;
+  }
+  return exec_fd_streams[info->dup_fd];
+}
+
+// exec REDIRECT applies the redirect to the shell for good: every later
+// command inherits the descriptor, and >&N reaches it without opening
+// anything. With -b what builtins write to >&N is kept in a buffer until
+// anything else could write to N. exec COMMAND replaces the shell with the
+// command.
+internal void exec_builtin(Arena *a, ShellCommand *shell_cmd,
+                           StringList *env_path_list) {
+  last_exit_status = 0;
+  StringArray args = shell_cmd->args;
+  uint64_t i = 1;
+  bool buffered = i < args.count && str_equal_cstr(args.items[i], "-b");
+  if (buffered) {
+    i += 1;
+  }
+
+  RedirectInfo *info = &shell_cmd->redir_info;
+  int fd = -1;
+  if (redirect_is_set(info)) {
+    if (!redirect_open(a, info, &fd)) {
+      return;
+    }
+    exec_fd_release(info->source_fd);
+    redirect_apply(info, fd);
+    if (info->source_fd > STDERR_FILENO && fd >= 0) {
+      exec_fd_mask |= 1u << info->source_fd;
+    } else if (info->source_fd > STDERR_FILENO) {
+      exec_fd_mask &= ~(1u << info->source_fd);
+    }
+  }
+  if (fd >= 0 && !info->input && info->source_fd < EXEC_FD_COUNT) {
+    // over a copy of the descriptor, so that dropping the stream leaves
+    // the descriptor alone
+    int copy = fcntl(info->source_fd, F_DUPFD_CLOEXEC, 10);
+    FILE *stream = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (stream != NULL) {
+      setvbuf(stream, NULL, _IOFBF, EXEC_FD_BUFFER_SIZE);
+      exec_fd_streams[info->source_fd] = stream;
+      if (buffered) {
+        exec_fd_buffered |= 1u << info->source_fd;
+      }
+    } else if (copy >= 0) {
+      close(copy);
+    }
+  }
+  if (i == args.count) {
+    return;
+  }
+
+  String exe = args.items[i];
+  String exe_path = resolve_command(a, exe, env_path_list);
+  if (exe_path.size == 0) {
+    fprintf(stderr, "exec: %.*s: not found\n", (int)exe.size, exe.str);
+    last_exit_status = 127;
+    return;
+  }
+  ShellCommand command = *shell_cmd;
+  command.args = (StringArray){.items = args.items + i,
+                               .count = args.count - i,
+                               .capacity = args.count - i};
+  char **argv = NULL;
+  cmd_to_execvp_args(a, &command, &argv);
+  char **envp = cmd_envp(a, &command);
+  shell_io_sync();
+  execve((char *)exe_path.str, argv, envp);
+  fprintf(stderr, "exec: %.*s: %s\n", (int)exe.size, exe.str,
+          strerror(errno));
+  last_exit_status = 126;
+}
+
+internal void run_builtin(Arena *arena, ShellCommand *shell_cmd,
+                          StringList *env_path_list) {
+  last_exit_status = 0;
+  if (str_equal_cstr(shell_cmd->exe, "echo")) {
+    echo(shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "pwd")) {
+    pwd(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "type")) {
+    type(arena, shell_cmd, env_path_list);
+  } else if (str_equal_cstr(shell_cmd->exe, "cd")) {
+    cd(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "history")) {
+    history(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "jobs")) {
+    jobs(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "export")) {
+    export(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "unset")) {
+    unset(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "parallel")) {
+    parallel(arena, shell_cmd, env_path_list);
+  } else if (str_equal_cstr(shell_cmd->exe, "memstats")) {
+    memstats();
+  } else if (str_equal_cstr(shell_cmd->exe, "false")) {
+    last_exit_status = 1;
+  } else if (str_equal_cstr(shell_cmd->exe, "read")) {
+    read_builtin(arena, shell_cmd);
+  } else if (str_equal_cstr(shell_cmd->exe, "exec")) {
+    exec_builtin(arena, shell_cmd, env_path_list);
+  }
+}
+
+internal void redirect_end(RedirectInfo *info, int saved) {
+  if (info->source_fd == STDIN_FILENO) {
+    line_reader_sync(&stdin_reader);
+  }
+  if (saved >= 0) {
+    dup2(saved, info->source_fd);
+    close(saved);
+  } else {
+    close(info->source_fd);
+  }
+}
+
+internal void run_shell_command(Arena *arena, ShellCommand *shell_cmd,
+                                StringList *env_path_list) {
+  Placement place;
+  if (!place_take(arena, shell_cmd, &place)) {
+    return;
+  }
+
+  if (str_equal_cstr(shell_cmd->exe, "exec")) {
+    exec_builtin(arena, shell_cmd, env_path_list);
+    return;
+  }
+  if (str_equal_cstr(shell_cmd->exe, "exit")) {
+    if (shell_cmd->args.count > 1 && str_is_posnum(shell_cmd->args.items[1])) {
+      last_exit_status = atoi(to_cstring(arena, shell_cmd->args.items[1]));
+    }
+    shell_running = false;
+    return;
+  }
+  if (shell_cmd->exe.size == 0) {
+    run_assignments(shell_cmd);
+    return;
+  }
+
+  int saved_fd = -1;
+  RedirectInfo *redir_info = &shell_cmd->redir_info;
+  FILE *stream = shell_cmd->builtin ? exec_fd_stream(redir_info) : NULL;
+  if (stream == NULL && redirect_is_set(redir_info) &&
+      !redirect_begin(arena, redir_info, &saved_fd)) {
+    return;
+  }
+
+  // a builtin runs in the shell, which is not moved
+  PlacementPlan plan = {.cgroup_procs = -1};
+  if (shell_cmd->builtin) {
+    exec_fds_flush_std(stream);
+  }
+  if (stream != NULL) {
+    FILE **target = redir_info->source_fd == STDERR_FILENO ? &stderr : &stdout;
+    FILE *saved_stream = *target;
+    *target = stream;
+    run_builtin(arena, shell_cmd, env_path_list);
+    *target = saved_stream;
+    if ((exec_fd_buffered & (1u << redir_info->dup_fd)) == 0) {
+      fflush(stream);
+    }
+  } else if (shell_cmd->builtin) {
+    run_builtin(arena, shell_cmd, env_path_list);
+  } else if (!placement_plan(arena, &place, 1, &plan)) {
+    last_exit_status = 1;
+  } else {
+    run_exec(arena, shell_cmd, env_path_list, &plan);
+  }
+  if (plan.cgroup_procs >= 0) {
+    close(plan.cgroup_procs);
+  }
+
+  if (stream == NULL && redirect_is_set(redir_info)) {
+    redirect_end(redir_info, saved_fd);
+  }
+}
+
+internal void run_piped_shell_command(Arena *a,
+                                      PipedShellCommandList *piped_cmd_list,
+                                      StringList *env_path_list) {
+  if (piped_cmd_list->node_count == 0) {
+    return;
+  }
+
+  int n_cmds = piped_cmd_list->node_count;
+  Arena *stage_arenas = shell_stage_arenas(n_cmds);
+
+  // no pipe
+  if (n_cmds == 1) {
+    run_shell_command(&stage_arenas[0], &piped_cmd_list->first->cmd,
+                      env_path_list);
+    return;
+  }
+
+  // resolve every command before starting any
+  PipelineStage *stages =
+      (PipelineStage *)arena_alloc(a, sizeof(PipelineStage) * n_cmds);
+  Placement *places = (Placement *)arena_alloc(a, sizeof(Placement) * n_cmds);
+  PipedShellCommandNode *cmd_ptr = piped_cmd_list->first;
+  for (int i = 0; cmd_ptr != NULL; cmd_ptr = cmd_ptr->next, i += 1) {
+    ShellCommand *cmd = &cmd_ptr->cmd;
+    PipelineStage *stage = &stages[i];
+    stage->arena = &stage_arenas[i];
+    if (!place_take(stage->arena, cmd, &places[i])) {
+      return;
+    }
+    if (cmd->exe.size == 0 || cmd->builtin) {
+      continue;
+    }
+
+    String exe_path = resolve_command(stage->arena, cmd->exe, env_path_list);
+    if (exe_path.size == 0) {
+      printf("%.*s: command not found\n", (int)cmd->exe.size, cmd->exe.str);
+      last_exit_status = 127;
+      return;
+    }
+    stage->path = (char *)exe_path.str;
+    cmd_to_execvp_args(stage->arena, cmd, &stage->argv);
+    stage->envp = cmd_envp(stage->arena, cmd);
+  }
+  PlacementPlan plan = {0};
+  if (!placement_plan(a, places, n_cmds, &plan)) {
+    last_exit_status = 1;
+    return;
+  }
+
+  shell_io_sync();
+  pid_t *pids = (pid_t *)arena_alloc(a, sizeof(pid_t) * n_cmds);
+  Pipe *pipes = (Pipe *)arena_alloc(a, sizeof(Pipe) * (n_cmds - 1));
+  for (int i = 0; i < n_cmds - 1; i += 1) {
+    pipe(pipes[i].fds);
+  }
+
+  PipedShellCommandNode *node_ptr = piped_cmd_list->first;
+  int cmd_idx = 0;
+  for (; node_ptr != NULL; node_ptr = node_ptr->next, cmd_idx += 1) {
     ShellCommand cmd = node_ptr->cmd;
 
     pids[cmd_idx] = fork();
@@ -643,11 +1823,17 @@ internal void run_piped_shell_command(Arena *a,
       for (int i = 0; i < cmd_idx; i += 1) {
         waitpid(pids[i], NULL, 0);
       }
+      if (plan.cgroup_procs >= 0) {
+        close(plan.cgroup_procs);
+      }
       return;
     }
     if (pids[cmd_idx] == 0) {
       signal(SIGINT, SIG_DFL);
       signal(SIGTSTP, SIG_DFL);
+      if (!placement_apply(&plan, cmd_idx)) {
+        child_exit(126);
+      }
       if (cmd_idx == 0) {
         dup2(pipes[0].fds[1], STDOUT_FILENO);
       } else if (cmd_idx == n_cmds - 1) {
@@ -664,15 +1850,22 @@ internal void run_piped_shell_command(Arena *a,
       }
 
       // execute
-      if (is_builtin(cmd.exe)) {
-        run_builtin(a, &cmd, env_path_list);
-        exit(0);
+      PipelineStage *stage = &stages[cmd_idx];
+      int saved_fd = -1;
+      if (redirect_is_set(&cmd.redir_info) &&
+          !redirect_begin(stage->arena, &cmd.redir_info, &saved_fd)) {
+        child_exit(last_exit_status);
+      }
+      if (cmd.builtin) {
+        run_builtin(stage->arena, &cmd, env_path_list);
+        child_exit(last_exit_status);
+      } else if (stage->path == NULL) {
+        // only assignments, which do not outlive the stage
+        child_exit(0);
       } else {
-        char **args = NULL;
-        cmd_to_execvp_args(a, &cmd, &args);
-        execvp(args[0], args);
-        perror("execvp");
-        exit(1);
+        execve(stage->path, stage->argv, stage->envp);
+        perror("execve");
+        child_exit(127);
       }
     }
   }
@@ -682,13 +1875,447 @@ internal void run_piped_shell_command(Arena *a,
     close(pipes[i].fds[0]);
     close(pipes[i].fds[1]);
   }
-  // wait on finish
+  if (plan.cgroup_procs >= 0) {
+    close(plan.cgroup_procs);
+  }
+  // wait on finish, $? is the status of the last stage
   for (int i = 0; i < n_cmds; i += 1) {
-    waitpid(pids[i], NULL, 0);
+    int status = 0;
+    waitpid(pids[i], &status, 0);
+    if (i == n_cmds - 1) {
+      last_exit_status = exit_status(status);
+    }
+  }
+}
+
+// Builtins that change the shell itself. Inside a substitution they run in
+// a child like any other command, so the change does not leak out.
+internal bool is_state_builtin(String exe) {
+  return str_equal_cstr(exe, "cd") || str_equal_cstr(exe, "exit") ||
+         str_equal_cstr(exe, "export") || str_equal_cstr(exe, "unset") ||
+         str_equal_cstr(exe, "history") || str_equal_cstr(exe, "read") ||
+         str_equal_cstr(exe, "exec");
+}
+
+// Re-splits $PATH into shell_path_list when it changed. The list lives in
+// its own small arena that is reset every time, since PATH only changes
+// through an assignment.
+internal void refresh_path_list(bool force) {
+  if (!force && shell_path_generation == shell_vars.path_generation) {
+    return;
+  }
+  shell_path_generation = shell_vars.path_generation;
+
+  Arena *a = &shell_path_arena;
+  arena_free_all(a);
+  shell_path_list = (StringList){0};
+  char *env_path = vars_get_cstr(&shell_vars, "PATH");
+  if (env_path != NULL && strlen(env_path) < a->buf_size / 4) {
+    shell_path_list = str_split_cstr(a, env_path, ":");
+  }
+  for (StringNode *ptr = shell_path_list.first; ptr != NULL; ptr = ptr->next) {
+    ptr->string = intern(&shell_strings, ptr->string);
+  }
+}
+
+// Where a running script is in its loops. A break or continue sets how
+// many enclosing loops it still has to leave, and every list stops until
+// the loop it is meant for takes it.
+typedef struct ScriptRun ScriptRun;
+struct ScriptRun {
+  ScriptImage *image;
+  uint32_t loop_depth;
+  uint32_t breaking;
+  uint32_t continuing;
+};
+
+internal bool script_stopped(ScriptRun *run) {
+  return !shell_running || shell_interrupted || run->breaking > 0 ||
+         run->continuing > 0;
+}
+
+// Takes the break or continue meant for the innermost loop after it ran
+// its body. Returns whether the loop has to stop.
+internal bool script_loop_done(ScriptRun *run) {
+  if (run->continuing > 0) {
+    run->continuing -= 1;
+    // an outer loop is the one to continue
+    return run->continuing > 0;
+  }
+  if (run->breaking > 0) {
+    run->breaking -= 1;
+    return true;
+  }
+  return !shell_running || shell_interrupted;
+}
+
+internal void script_run_list(Arena *a, ScriptRun *run, uint32_t first);
+
+// The words are evaluated once up front, then every iteration gets a
+// fresh scratch region of the arena for its expansions.
+internal void script_run_for(Arena *a, ScriptRun *run, ScriptNode *node) {
+  ScriptImage *image = run->image;
+  TempArenaMemory outer = temp_arena_memory_begin(a);
+  refresh_path_list(false);
+  StringList items = {0};
+  for (uint32_t w = 0; w < node->word_count; w += 1) {
+    script_eval_word(a, &shell_parse, image,
+                     &image->words[node->word_first + w], &items);
+  }
+
+  String name = script_string(image, node->arg);
+  last_exit_status = 0;
+  run->loop_depth += 1;
+  for (StringNode *item = items.first; item != NULL; item = item->next) {
+    TempArenaMemory temp = temp_arena_memory_begin(a);
+    vars_set(&shell_vars, name, item->string);
+    script_run_list(a, run, node->body);
+    temp_arena_memory_end(temp);
+    if (script_loop_done(run)) {
+      break;
+    }
+  }
+  run->loop_depth -= 1;
+  temp_arena_memory_end(outer);
+}
+
+// while and until. $? is that of the last body run, 0 when there was none.
+internal void script_run_while(Arena *a, ScriptRun *run, ScriptNode *node) {
+  int status = 0;
+  run->loop_depth += 1;
+  for (;;) {
+    TempArenaMemory temp = temp_arena_memory_begin(a);
+    script_run_list(a, run, node->cond);
+    bool enter = (last_exit_status == 0) == (node->kind == SCRIPT_NODE_WHILE);
+    if (enter && !script_stopped(run)) {
+      script_run_list(a, run, node->body);
+      status = last_exit_status;
+    }
+    temp_arena_memory_end(temp);
+    if (script_loop_done(run) || !enter) {
+      break;
+    }
+  }
+  run->loop_depth -= 1;
+  last_exit_status = status;
+}
+
+internal void script_run_if(Arena *a, ScriptRun *run, ScriptNode *node) {
+  script_run_list(a, run, node->cond);
+  if (script_stopped(run)) {
+    return;
+  }
+  if (last_exit_status == 0) {
+    script_run_list(a, run, node->body);
+  } else if (node->else_body != SCRIPT_NONE) {
+    script_run_list(a, run, node->else_body);
+  } else {
+    last_exit_status = 0;
+  }
+}
+
+// break N and continue N leave at most as many loops as there are.
+internal void script_run_loop_control(ScriptRun *run, ScriptNode *node) {
+  last_exit_status = 0;
+  if (run->loop_depth == 0) {
+    fprintf(stderr, "%s: only meaningful in a loop\n",
+            node->kind == SCRIPT_NODE_BREAK ? "break" : "continue");
+    return;
+  }
+  uint32_t count = node->arg < run->loop_depth ? node->arg : run->loop_depth;
+  if (node->kind == SCRIPT_NODE_BREAK) {
+    run->breaking = count;
+  } else {
+    run->continuing = count;
+  }
+}
+
+internal void script_run_pipeline(Arena *a, ScriptImage *image,
+                                  ScriptPipeline *pipeline) {
+  TempArenaMemory temp = temp_arena_memory_begin(a);
+  refresh_path_list(false);
+  PipedShellCommandList list =
+      script_build_pipeline(a, &shell_parse, image, pipeline);
+  run_piped_shell_command(a, &list, &shell_path_list);
+  temp_arena_memory_end(temp);
+}
+
+internal void script_run_list(Arena *a, ScriptRun *run, uint32_t first) {
+  ScriptImage *image = run->image;
+  for (uint32_t n = first; n != SCRIPT_NONE && !script_stopped(run);
+       n = image->nodes[n].next) {
+    ScriptNode *node = &image->nodes[n];
+    RedirectInfo redir =
+        script_eval_redirect(a, &shell_parse, image, node->redir_word,
+                             node->redir_fd, node->redir_flag,
+                             node->redir_dup);
+    int saved_fd = -1;
+    if (redirect_is_set(&redir) && !redirect_begin(a, &redir, &saved_fd)) {
+      continue;
+    }
+
+    if (node->kind == SCRIPT_NODE_PIPELINE) {
+      script_run_pipeline(a, image, &image->pipelines[node->arg]);
+    } else if (node->kind == SCRIPT_NODE_FOR) {
+      script_run_for(a, run, node);
+    } else if (node->kind == SCRIPT_NODE_WHILE ||
+               node->kind == SCRIPT_NODE_UNTIL) {
+      script_run_while(a, run, node);
+    } else if (node->kind == SCRIPT_NODE_IF) {
+      script_run_if(a, run, node);
+    } else {
+      script_run_loop_control(run, node);
+    }
+
+    if (redirect_is_set(&redir)) {
+      redirect_end(&redir, saved_fd);
+    }
+  }
+}
+
+// Runs a compiled script or command line in the shell itself: builtins in
+// loops never fork.
+internal void script_run(Arena *a, ScriptImage *image) {
+  ScriptRun run = {.image = image};
+  script_run_list(a, &run, image->root);
+}
+
+// Output of text run as a command, without trailing newlines. A single
+// builtin runs in-process with stdout pointed at the arena, so x=$(pwd)
+// forks nothing. Anything else runs in a child and is read from a pipe.
+internal String command_substitute(Arena *a, String text) {
+  ScriptBuilder builder = {0};
+  int result = script_compile(a, &shell_parse, &builder, text);
+  ScriptImage *image = &builder.image;
+  if (result != SCRIPT_COMPILE_OK || image->root == SCRIPT_NONE) {
+    if (result == SCRIPT_COMPILE_INCOMPLETE) {
+      fprintf(stderr, "syntax error: unexpected end of file\n");
+    }
+    if (result != SCRIPT_COMPILE_OK) {
+      last_exit_status = 2;
+    }
+    script_builder_free(&builder);
+    return (String){0};
+  }
+
+  // a lone pipeline is evaluated here to see whether it can stay in-process
+  ArenaStream out = {.arena = a};
+  ScriptNode *root = &image->nodes[image->root];
+  bool single = root->kind == SCRIPT_NODE_PIPELINE && root->next == SCRIPT_NONE;
+  PipedShellCommandList list = {0};
+  if (single) {
+    refresh_path_list(false);
+    list = script_build_pipeline(a, &shell_parse, image,
+                                 &image->pipelines[root->arg]);
+  }
+
+  ShellCommand *first = list.first != NULL ? &list.first->cmd : NULL;
+  // place forks to move what it runs
+  if (list.node_count == 1 && first->builtin &&
+      !is_state_builtin(first->exe) && !str_equal_cstr(first->exe, "place") &&
+      first->assigns.count == 0 &&
+      !redirect_is_set(&first->redir_info)) {
+    FILE *stream = arena_stream_open(&out);
+    if (stream != NULL) {
+      FILE *saved_stdout = stdout;
+      stdout = stream;
+      run_builtin(a, first, &shell_path_list);
+      stdout = saved_stdout;
+      fclose(stream);
+      script_builder_free(&builder);
+      return arena_stream_trimmed(&out);
+    }
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    script_builder_free(&builder);
+    return (String){0};
+  }
+
+  shell_io_sync();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    script_builder_free(&builder);
+    return (String){0};
+  }
+  if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    if (single) {
+      run_piped_shell_command(a, &list, &shell_path_list);
+    } else {
+      script_run(a, image);
+    }
+    child_exit(last_exit_status);
+  }
+
+  script_builder_free(&builder);
+  close(fds[1]);
+  arena_stream_read_fd(&out, fds[0]);
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  last_exit_status = exit_status(status);
+  return arena_stream_trimmed(&out);
+}
+
+// Path of a file in the shell's cache directory ($XDG_CACHE_HOME or
+// ~/.cache), creating the directory if needed. NULL when there is no home,
+// or when the path does not fit, so that nothing is cached.
+internal char *cache_file_path(Arena *a, const char *name) {
+  char *env_cache = getenv("XDG_CACHE_HOME");
+  char *env_home = getenv("HOME");
+  char dir[PATH_MAX_LEN];
+
+  int n = 0;
+  if (env_cache != NULL && env_cache[0] != '\0') {
+    n = snprintf(dir, sizeof(dir), "%s/codecrafters-shell", env_cache);
+  } else if (env_home != NULL) {
+    n = snprintf(dir, sizeof(dir), "%s/.cache/codecrafters-shell", env_home);
+  } else {
+    return NULL;
+  }
+  if (n < 0 || n >= (int)sizeof(dir)) {
+    return NULL;
+  }
+  // the parent first, it may not exist yet
+  char *slash = strrchr(dir, '/');
+  *slash = '\0';
+  mkdir(dir, 0755);
+  *slash = '/';
+  if (mkdir(dir, 0755) != 0 && !is_directory(dir)) {
+    return NULL;
+  }
+
+  char *path = (char *)arena_alloc(a, PATH_MAX_LEN);
+  n = snprintf(path, PATH_MAX_LEN, "%s/%s", dir, name);
+  return n > 0 && n < PATH_MAX_LEN ? path : NULL;
+}
+
+// The compiled form of the script at path, in the cache directory under a
+// hash of the script's absolute path. A cache file next to the script could
+// be planted by anyone who can write to its directory.
+internal char *script_cache_path(Arena *a, const char *path) {
+  char *absolute = realpath(path, NULL);
+  if (absolute == NULL) {
+    return NULL;
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "script-%016llx.shc",
+           (unsigned long long)str_hash(str_init(absolute, strlen(absolute))));
+  free(absolute);
+  return cache_file_path(a, name);
+}
+
+// Batch mode. The compiled script is cached and mapped on later runs,
+// skipping lexing and parsing, for as long as the script keeps its size and
+// mtime. When only the mtime changed the content hash decides.
+internal int run_script(Arena *a, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 127;
+  }
+
+  char *cache_path = script_cache_path(a, path);
+  ScriptImage image = {0};
+  ScriptBuilder builder = {0};
+  bool cached = cache_path != NULL && script_cache_open(cache_path, &image);
+  bool fresh = cached && image.source_size == (uint64_t)st.st_size &&
+               image.mtime.tv_sec == st.st_mtim.tv_sec &&
+               image.mtime.tv_nsec == st.st_mtim.tv_nsec;
+
+  if (!fresh) {
+    TempArenaMemory temp = temp_arena_memory_begin(a);
+    ArenaStream source = {.arena = a};
+    arena_stream_read_fd(&source, fd);
+    String text = {.str = source.buf, .size = source.size};
+    uint64_t hash = str_hash(text);
+
+    if (cached && image.source_hash == hash &&
+        image.source_size == text.size) {
+      // only touched, the compiled form still holds
+      image.mtime = st.st_mtim;
+    } else {
+      script_cache_close(&image);
+      int result = script_compile(a, &shell_parse, &builder, text);
+      if (result != SCRIPT_COMPILE_OK) {
+        if (result == SCRIPT_COMPILE_INCOMPLETE) {
+          fprintf(stderr, "%s: syntax error: unexpected end of file\n", path);
+        }
+        temp_arena_memory_end(temp);
+        close(fd);
+        script_builder_free(&builder);
+        return 2;
+      }
+      image = builder.image;
+      image.source_size = text.size;
+      image.source_hash = hash;
+      image.mtime = st.st_mtim;
+    }
+    if (cache_path != NULL) {
+      script_cache_write(cache_path, &image);
+    }
+    temp_arena_memory_end(temp);
   }
+  close(fd);
+
+  script_run(a, &image);
+  script_cache_close(&image);
+  script_builder_free(&builder);
+  return last_exit_status;
+}
+
+// Counts every command named literally in a command line.
+internal void record_command_usage(ScriptImage *image) {
+  for (uint32_t i = 0; i < image->command_count; i += 1) {
+    ScriptCommand *cmd = &image->commands[i];
+    ScriptWord *name = cmd->assign_count < cmd->word_count
+                           ? &image->words[cmd->word_first + cmd->assign_count]
+                           : NULL;
+    if (name != NULL && (name->flags & SCRIPT_WORD_LITERAL)) {
+      cmd_index_record(&cmd_index, script_string(image, name->text));
+    }
+  }
+}
+
+// Seeds usage counts from the first word of every history entry, used when
+// there is no rank file yet.
+internal void learn_ranks_from_history(Arena *a) {
+  TempArenaMemory temp = temp_arena_memory_begin(a);
+  for (int i = 0; i < history_length; i += 1) {
+    HIST_ENTRY *e = history_get(i + history_base);
+    if (e == NULL) {
+      continue;
+    }
+    StringList words = str_split_cstr(a, e->line, " \t|");
+    if (words.first != NULL) {
+      cmd_index_record(&cmd_index, words.first->string);
+    }
+  }
+  temp_arena_memory_end(temp);
 }
 
 int main(int argc, char *argv[]) {
+  // before anything else so the zygote stays small
+  char *env_zygote = getenv("SHELL_ZYGOTE");
+  if (env_zygote != NULL && strcmp(env_zygote, "1") == 0) {
+    zygote_start(&zygote);
+  }
+
   // Flush after every printf
   setbuf(stdout, NULL);
 
@@ -696,27 +2323,79 @@ int main(int argc, char *argv[]) {
   signal(SIGINT, sigint_handler);
   signal(SIGTSTP, SIG_IGN);
 
-  uint8_t *arena_backing_buffer = (uint8_t *)malloc(4 * MB);
-  Arena arena = {0};
-  arena_init(&arena, arena_backing_buffer, 4 * MB);
+  shell_arenas_init();
+  Arena *session = &shell_arenas.session;
+  Arena *prompt = &shell_arenas.prompt;
+
+  intern_init(&shell_strings);
+  intern_builtins();
+
+  extern char **environ;
+  vars_init(&shell_vars, environ);
+  shell_parse = (ParseContext){
+      .vars = &shell_vars,
+      .last_exit_status = &last_exit_status,
+      .is_builtin = is_builtin,
+      .substitute = command_substitute,
+  };
+
+  arena_init(&shell_path_arena, malloc(SHELL_PATH_ARENA_SIZE),
+             SHELL_PATH_ARENA_SIZE);
+  refresh_path_list(true);
+
+  // batch mode: shell script
+  if (argc > 1) {
+    signal(SIGINT, SIG_DFL);
+    int status = run_script(prompt, argv[1]);
+    // whoever reads stdin after the shell starts right after the last line
+    shell_io_sync();
+    zygote_stop(&zygote);
+    intern_release(&shell_strings);
+    free(shell_path_arena.buf);
+    shell_arenas_release();
+    return status;
+  }
 
-  char *env_path = getenv("PATH");
-  StringList env_path_list = str_split_cstr(&arena, env_path, ":");
   char *env_histfile = getenv("HISTFILE");
+  char *env_home = getenv("HOME");
+  char *rankfile = NULL;
+  if (env_home != NULL) {
+    String home = str_init(env_home, strlen(env_home));
+    String name = str_init("/.shell_cmd_rank", 16);
+    rankfile = to_cstring(session, str_concat(session, home, name));
+  }
+  char *snapshot_file = cache_file_path(session, "cmd_index");
 
   // setup readline
   // 1. completion
   rl_attempted_completion_function = cmd_completion;
+  rl_event_hook = completion_prefetch_hook;
+  dir_cache_init(&dir_cache);
   // 2. history
   using_history();
   if (env_histfile != NULL) {
     read_history(env_histfile);
   }
+  // 3. command index, ranked by usage
+  // the index fills in the background while the prompt is already shown
+  cmd_index_init(&cmd_index, &shell_strings, snapshot_file);
+  cmd_index_rebuild(&cmd_index, builtin_commands, &shell_path_list);
+  // recording never waits for the build, the counts are settled once it
+  // is done
+  if (rankfile == NULL || !cmd_index_load_ranks(&cmd_index, rankfile)) {
+    learn_ranks_from_history(prompt);
+  }
 
   while (shell_running) {
-    TempArenaMemory temp = temp_arena_memory_begin(&arena);
-    preload_existing_commands(&arena, &env_path_list);
+    arena_free_all(prompt);
+    cmd_index_poll(&cmd_index);
+    refresh_path_list(false);
+    if (cmd_index_is_stale(&cmd_index, &shell_path_list)) {
+      cmd_index_rebuild(&cmd_index, builtin_commands, &shell_path_list);
+    }
 
+    // readline reads stdin too
+    shell_io_sync();
     char *cmd = NULL;
     cmd = readline("$ ");
     if (cmd == NULL) {
@@ -724,16 +2403,52 @@ int main(int argc, char *argv[]) {
     }
     add_history(cmd);
 
-    PipedShellCommandList piped_shell_cmd = parse_command(&arena, cmd);
-    run_piped_shell_command(&arena, &piped_shell_cmd, &env_path_list);
+    // a compound command goes on over as many lines as it takes
+    String line = str_init(cmd, strlen(cmd));
+    ScriptBuilder builder = {0};
+    int result = script_compile(prompt, &shell_parse, &builder, line);
+    while (result == SCRIPT_COMPILE_INCOMPLETE) {
+      char *more = readline("> ");
+      if (more == NULL) {
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+        result = SCRIPT_COMPILE_ERROR;
+        break;
+      }
+      add_history(more);
+      line = str_concat_sep(prompt, line, str_init(more, strlen(more)),
+                            str_init("\n", 1));
+      free(more);
+      script_builder_free(&builder);
+      result = script_compile(prompt, &shell_parse, &builder, line);
+    }
 
+    if (result == SCRIPT_COMPILE_OK) {
+      record_command_usage(&builder.image);
+      shell_interrupted = 0;
+      script_run(prompt, &builder.image);
+    } else {
+      last_exit_status = 2;
+    }
+    script_builder_free(&builder);
     free(cmd);
-    temp_arena_memory_end(temp);
   }
 
   if (env_histfile != NULL) {
     write_history(env_histfile);
   }
-  free(arena_backing_buffer);
+  if (rankfile != NULL) {
+    cmd_index_save_ranks(&cmd_index, rankfile);
+  }
+  shell_io_sync();
+  cmd_index_release(&cmd_index);
+  dir_cache_release(&dir_cache);
+  zygote_stop(&zygote);
+  char *env_arena_stats = getenv("SHELL_ARENA_STATS");
+  if (env_arena_stats != NULL && strcmp(env_arena_stats, "1") == 0) {
+    shell_arenas_report(stderr);
+  }
+  intern_release(&shell_strings);
+  free(shell_path_arena.buf);
+  shell_arenas_release();
   return 0;
 }
@@ -0,0 +1,651 @@
+#ifndef CODECRAFTER_PARSER_H
+#define CODECRAFTER_PARSER_H
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "vars.h"
+#include "wildcard.h"
+
+// Command lines to words: lexing into raw words and the evaluation of
+// quotes, parameters, substitutions and globs. script.h puts the raw words
+// together into commands.
+
+// What evaluation needs from the shell. Any of it may be left out: without
+// vars every variable is unset, without substitute a command substitution
+// expands to nothing. That is how the fuzz targets parse without running
+// anything.
+typedef struct ParseContext ParseContext;
+struct ParseContext {
+  ShellVars *vars;
+  int *last_exit_status; // for $?
+  bool (*is_builtin)(String name);
+  String (*substitute)(Arena *a, String text);
+};
+
+typedef struct RedirectInfo RedirectInfo;
+struct RedirectInfo {
+  int source_fd;
+  String file_name;
+  int flag;
+  bool input; // N< file
+  bool dup;   // N>&M or N<&M: source_fd becomes a copy of dup_fd
+  int dup_fd; // -1 closes source_fd, N>&-
+};
+
+internal bool redirect_is_set(RedirectInfo *info) {
+  return info->source_fd > 0 || info->input || info->dup;
+}
+
+typedef struct ShellCommand ShellCommand;
+struct ShellCommand {
+  String exe;
+  StringArray args;
+  StringArray assigns; // NAME=value words before the command name
+  RedirectInfo redir_info;
+  bool builtin; // exe is a builtin, resolved when the command is parsed
+};
+
+typedef struct PipedShellCommandNode PipedShellCommandNode;
+struct PipedShellCommandNode {
+  ShellCommand cmd;
+  PipedShellCommandNode *next;
+};
+
+typedef struct PipedShellCommandList PipedShellCommandList;
+struct PipedShellCommandList {
+  PipedShellCommandNode *first;
+  PipedShellCommandNode *last;
+  uint64_t node_count;
+};
+
+internal PipedShellCommandNode *piped_cmd_list_push(Arena *a,
+                                                    PipedShellCommandList *list,
+                                                    ShellCommand shell_cmd) {
+  PipedShellCommandNode *node =
+      (PipedShellCommandNode *)arena_alloc(a, sizeof(PipedShellCommandNode));
+  node->cmd = shell_cmd;
+
+  if (list->first == NULL) {
+    list->first = node;
+  }
+  if (list->last != NULL) {
+    list->last->next = node;
+  }
+  list->last = node;
+  list->node_count += 1;
+
+  return node;
+}
+
+// N> file, N>> file and N< file, N a single digit that defaults to 1 for
+// output and 0 for input. N>&M and N<&M make N a copy of the descriptor M
+// and N>&- closes N; these take no file, file_name is left alone.
+internal RedirectInfo parse_redirect(String s, StringNode *file_name) {
+  RedirectInfo info = {0};
+  String op = s;
+  int source_fd = -1;
+  if (s.size > 1 && s.str[0] >= '0' && s.str[0] <= '9') {
+    source_fd = s.str[0] - '0';
+    op = str_substr(s, 1, s.size);
+  }
+  if (op.size == 0 || (op.str[0] != '>' && op.str[0] != '<')) {
+    return info;
+  }
+  bool input = op.str[0] == '<';
+  if (source_fd < 0) {
+    source_fd = input ? 0 : 1;
+  }
+
+  if (op.size == 3 && op.str[1] == '&' &&
+      ((op.str[2] >= '0' && op.str[2] <= '9') || op.str[2] == '-')) {
+    info.source_fd = source_fd;
+    info.dup = true;
+    info.dup_fd = op.str[2] == '-' ? -1 : op.str[2] - '0';
+    return info;
+  }
+  if (file_name == NULL) {
+    return info;
+  }
+
+  if (str_equal_cstr(op, ">") && source_fd > 0) {
+    info.flag = O_TRUNC;
+  } else if (str_equal_cstr(op, ">>") && source_fd > 0) {
+    info.flag = O_APPEND;
+  } else if (str_equal_cstr(op, "<")) {
+    info.input = true;
+  } else {
+    return info;
+  }
+  info.source_fd = source_fd;
+  info.file_name = file_name->string;
+  return info;
+}
+
+// Scans the $( at s.str[i] up to its closing parenthesis. With closes set
+// it also records where every $( nested in it ends, indexed by the position
+// of its '$': one past the end plus one, or 1 when it is not terminated.
+// stack needs room for s.size positions.
+internal uint64_t subst_scan_parens(String s, uint64_t i, uint64_t *closes,
+                                    uint64_t *stack) {
+  assert(s.str[i] == '$' && i + 1 < s.size && s.str[i + 1] == '(');
+  int depth = 0;
+  char quote = '\0';
+  for (i += 1; i < s.size; i += 1) {
+    char ch = s.str[i];
+    if (quote == SINGLE_QUOTE) {
+      if (ch == SINGLE_QUOTE) {
+        quote = '\0';
+      }
+    } else if (ch == BACKSLASH) {
+      i += 1;
+    } else if (quote == DOUBLE_QUOTE) {
+      if (ch == DOUBLE_QUOTE) {
+        quote = '\0';
+      }
+    } else if (ch == SINGLE_QUOTE || ch == DOUBLE_QUOTE) {
+      quote = ch;
+    } else if (ch == '(') {
+      if (closes != NULL) {
+        stack[depth] = i;
+      }
+      depth += 1;
+    } else if (ch == ')') {
+      depth -= 1;
+      if (depth == 0) {
+        return i + 1;
+      }
+      if (closes != NULL && s.str[stack[depth] - 1] == '$') {
+        closes[stack[depth] - 1] = i + 2;
+      }
+    }
+  }
+
+  if (closes != NULL) {
+    for (int d = 0; d < depth; d += 1) {
+      if (s.str[stack[d] - 1] == '$') {
+        closes[stack[d] - 1] = 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// One past the end of the command substitution starting at s.str[i], either
+// $(...) or `...`, or 0 when it is not terminated.
+internal uint64_t subst_end(String s, uint64_t i) {
+  if (s.str[i] == '`') {
+    for (i += 1; i < s.size; i += 1) {
+      if (s.str[i] == BACKSLASH) {
+        i += 1;
+      } else if (s.str[i] == '`') {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
+  return subst_scan_parens(s, i, NULL, NULL);
+}
+
+// subst_end over one string, keeping what an unterminated $( found out
+// about the ones nested in it. A line full of unterminated $( would
+// otherwise be rescanned to its end from each of them.
+typedef struct SubstEnds SubstEnds;
+struct SubstEnds {
+  String s;
+  uint64_t *closes; // NULL until a $( turns out unterminated
+};
+
+internal uint64_t subst_end_cached(Arena *a, SubstEnds *ends, uint64_t i) {
+  if (ends->closes != NULL && ends->closes[i] != 0) {
+    return ends->closes[i] - 1;
+  }
+
+  uint64_t result = subst_end(ends->s, i);
+  if (result == 0 && ends->s.str[i] == '$') {
+    if (ends->closes == NULL) {
+      ends->closes =
+          (uint64_t *)arena_alloc(a, sizeof(uint64_t) * ends->s.size);
+    }
+    TempArenaMemory temp = temp_arena_memory_begin(a);
+    uint64_t *stack =
+        (uint64_t *)arena_alloc(a, sizeof(uint64_t) * ends->s.size);
+    subst_scan_parens(ends->s, i, ends->closes, stack);
+    temp_arena_memory_end(temp);
+  }
+  return result;
+}
+
+internal bool is_subst_start(String s, uint64_t i) {
+  return s.str[i] == '`' ||
+         (s.str[i] == '$' && i + 1 < s.size && s.str[i + 1] == '(');
+}
+
+// Builds the words of one token. Every word is kept twice: its evaluated
+// text, and the same text as a glob pattern in which every quoted or escaped
+// glob character is backslash-escaped so it only ever matches itself.
+typedef struct TokenBuilder TokenBuilder;
+struct TokenBuilder {
+  Arena *arena;
+  ParseContext *ctx;
+  StringList *out;
+  uint8_t *buf;
+  uint8_t *pattern; // twice the capacity of buf
+  uint64_t size;
+  uint64_t pattern_size;
+  uint64_t capacity;
+  bool has_glob;   // an unquoted *, ? or [ was seen
+  bool has_word;   // quotes make a word even when nothing is inside them
+  bool assignment; // NAME=value: no field splitting or globbing
+};
+
+internal void token_reserve(TokenBuilder *tb, uint64_t extra) {
+  if (tb->size + extra <= tb->capacity) {
+    return;
+  }
+
+  uint64_t capacity = tb->capacity == 0 ? 16 : tb->capacity * 2;
+  for (; capacity < tb->size + extra; capacity *= 2)
+    ;
+  uint8_t *buf = (uint8_t *)arena_alloc(tb->arena, capacity);
+  uint8_t *pattern = (uint8_t *)arena_alloc(tb->arena, capacity * 2);
+  if (tb->size > 0) {
+    memcpy(buf, tb->buf, tb->size);
+    memcpy(pattern, tb->pattern, tb->pattern_size);
+  }
+  tb->buf = buf;
+  tb->pattern = pattern;
+  tb->capacity = capacity;
+}
+
+internal void token_push(TokenBuilder *tb, uint8_t ch, bool quoted) {
+  token_reserve(tb, 1);
+  tb->buf[tb->size] = ch;
+  tb->size += 1;
+  tb->has_word = true;
+
+  if (quoted && glob_is_special(ch)) {
+    tb->pattern[tb->pattern_size] = BACKSLASH;
+    tb->pattern_size += 1;
+  } else if (!quoted && (ch == '*' || ch == '?' || ch == '[')) {
+    tb->has_glob = true;
+  }
+  tb->pattern[tb->pattern_size] = ch;
+  tb->pattern_size += 1;
+}
+
+// Emits the word built so far, glob expanded when it has unquoted glob
+// characters, and starts a new one.
+internal void token_finish_word(TokenBuilder *tb) {
+  if (!tb->has_word) {
+    return;
+  }
+
+  String word = {.str = tb->buf, .size = tb->size};
+  StringArray matches = {0};
+  if (tb->has_glob && !tb->assignment) {
+    String pattern = {.str = tb->pattern, .size = tb->pattern_size};
+    matches = glob_expand(tb->arena, pattern);
+  }
+
+  if (matches.count > 0) {
+    for (uint64_t i = 0; i < matches.count; i += 1) {
+      str_list_push(tb->arena, tb->out, matches.items[i]);
+    }
+  } else {
+    str_list_push(tb->arena, tb->out, word);
+  }
+
+  // the finished word keeps its buffers
+  tb->buf = NULL;
+  tb->pattern = NULL;
+  tb->size = 0;
+  tb->pattern_size = 0;
+  tb->capacity = 0;
+  tb->has_glob = false;
+  tb->has_word = false;
+}
+
+internal void token_push_value(TokenBuilder *tb, String value, bool quoted) {
+  token_reserve(tb, value.size);
+  for (uint64_t i = 0; i < value.size; i += 1) {
+    uint8_t ch = value.str[i];
+    // unquoted expansions are split into fields on whitespace
+    if (!quoted && !tb->assignment &&
+        (ch == ' ' || ch == '\t' || ch == '\n')) {
+      token_finish_word(tb);
+    } else {
+      token_push(tb, ch, quoted);
+    }
+  }
+}
+
+// Expands the parameter reference at s.str[i] == '$': $NAME, ${NAME}, $? or
+// $$. Returns the number of characters used, 0 when there is no reference
+// and the '$' is literal.
+internal uint64_t token_expand_variable(TokenBuilder *tb, String s, uint64_t i,
+                                        bool quoted) {
+  assert(s.str[i] == '$');
+
+  String name = {0};
+  uint64_t used = 0;
+  if (i + 1 < s.size && s.str[i + 1] == '{') {
+    // only a name fits between the braces, so an unterminated ${ is known
+    // without scanning the rest of the word
+    uint64_t end = i + 2;
+    if (end < s.size && (s.str[end] == '?' || s.str[end] == '$')) {
+      end += 1;
+    } else {
+      for (; end < s.size && vars_is_name_char(s.str[end]); end += 1)
+        ;
+    }
+    if (end >= s.size || s.str[end] != '}') {
+      return 0;
+    }
+    name = str_substr(s, i + 2, end);
+    used = end + 1 - i;
+  } else if (i + 1 < s.size &&
+             (s.str[i + 1] == '?' || s.str[i + 1] == '$')) {
+    name = str_substr(s, i + 1, i + 2);
+    used = 2;
+  } else {
+    uint64_t end = i + 1;
+    if (end < s.size && vars_is_name_start(s.str[end])) {
+      for (; end < s.size && vars_is_name_char(s.str[end]); end += 1)
+        ;
+    }
+    name = str_substr(s, i + 1, end);
+    used = end - i;
+  }
+
+  if (name.size == 0) {
+    return 0;
+  }
+
+  String value = {0};
+  char number[32];
+  if (str_equal_cstr(name, "?") || str_equal_cstr(name, "$")) {
+    int status = tb->ctx->last_exit_status != NULL
+                     ? *tb->ctx->last_exit_status
+                     : 0;
+    int n = name.str[0] == '?' ? status : (int)getpid();
+    value = str_init(number, snprintf(number, sizeof(number), "%d", n));
+  } else if (tb->ctx->vars != NULL) {
+    ShellVar *var = vars_get(tb->ctx->vars, name);
+    if (var != NULL) {
+      value = var->value;
+    }
+  }
+
+  token_push_value(tb, value, quoted);
+  return used;
+}
+
+// Replaces the command substitution at s.str[i] with the output of the
+// command. Returns the number of characters used, 0 when it is not
+// terminated and is taken literally.
+internal uint64_t token_substitute(TokenBuilder *tb, SubstEnds *ends,
+                                   uint64_t i, bool quoted) {
+  String s = ends->s;
+  uint64_t end = subst_end_cached(tb->arena, ends, i);
+  if (end == 0) {
+    return 0;
+  }
+
+  String body = {0};
+  if (s.str[i] == '`') {
+    // inside backticks a backslash only escapes \, ` and $
+    uint8_t *buf = (uint8_t *)arena_alloc(tb->arena, end - i);
+    for (uint64_t j = i + 1; j < end - 1; j += 1) {
+      uint8_t next = j + 1 < end - 1 ? s.str[j + 1] : '\0';
+      if (s.str[j] == BACKSLASH &&
+          (next == BACKSLASH || next == '`' || next == '$')) {
+        j += 1;
+      }
+      buf[body.size] = s.str[j];
+      body.size += 1;
+    }
+    body.str = buf;
+  } else {
+    body = str_substr(s, i + 2, end - 1);
+  }
+
+  String output = {0};
+  if (tb->ctx->substitute != NULL) {
+    output = tb->ctx->substitute(tb->arena, body);
+  }
+  token_push_value(tb, output, quoted);
+  return end - i;
+}
+
+// Evaluates the quoted and unquoted parts of one token into zero or more
+// words appended to out: parameters are expanded, unquoted expansions are
+// split into fields and unquoted glob characters are expanded.
+internal void eval_token(Arena *a, ParseContext *ctx, StringList *tokens,
+                         bool assignment, StringList *out) {
+  assert(tokens != NULL);
+  assert(tokens->node_count > 0);
+  assert(tokens->first != NULL);
+  assert(tokens->last != NULL);
+
+  TokenBuilder tb = {
+      .arena = a, .ctx = ctx, .out = out, .assignment = assignment};
+  token_reserve(&tb, tokens->total_size);
+
+  StringNode *ptr = tokens->first;
+  for (; ptr != NULL; ptr = ptr->next) {
+    String str = ptr->string;
+    // the lexer leaves an empty piece before a blank, it adds nothing
+    if (str.size == 0) {
+      continue;
+    }
+    char ch = str.str[0];
+    if (ch == SINGLE_QUOTE) {
+      // treated literally
+      tb.has_word = true;
+      for (int i = 1; i < str.size - 1; i += 1) {
+        token_push(&tb, str.str[i], true);
+      }
+    } else if (ch == DOUBLE_QUOTE) {
+      tb.has_word = true;
+      // without the closing quote
+      String inner = str_substr(str, 0, str.size - 1);
+      SubstEnds ends = {.s = inner};
+      for (int i = 1; i < str.size - 1; i += 1) {
+        char ch = str.str[i];
+        char next = i + 1 < str.size - 1 ? str.str[i + 1] : '\0';
+        uint64_t used = 0;
+        if (ch == BACKSLASH && (next == DOUBLE_QUOTE || next == BACKSLASH ||
+                                next == '$' || next == '`')) {
+          token_push(&tb, next, true);
+          i += 1;
+        } else if (is_subst_start(inner, i) &&
+                   (used = token_substitute(&tb, &ends, i, true)) > 0) {
+          i += used - 1;
+        } else if (ch == '$') {
+          used = token_expand_variable(&tb, str, i, true);
+          if (used > 0) {
+            i += used - 1;
+          } else {
+            token_push(&tb, ch, true);
+          }
+        } else {
+          token_push(&tb, ch, true);
+        }
+      }
+    } else {
+      // no quote
+      SubstEnds ends = {.s = str};
+      for (int i = 0; i < str.size; i += 1) {
+        char ch = str.str[i];
+        uint64_t used = 0;
+        if (ch == BACKSLASH && i + 1 < str.size) {
+          token_push(&tb, str.str[i + 1], true);
+          i += 1;
+        } else if (is_subst_start(str, i) &&
+                   (used = token_substitute(&tb, &ends, i, false)) > 0) {
+          i += used - 1;
+        } else if (ch == '$') {
+          used = token_expand_variable(&tb, str, i, false);
+          if (used > 0) {
+            i += used - 1;
+          } else {
+            token_push(&tb, ch, false);
+          }
+        } else {
+          token_push(&tb, ch, ch == BACKSLASH);
+        }
+      }
+    }
+  }
+
+  token_finish_word(&tb);
+}
+
+// NAME=value, checked on the raw text so that a quoted '=' does not count.
+internal bool is_assignment_word(String s) {
+  uint64_t eq = 0;
+  for (; eq < s.size && s.str[eq] != '='; eq += 1)
+    ;
+  return eq < s.size && vars_is_valid_name(str_substr(s, 0, eq));
+}
+
+// One word of a command line before evaluation: its quoted and unquoted
+// pieces as typed, quotes included.
+typedef struct RawWord RawWord;
+struct RawWord {
+  StringList pieces;
+  bool assignment;
+  RawWord *next;
+};
+
+typedef struct RawWordList RawWordList;
+struct RawWordList {
+  RawWord *first;
+  RawWord *last;
+  uint64_t count;
+};
+
+internal RawWordList lex_command(Arena *a, String cmd) {
+  RawWordList words = {0};
+  // assignments are only recognized before the command name
+  bool command_position = true;
+  SubstEnds ends = {.s = cmd};
+
+  int start = 0;
+  for (; start <= cmd.size; start += 1) {
+    // consume prefixing spaces
+    for (;
+         start < cmd.size && (cmd.str[start] == ' ' || cmd.str[start] == '\t');
+         start += 1)
+      ;
+
+    int end = start;
+    StringList tokens_with_quote = {0};
+    char current_quote = '\0'; // default empty: no quote, can also be " or '
+    char prev_ch = '\0';
+
+    for (; end < cmd.size; end += 1) {
+      char ch = cmd.str[end];
+
+      // a command substitution belongs to the word, spaces and quotes
+      // inside it included
+      uint64_t subst = 0;
+      if (current_quote != SINGLE_QUOTE && prev_ch != BACKSLASH &&
+          is_subst_start(cmd, end)) {
+        subst = subst_end_cached(a, &ends, end);
+      }
+      if (subst > 0) {
+        end = (int)subst - 1;
+        if (end + 1 == cmd.size && current_quote == '\0') {
+          str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end + 1));
+          start = end + 1;
+          break;
+        }
+        prev_ch = cmd.str[end];
+        continue;
+      }
+
+      if ((ch == SINGLE_QUOTE || ch == DOUBLE_QUOTE) && prev_ch != BACKSLASH) {
+        if (ch == current_quote) {
+          // quote finished
+          str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end + 1));
+          current_quote = '\0';
+          start = end + 1;
+        } else if (current_quote == '\0') {
+          // starting quote, the previous token should be pushed
+          if (end > start) {
+            str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end));
+          }
+          current_quote = ch;
+          start = end;
+        }
+      } else if ((ch == ' ' || ch == '\t') && current_quote == '\0' &&
+                 prev_ch != BACKSLASH) {
+        // not in a quote, and sees a space or tab
+        str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end));
+        start = end;
+        break;
+      } else if (ch == ';' && current_quote == '\0' && prev_ch != BACKSLASH) {
+        // a separator is a word of its own even without spaces around it
+        if (end > start || tokens_with_quote.node_count > 0) {
+          if (end > start) {
+            str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end));
+          }
+          // the next word starts at the separator
+          start = end - 1;
+        } else {
+          str_list_push(a, &tokens_with_quote, str_substr(cmd, end, end + 1));
+          start = end;
+        }
+        break;
+      } else if (end + 1 == cmd.size) {
+        str_list_push(a, &tokens_with_quote, str_substr(cmd, start, end + 1));
+        start = end + 1;
+        break;
+      }
+
+      // an escaped backslash escapes nothing, and neither does one inside
+      // single quotes
+      bool literal = ch == BACKSLASH && (prev_ch == BACKSLASH ||
+                                         current_quote == SINGLE_QUOTE);
+      prev_ch = literal ? '\0' : ch;
+    }
+
+    if (tokens_with_quote.node_count > 0) {
+      String first = tokens_with_quote.first->string;
+      bool assignment = command_position && first.size > 0 &&
+                        first.str[0] != SINGLE_QUOTE &&
+                        first.str[0] != DOUBLE_QUOTE &&
+                        is_assignment_word(first);
+      RawWord *word = (RawWord *)arena_alloc(a, sizeof(RawWord));
+      word->pieces = tokens_with_quote;
+      word->assignment = assignment;
+      if (words.last == NULL) {
+        words.first = word;
+      } else {
+        words.last->next = word;
+      }
+      words.last = word;
+      words.count += 1;
+
+      if (tokens_with_quote.node_count == 1 &&
+          (str_equal_cstr(first, "|") || str_equal_cstr(first, ";"))) {
+        command_position = true;
+      } else if (!assignment) {
+        command_position = false;
+      }
+    }
+  }
+
+  return words;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef CODECRAFTER_PATH_CACHE_H
+#define CODECRAFTER_PATH_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "base.h"
+#include "base_string.h"
+#include "intern.h"
+
+#define PATH_CACHE_SLOTS 256
+
+typedef struct PathCacheEntry PathCacheEntry;
+struct PathCacheEntry {
+  String name; // interned, empty for a free slot
+  String path; // interned
+  uint64_t hash;
+};
+
+// Where PATH lookups found each command, valid for one PATH generation.
+// Direct mapped: a colliding command replaces the old one, which only costs
+// a fresh search later. Only hits are kept, so a command installed since
+// the last lookup is still found.
+typedef struct PathCache PathCache;
+struct PathCache {
+  PathCacheEntry slots[PATH_CACHE_SLOTS];
+  uint64_t generation;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+// Forgets everything when PATH changed since the cache was filled.
+internal void path_cache_sync(PathCache *cache, uint64_t generation) {
+  if (cache->generation != generation) {
+    for (int i = 0; i < PATH_CACHE_SLOTS; i += 1) {
+      cache->slots[i] = (PathCacheEntry){0};
+    }
+    cache->generation = generation;
+  }
+}
+
+// Cached path of name, empty when there is none.
+internal String path_cache_get(PathCache *cache, String name) {
+  uint64_t hash = str_hash(name);
+  PathCacheEntry *entry = &cache->slots[hash & (PATH_CACHE_SLOTS - 1)];
+  if (entry->hash == hash && str_equal(entry->name, name)) {
+    cache->hits += 1;
+    return entry->path;
+  }
+  cache->misses += 1;
+  return (String){0};
+}
+
+internal void path_cache_put(PathCache *cache, String name, String path) {
+  uint64_t hash = str_hash(name);
+  cache->slots[hash & (PATH_CACHE_SLOTS - 1)] = (PathCacheEntry){
+      .name = name,
+      .path = path,
+      .hash = hash,
+  };
+}
+
+#endif
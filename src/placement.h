@@ -0,0 +1,328 @@
+#ifndef CODECRAFTER_PLACEMENT_H
+#define CODECRAFTER_PLACEMENT_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+
+#define PLACEMENT_CPU_PERIOD 100000 // cpu.max period, in microseconds
+
+// Where the processes of one pipeline stage run, from its `place` prefix.
+// cpus pins the stage. spread gives every stage of the pipeline a CPU of
+// its own, and cgroup puts the whole pipeline in a cgroup v2 leaf with
+// memory_max and cpu_percent written to it first; these three are for the
+// pipeline, whichever stage gives them.
+typedef struct Placement Placement;
+struct Placement {
+  bool has_cpus;
+  bool spread;
+  cpu_set_t cpus;
+  String cgroup;     // relative to the cgroup v2 mount
+  String memory_max; // written as is, "max" or bytes with a K, M or G
+  int cpu_percent;   // of one CPU, 0 without a limit
+};
+
+// What the children of a pipeline apply between fork and exec.
+typedef struct PlacementPlan PlacementPlan;
+struct PlacementPlan {
+  cpu_set_t **stage_cpus; // NULL for a stage that runs anywhere
+  int cgroup_procs;       // cgroup.procs of the leaf, -1 without one
+};
+
+// Parses a CPU list like "0-3,8,10-11", the format of taskset -c and of
+// the cpulist files in sysfs, into set.
+internal bool cpu_list_parse(String list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  uint64_t i = 0;
+  while (i < list.size) {
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t start = i;
+    for (; i < list.size && list.str[i] >= '0' && list.str[i] <= '9'; i += 1) {
+      first = first * 10 + (list.str[i] - '0');
+      if (first >= CPU_SETSIZE) {
+        return false;
+      }
+    }
+    if (i == start) {
+      return false;
+    }
+    last = first;
+    if (i < list.size && list.str[i] == '-') {
+      i += 1;
+      start = i;
+      last = 0;
+      for (; i < list.size && list.str[i] >= '0' && list.str[i] <= '9';
+           i += 1) {
+        last = last * 10 + (list.str[i] - '0');
+        if (last >= CPU_SETSIZE) {
+          return false;
+        }
+      }
+      if (i == start || last < first) {
+        return false;
+      }
+    }
+    for (uint64_t cpu = first; cpu <= last; cpu += 1) {
+      CPU_SET(cpu, set);
+    }
+    if (i < list.size && (list.str[i] == ',' || list.str[i] == '\n')) {
+      i += 1;
+    } else if (i < list.size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The CPUs of pool, those of the NUMA node holding the most of them first,
+// then the next node and so on, so that taking them in order keeps as many
+// stages as possible on one node's cache and memory. Memory follows by
+// itself, the kernel allocates pages on the node of the CPU touching them.
+// Without NUMA information in sysfs pool is one node. Returns the count.
+internal int placement_numa_order(cpu_set_t *pool, int *order) {
+  cpu_set_t nodes[64];
+  int node_count = 0;
+  DIR *dir = opendir("/sys/devices/system/node");
+  struct dirent *entry = NULL;
+  while (dir != NULL && node_count < (int)ArrayCount(nodes) &&
+         (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' ||
+        entry->d_name[4] > '9') {
+      continue;
+    }
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+             entry->d_name);
+    char text[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd < 0 ? -1 : read(fd, text, sizeof(text));
+    if (fd >= 0) {
+      close(fd);
+    }
+    String list = {.str = (uint8_t *)text, .size = n > 0 ? (uint64_t)n : 0};
+    if (n > 0 && cpu_list_parse(list, &nodes[node_count])) {
+      CPU_AND(&nodes[node_count], &nodes[node_count], pool);
+      node_count += 1;
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+
+  int count = 0;
+  cpu_set_t left = *pool;
+  while (CPU_COUNT(&left) > 0) {
+    // the node with the most of what is left, or what is left when no node
+    // has any of it
+    cpu_set_t next = left;
+    int best = 0;
+    for (int i = 0; i < node_count; i += 1) {
+      cpu_set_t mine;
+      CPU_AND(&mine, &nodes[i], &left);
+      if (CPU_COUNT(&mine) > best) {
+        best = CPU_COUNT(&mine);
+        next = mine;
+      }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+      if (CPU_ISSET(cpu, &next)) {
+        order[count] = cpu;
+        count += 1;
+        CPU_CLR(cpu, &left);
+      }
+    }
+  }
+  return count;
+}
+
+// Where the cgroup v2 hierarchy is mounted, NULL without one. Hybrid
+// systems keep it beside the v1 controllers.
+internal const char *cgroup_root(void) {
+  if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) {
+    return "/sys/fs/cgroup";
+  }
+  if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0) {
+    return "/sys/fs/cgroup/unified";
+  }
+  return NULL;
+}
+
+internal bool cgroup_write(const char *dir, const char *file,
+                           const char *value) {
+  char path[PATH_MAX_LEN];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "place: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  ssize_t n = write(fd, value, strlen(value));
+  if (n < 0) {
+    fprintf(stderr, "place: %s: %s\n", path, strerror(errno));
+  }
+  close(fd);
+  return n >= 0;
+}
+
+// Creates the leaf cgroup of place, with the controllers its limits need
+// enabled on the way down, writes the limits and opens cgroup.procs, which
+// a child joins by writing 0. Returns -1 after printing why it failed.
+internal int cgroup_open(Arena *a, Placement *place) {
+  const char *root = cgroup_root();
+  if (root == NULL) {
+    fprintf(stderr, "place: no cgroup v2 hierarchy is mounted\n");
+    return -1;
+  }
+  char *controllers = "";
+  if (place->memory_max.size > 0 && place->cpu_percent > 0) {
+    controllers = "+cpu +memory";
+  } else if (place->memory_max.size > 0) {
+    controllers = "+memory";
+  } else if (place->cpu_percent > 0) {
+    controllers = "+cpu";
+  }
+
+  String leaf = place->cgroup;
+  char *path = (char *)arena_alloc(a, strlen(root) + leaf.size + 2);
+  uint64_t size = strlen(root);
+  memcpy(path, root, size);
+  path[size] = '\0';
+  uint64_t i = 0;
+  while (i < leaf.size) {
+    for (; i < leaf.size && leaf.str[i] == '/'; i += 1)
+      ;
+    uint64_t start = i;
+    for (; i < leaf.size && leaf.str[i] != '/'; i += 1)
+      ;
+    if (i == start) {
+      break;
+    }
+    // the controllers must be on in the parent for the files to exist in
+    // the child
+    if (controllers[0] != '\0' &&
+        !cgroup_write(path, "cgroup.subtree_control", controllers)) {
+      return -1;
+    }
+    path[size] = '/';
+    memcpy(path + size + 1, leaf.str + start, i - start);
+    size += 1 + (i - start);
+    path[size] = '\0';
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+      fprintf(stderr, "place: %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+
+  if (place->memory_max.size > 0 &&
+      !cgroup_write(path, "memory.max", to_cstring(a, place->memory_max))) {
+    return -1;
+  }
+  if (place->cpu_percent > 0) {
+    char value[64];
+    snprintf(value, sizeof(value), "%ld %d",
+             (long)place->cpu_percent * PLACEMENT_CPU_PERIOD / 100,
+             PLACEMENT_CPU_PERIOD);
+    if (!cgroup_write(path, "cpu.max", value)) {
+      return -1;
+    }
+  }
+
+  char procs[PATH_MAX_LEN];
+  snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+  int fd = open(procs, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "place: %s: %s\n", procs, strerror(errno));
+  }
+  return fd;
+}
+
+// Turns the placements of the n stages of a pipeline into a plan, its CPU
+// sets in a. A stage with its own CPUs keeps them; with spread every other
+// stage gets one CPU, in placement_numa_order, of the CPUs given with the
+// spread or else of those the shell may run on. Returns false after
+// printing why when the cgroup cannot be set up.
+internal bool placement_plan(Arena *a, Placement *places, int n,
+                             PlacementPlan *plan) {
+  plan->stage_cpus = (cpu_set_t **)arena_alloc(a, sizeof(cpu_set_t *) * n);
+  plan->cgroup_procs = -1;
+  Placement *spread = NULL;
+  Placement *cgroup = NULL;
+  for (int i = 0; i < n; i += 1) {
+    plan->stage_cpus[i] = NULL;
+    if (places[i].spread && spread == NULL) {
+      spread = &places[i];
+    }
+    if (places[i].cgroup.size > 0 && cgroup == NULL) {
+      cgroup = &places[i];
+    }
+  }
+
+  int *order = NULL;
+  int order_count = 0;
+  if (spread != NULL) {
+    cpu_set_t pool = spread->cpus;
+    if (!spread->has_cpus && sched_getaffinity(0, sizeof(pool), &pool) < 0) {
+      CPU_ZERO(&pool);
+    }
+    order = (int *)arena_alloc(a, sizeof(int) * CPU_SETSIZE);
+    order_count = placement_numa_order(&pool, order);
+  }
+  int spread_index = 0;
+  for (int i = 0; i < n; i += 1) {
+    Placement *place = &places[i];
+    if (place->has_cpus && place != spread) {
+      plan->stage_cpus[i] = &place->cpus;
+    } else if (order_count > 0) {
+      cpu_set_t *cpus = (cpu_set_t *)arena_alloc(a, sizeof(cpu_set_t));
+      CPU_ZERO(cpus);
+      CPU_SET(order[spread_index % order_count], cpus);
+      spread_index += 1;
+      plan->stage_cpus[i] = cpus;
+    }
+  }
+
+  if (cgroup != NULL) {
+    plan->cgroup_procs = cgroup_open(a, cgroup);
+    if (plan->cgroup_procs < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// In a forked child, before exec: moves it where the plan says. Returns
+// false after printing why it could not.
+internal bool placement_apply(PlacementPlan *plan, int stage) {
+  cpu_set_t *cpus = plan->stage_cpus[stage];
+  if (cpus != NULL && sched_setaffinity(0, sizeof(*cpus), cpus) < 0) {
+    perror("place: sched_setaffinity");
+    return false;
+  }
+  if (plan->cgroup_procs >= 0 && write(plan->cgroup_procs, "0", 1) < 0) {
+    perror("place: cgroup.procs");
+    return false;
+  }
+  return true;
+}
+
+internal bool placement_is_set(PlacementPlan *plan, int n) {
+  bool result = plan->cgroup_procs >= 0;
+  for (int i = 0; i < n && !result; i += 1) {
+    result = plan->stage_cpus[i] != NULL;
+  }
+  return result;
+}
+
+#endif
@@ -0,0 +1,757 @@
+#ifndef CODECRAFTER_SCRIPT_H
+#define CODECRAFTER_SCRIPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+#include "parser.h"
+#include "script_cache.h"
+#include "vars.h"
+
+// Scripts and command lines to a ScriptImage: the words of lex_command
+// parsed into statements, pipelines and commands, and the evaluation of the
+// compiled words when they run. Running the image is left to the shell, so
+// the fuzz targets compile and evaluate through here without running
+// anything.
+
+// reserved words, only recognized unquoted where a command name can be
+global const char *script_keywords[] = {
+    "for", "in", "do", "done", "while", "until", "if", "then", "elif",
+    "else", "fi", NULL};
+
+// A piece without its quotes, and the characters that make it need
+// evaluation.
+internal String raw_piece_inner(String piece, const char **special) {
+  *special = "$`\\*?[";
+  if (piece.size >= 2 && piece.str[0] == SINGLE_QUOTE) {
+    *special = "";
+    return str_substr(piece, 1, piece.size - 1);
+  }
+  if (piece.size >= 2 && piece.str[0] == DOUBLE_QUOTE) {
+    *special = "$`\\";
+    return str_substr(piece, 1, piece.size - 1);
+  }
+  return piece;
+}
+
+// Text of a word that needs no evaluation at all: no expansion, glob or
+// backslash in it. Returns false when it has to be evaluated at run time.
+// The pieces are measured first and copied once, a word can have any
+// number of them.
+internal bool raw_word_literal(Arena *a, RawWord *word, String *out) {
+  const char *special = NULL;
+  uint64_t size = 0;
+  for (StringNode *ptr = word->pieces.first; ptr != NULL; ptr = ptr->next) {
+    String inner = raw_piece_inner(ptr->string, &special);
+    for (uint64_t i = 0; i < inner.size; i += 1) {
+      if (inner.str[i] != '\0' && strchr(special, inner.str[i]) != NULL) {
+        return false;
+      }
+    }
+    size += inner.size;
+  }
+  if (word->pieces.node_count == 1) {
+    *out = raw_piece_inner(word->pieces.first->string, &special);
+    return true;
+  }
+
+  String text = {0};
+  if (size > 0) {
+    text.str = (uint8_t *)arena_alloc(a, size);
+    if (text.str == NULL) {
+      return false;
+    }
+  }
+  for (StringNode *ptr = word->pieces.first; ptr != NULL; ptr = ptr->next) {
+    String inner = raw_piece_inner(ptr->string, &special);
+    if (inner.size > 0) {
+      memcpy(text.str + text.size, inner.str, inner.size);
+      text.size += inner.size;
+    }
+  }
+  *out = text;
+  return true;
+}
+
+// Adds word to the script, evaluated now when it is literal and as its
+// interned raw pieces otherwise. Returns its index.
+internal uint32_t script_add_word(Arena *a, ScriptBuilder *b, RawWord *word,
+                                  bool assignment) {
+  ScriptImage *image = &b->image;
+  ScriptWord w = {0};
+  String text = {0};
+  if (raw_word_literal(a, word, &text)) {
+    w.flags = SCRIPT_WORD_LITERAL;
+    w.text = script_intern(b, text);
+  } else {
+    w.flags = assignment ? SCRIPT_WORD_ASSIGNMENT : 0;
+    w.piece_first = image->piece_count;
+    for (StringNode *ptr = word->pieces.first; ptr != NULL; ptr = ptr->next) {
+      uint32_t piece = script_intern(b, ptr->string);
+      image->pieces = (uint32_t *)script_grow(
+          image->pieces, image->piece_count, &b->piece_capacity,
+          sizeof(uint32_t));
+      image->pieces[image->piece_count] = piece;
+      image->piece_count += 1;
+      w.piece_count += 1;
+    }
+  }
+
+  image->words = (ScriptWord *)script_grow(image->words, image->word_count,
+                                           &b->word_capacity,
+                                           sizeof(ScriptWord));
+  image->words[image->word_count] = w;
+  image->word_count += 1;
+  return image->word_count - 1;
+}
+
+// Results of script_compile
+#define SCRIPT_COMPILE_OK 0
+#define SCRIPT_COMPILE_INCOMPLETE 1 // the source stops inside a statement
+#define SCRIPT_COMPILE_ERROR 2
+
+global const char *script_do_words[] = {"do", NULL};
+global const char *script_done_words[] = {"done", NULL};
+global const char *script_then_words[] = {"then", NULL};
+global const char *script_branch_words[] = {"elif", "else", "fi", NULL};
+global const char *script_fi_words[] = {"fi", NULL};
+
+// Recursive descent over the words of a whole script. A word without
+// pieces stands for a newline.
+typedef struct ScriptParser ScriptParser;
+struct ScriptParser {
+  Arena *arena;
+  ParseContext *ctx; // its is_builtin marks builtin command names
+  ScriptBuilder *b;
+  RawWord *word; // the next word, NULL at the end of the source
+  uint32_t depth;
+  bool error;
+  bool incomplete; // the error is running out of source
+};
+
+internal bool script_is_newline(RawWord *word) {
+  return word != NULL && word->pieces.node_count == 0;
+}
+
+// Whether word is text as typed, which leaves out quoted words.
+internal bool script_word_is(RawWord *word, const char *text) {
+  return word != NULL && word->pieces.node_count == 1 &&
+         str_equal_cstr(word->pieces.first->string, text);
+}
+
+internal bool script_word_in(RawWord *word, const char **words) {
+  for (int i = 0; words != NULL && words[i] != NULL; i += 1) {
+    if (script_word_is(word, words[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Where a statement or pipeline stage ends.
+internal bool script_is_separator(RawWord *word) {
+  return word == NULL || script_is_newline(word) || script_word_is(word, ";");
+}
+
+// Compound commands nested deeper than SCRIPT_DEPTH_MAX, said as such
+// rather than as an unexpected token.
+internal void script_depth_error(ScriptParser *p) {
+  if (p->error) {
+    return;
+  }
+  p->error = true;
+  fprintf(stderr,
+          "syntax error: compound commands nested more than %d levels deep\n",
+          SCRIPT_DEPTH_MAX);
+}
+
+internal void script_syntax_error(ScriptParser *p, RawWord *near) {
+  if (p->error) {
+    return;
+  }
+  p->error = true;
+  fprintf(stderr, "syntax error near unexpected token `");
+  if (near == NULL || script_is_newline(near)) {
+    fprintf(stderr, "newline");
+  }
+  for (StringNode *ptr = near != NULL ? near->pieces.first : NULL;
+       ptr != NULL; ptr = ptr->next) {
+    fprintf(stderr, "%.*s", (int)ptr->string.size, ptr->string.str);
+  }
+  fprintf(stderr, "'\n");
+}
+
+// The next word does not fit. At the end of the source more lines could
+// still complete the statement.
+internal void script_parse_error(ScriptParser *p) {
+  if (p->word == NULL && !p->error) {
+    p->error = true;
+    p->incomplete = true;
+  }
+  script_syntax_error(p, p->word);
+}
+
+internal void script_skip_newlines(ScriptParser *p) {
+  for (; script_is_newline(p->word); p->word = p->word->next)
+    ;
+}
+
+internal bool script_expect(ScriptParser *p, const char *keyword) {
+  if (p->error) {
+    return false;
+  }
+  if (!script_word_is(p->word, keyword)) {
+    script_parse_error(p);
+    return false;
+  }
+  p->word = p->word->next;
+  return true;
+}
+
+internal uint32_t script_add_node(ScriptBuilder *b, uint32_t kind) {
+  ScriptImage *image = &b->image;
+  image->nodes = (ScriptNode *)script_grow(image->nodes, image->node_count,
+                                           &b->node_capacity,
+                                           sizeof(ScriptNode));
+  image->nodes[image->node_count] = (ScriptNode){
+      .kind = kind,
+      .next = SCRIPT_NONE,
+      .cond = SCRIPT_NONE,
+      .body = SCRIPT_NONE,
+      .else_body = SCRIPT_NONE,
+      .redir_word = SCRIPT_NONE,
+      .redir_dup = SCRIPT_REDIR_FILE,
+  };
+  image->node_count += 1;
+  return image->node_count - 1;
+}
+
+// A pipeline up to the next separator, continued on the next line after a
+// trailing |. Only unquoted literal words can be operators. The words
+// after a redirect are dropped.
+internal uint32_t script_parse_pipeline(ScriptParser *p) {
+  ScriptBuilder *b = p->b;
+  ScriptImage *image = &b->image;
+  ScriptPipeline pipeline = {.command_first = image->command_count};
+  ScriptCommand *cmd = NULL;
+  bool redirected = false;
+
+  for (; !p->error && !script_is_separator(p->word); p->word = p->word->next) {
+    RawWord *word = p->word;
+    String first = word->pieces.first->string;
+    bool unquoted = word->pieces.node_count == 1 && first.size > 0 &&
+                    first.str[0] != SINGLE_QUOTE &&
+                    first.str[0] != DOUBLE_QUOTE;
+    if (unquoted && str_equal_cstr(first, "|")) {
+      if (cmd == NULL) {
+        script_parse_error(p);
+        break;
+      }
+      cmd = NULL;
+      // the pipeline goes on over a newline
+      for (; script_is_newline(word->next); word = word->next)
+        ;
+      p->word = word;
+      continue;
+    }
+
+    if (cmd == NULL) {
+      // compound commands cannot be pipeline stages
+      if (script_word_in(word, script_keywords)) {
+        script_parse_error(p);
+        break;
+      }
+      image->commands = (ScriptCommand *)script_grow(
+          image->commands, image->command_count, &b->command_capacity,
+          sizeof(ScriptCommand));
+      cmd = &image->commands[image->command_count];
+      *cmd = (ScriptCommand){.word_first = image->word_count,
+                             .redir_word = SCRIPT_NONE,
+                             .redir_dup = SCRIPT_REDIR_FILE};
+      image->command_count += 1;
+      pipeline.command_count += 1;
+      redirected = false;
+    }
+
+    StringNode file_node = {0};
+    RedirectInfo info =
+        unquoted ? parse_redirect(first, &file_node) : (RedirectInfo){0};
+    if (redirect_is_set(&info)) {
+      cmd->redir_word = SCRIPT_NONE;
+      cmd->redir_fd = info.source_fd;
+      cmd->redir_flag = info.flag;
+      cmd->redir_dup = info.dup ? info.dup_fd : SCRIPT_REDIR_FILE;
+      redirected = true;
+      if (info.dup) {
+        continue;
+      }
+      if (script_is_separator(word->next) || script_word_is(word->next, "|")) {
+        script_syntax_error(p, word->next);
+        break;
+      }
+      p->word = word->next;
+      cmd->redir_word = script_add_word(p->arena, b, p->word, false);
+      continue;
+    }
+    if (redirected) {
+      continue;
+    }
+
+    bool assignment = cmd->assign_count == cmd->word_count &&
+                      first.size > 0 && first.str[0] != SINGLE_QUOTE &&
+                      first.str[0] != DOUBLE_QUOTE &&
+                      is_assignment_word(first);
+    uint32_t idx = script_add_word(p->arena, b, word, assignment);
+    ScriptWord *w = &image->words[idx];
+    if (assignment) {
+      cmd->assign_count += 1;
+    } else if (cmd->word_count == cmd->assign_count &&
+               (w->flags & SCRIPT_WORD_LITERAL) && p->ctx->is_builtin != NULL &&
+               p->ctx->is_builtin(script_string(image, w->text))) {
+      w->flags |= SCRIPT_WORD_BUILTIN;
+    }
+    cmd->word_count += 1;
+  }
+
+  // nothing at all, or nothing after a |
+  if (!p->error && cmd == NULL) {
+    script_parse_error(p);
+  }
+  if (p->error) {
+    return SCRIPT_NONE;
+  }
+  image->pipelines = (ScriptPipeline *)script_grow(
+      image->pipelines, image->pipeline_count, &b->pipeline_capacity,
+      sizeof(ScriptPipeline));
+  image->pipelines[image->pipeline_count] = pipeline;
+  image->pipeline_count += 1;
+  return image->pipeline_count - 1;
+}
+
+internal uint32_t script_parse_list(ScriptParser *p, const char **terminators);
+
+// A list that has to have at least one statement.
+internal uint32_t script_parse_body(ScriptParser *p, const char **terminators) {
+  uint32_t first = script_parse_list(p, terminators);
+  if (!p->error && first == SCRIPT_NONE) {
+    script_parse_error(p);
+  }
+  return first;
+}
+
+// do LIST done, the body of every loop.
+internal uint32_t script_parse_do(ScriptParser *p) {
+  script_skip_newlines(p);
+  uint32_t body = SCRIPT_NONE;
+  if (script_expect(p, "do")) {
+    body = script_parse_body(p, script_done_words);
+    script_expect(p, "done");
+  }
+  return body;
+}
+
+// for NAME [in WORD...] do LIST done, the words being compiled like any
+// others and evaluated once when the loop starts.
+internal uint32_t script_parse_for(ScriptParser *p) {
+  ScriptBuilder *b = p->b;
+  p->word = p->word->next;
+  RawWord *name = p->word;
+  if (name == NULL || name->pieces.node_count != 1 ||
+      !vars_is_valid_name(name->pieces.first->string)) {
+    script_parse_error(p);
+    return SCRIPT_NONE;
+  }
+  uint32_t node = script_add_node(b, SCRIPT_NODE_FOR);
+  uint32_t var = script_intern(b, name->pieces.first->string);
+  uint32_t word_first = b->image.word_count;
+  p->word = name->next;
+
+  script_skip_newlines(p);
+  if (script_word_is(p->word, "in")) {
+    p->word = p->word->next;
+    for (; !script_is_separator(p->word); p->word = p->word->next) {
+      if (script_word_is(p->word, "|")) {
+        script_parse_error(p);
+        return node;
+      }
+      script_add_word(p->arena, b, p->word, false);
+    }
+    if (p->word == NULL) {
+      script_parse_error(p);
+      return node;
+    }
+    p->word = p->word->next;
+  } else if (script_word_is(p->word, ";")) {
+    p->word = p->word->next;
+  }
+  uint32_t word_count = b->image.word_count - word_first;
+  uint32_t body = script_parse_do(p);
+
+  ScriptNode *n = &b->image.nodes[node];
+  n->arg = var;
+  n->word_first = word_first;
+  n->word_count = word_count;
+  n->body = body;
+  return node;
+}
+
+// while LIST do LIST done, and until.
+internal uint32_t script_parse_while(ScriptParser *p, uint32_t kind) {
+  p->word = p->word->next;
+  uint32_t node = script_add_node(p->b, kind);
+  uint32_t cond = script_parse_body(p, script_do_words);
+  uint32_t body = script_parse_do(p);
+  p->b->image.nodes[node].cond = cond;
+  p->b->image.nodes[node].body = body;
+  return node;
+}
+
+// After if or elif: the condition, the branch and whatever follows up to
+// the fi. An elif becomes an if in the else branch, and the fi is left to
+// the innermost one.
+internal uint32_t script_parse_if(ScriptParser *p) {
+  p->word = p->word->next;
+  uint32_t node = script_add_node(p->b, SCRIPT_NODE_IF);
+  uint32_t cond = script_parse_body(p, script_then_words);
+  uint32_t body = SCRIPT_NONE;
+  uint32_t else_body = SCRIPT_NONE;
+  if (script_expect(p, "then")) {
+    body = script_parse_body(p, script_branch_words);
+  }
+  if (p->error) {
+    // nothing more to parse
+  } else if (script_word_is(p->word, "elif")) {
+    p->depth += 1;
+    if (p->depth > SCRIPT_DEPTH_MAX) {
+      script_depth_error(p);
+    } else {
+      else_body = script_parse_if(p);
+    }
+    p->depth -= 1;
+  } else if (script_word_is(p->word, "else")) {
+    p->word = p->word->next;
+    else_body = script_parse_body(p, script_fi_words);
+    script_expect(p, "fi");
+  } else {
+    script_expect(p, "fi");
+  }
+
+  ScriptNode *n = &p->b->image.nodes[node];
+  n->cond = cond;
+  n->body = body;
+  n->else_body = else_body;
+  return node;
+}
+
+// break [N] and continue [N], N being a literal positive number.
+internal uint32_t script_parse_loop_control(ScriptParser *p, uint32_t kind) {
+  p->word = p->word->next;
+  uint32_t count = 1;
+  if (!script_is_separator(p->word) && !script_word_is(p->word, "|")) {
+    String n = p->word->pieces.first->string;
+    if (p->word->pieces.node_count != 1 || n.size == 0 || n.size > 9 ||
+        !str_is_posnum(n) || atoi(to_cstring(p->arena, n)) == 0) {
+      script_syntax_error(p, p->word);
+      return SCRIPT_NONE;
+    }
+    count = (uint32_t)atoi(to_cstring(p->arena, n));
+    p->word = p->word->next;
+  }
+  uint32_t node = script_add_node(p->b, kind);
+  p->b->image.nodes[node].arg = count;
+  return node;
+}
+
+// Redirects after the end of a compound statement, as in done < file. They
+// apply to everything in it.
+internal void script_parse_node_redirect(ScriptParser *p, uint32_t node) {
+  for (; p->word != NULL && p->word->pieces.node_count == 1;) {
+    RawWord *word = p->word;
+    StringNode file_node = {0};
+    RedirectInfo info = parse_redirect(word->pieces.first->string, &file_node);
+    if (!redirect_is_set(&info)) {
+      break;
+    }
+    uint32_t file = SCRIPT_NONE;
+    if (!info.dup) {
+      if (script_is_separator(word->next) || script_word_is(word->next, "|")) {
+        script_syntax_error(p, word->next);
+        break;
+      }
+      file = script_add_word(p->arena, p->b, word->next, false);
+      word = word->next;
+    }
+    ScriptNode *n = &p->b->image.nodes[node];
+    n->redir_word = file;
+    n->redir_fd = info.source_fd;
+    n->redir_flag = info.flag;
+    n->redir_dup = info.dup ? info.dup_fd : SCRIPT_REDIR_FILE;
+    p->word = word->next;
+  }
+}
+
+internal uint32_t script_parse_statement(ScriptParser *p) {
+  uint32_t node = SCRIPT_NONE;
+  bool compound = script_word_is(p->word, "for") ||
+                  script_word_is(p->word, "while") ||
+                  script_word_is(p->word, "until") ||
+                  script_word_is(p->word, "if");
+  if (compound && p->depth >= SCRIPT_DEPTH_MAX) {
+    script_depth_error(p);
+    return node;
+  }
+
+  p->depth += 1;
+  if (script_word_is(p->word, "for")) {
+    node = script_parse_for(p);
+  } else if (script_word_is(p->word, "while")) {
+    node = script_parse_while(p, SCRIPT_NODE_WHILE);
+  } else if (script_word_is(p->word, "until")) {
+    node = script_parse_while(p, SCRIPT_NODE_UNTIL);
+  } else if (script_word_is(p->word, "if")) {
+    node = script_parse_if(p);
+  } else if (script_word_is(p->word, "break")) {
+    node = script_parse_loop_control(p, SCRIPT_NODE_BREAK);
+  } else if (script_word_is(p->word, "continue")) {
+    node = script_parse_loop_control(p, SCRIPT_NODE_CONTINUE);
+  } else {
+    node = script_add_node(p->b, SCRIPT_NODE_PIPELINE);
+    uint32_t pipeline = script_parse_pipeline(p);
+    p->b->image.nodes[node].arg = pipeline;
+  }
+  p->depth -= 1;
+
+  if (compound && !p->error) {
+    script_parse_node_redirect(p, node);
+  }
+  return node;
+}
+
+// Statements up to one of the terminators, which is left for the caller.
+// Returns the first one, SCRIPT_NONE for an empty list.
+internal uint32_t script_parse_list(ScriptParser *p, const char **terminators) {
+  ScriptImage *image = &p->b->image;
+  uint32_t first = SCRIPT_NONE;
+  uint32_t last = SCRIPT_NONE;
+  script_skip_newlines(p);
+  while (!p->error && p->word != NULL &&
+         !script_word_in(p->word, terminators)) {
+    uint32_t node = script_parse_statement(p);
+    if (p->error) {
+      break;
+    }
+    if (last == SCRIPT_NONE) {
+      first = node;
+    } else {
+      image->nodes[last].next = node;
+    }
+    last = node;
+
+    // a statement ends at a separator, or right before a terminator
+    if (script_word_is(p->word, ";")) {
+      p->word = p->word->next;
+    } else if (!script_is_separator(p->word) &&
+               !script_word_in(p->word, terminators)) {
+      script_syntax_error(p, p->word);
+    }
+    script_skip_newlines(p);
+  }
+  return first;
+}
+
+// Where the line from start ends: at the first newline outside quotes and
+// command substitutions, which follow the rules of lex_command, or outside
+// a comment. Sets *open when the source ends inside a quote or a
+// substitution instead.
+internal uint64_t script_line_end(Arena *a, SubstEnds *ends, uint64_t start,
+                                  bool *open) {
+  String source = ends->s;
+  char quote = '\0';
+  char prev_ch = '\0';
+  bool word_start = true;
+  for (uint64_t i = start; i < source.size; i += 1) {
+    char ch = source.str[i];
+    if (ch == '\n' && quote == '\0') {
+      return i;
+    }
+    if (ch == '#' && quote == '\0' && word_start) {
+      for (; i < source.size && source.str[i] != '\n'; i += 1)
+        ;
+      return i;
+    }
+    if (quote != SINGLE_QUOTE && prev_ch != BACKSLASH &&
+        is_subst_start(source, i)) {
+      uint64_t end = subst_end_cached(a, ends, i);
+      if (end == 0) {
+        *open = true;
+        return source.size;
+      }
+      i = end - 1;
+      prev_ch = source.str[i];
+      word_start = false;
+      continue;
+    }
+
+    if ((ch == SINGLE_QUOTE || ch == DOUBLE_QUOTE) && prev_ch != BACKSLASH) {
+      if (ch == quote) {
+        quote = '\0';
+      } else if (quote == '\0') {
+        quote = ch;
+      }
+    }
+    word_start = quote == '\0' && prev_ch != BACKSLASH &&
+                 (ch == ' ' || ch == '\t' || ch == ';');
+    bool literal = ch == BACKSLASH && (prev_ch == BACKSLASH ||
+                                       quote == SINGLE_QUOTE);
+    prev_ch = literal ? '\0' : ch;
+  }
+  *open = quote != '\0';
+  return source.size;
+}
+
+// The words of every line in a single list, a word without pieces ending
+// each line. A quote or a command substitution may go on over several
+// lines. Comments are left out. Sets *open when the source ends inside a
+// quote or a substitution.
+internal RawWord *script_lex(Arena *a, String source, bool *open) {
+  RawWordList all = {0};
+  SubstEnds ends = {.s = source};
+  *open = false;
+  uint64_t start = 0;
+  while (start <= source.size && !*open) {
+    uint64_t end = script_line_end(a, &ends, start, open);
+    RawWordList words = lex_command(a, str_substr(source, start, end));
+    RawWord *newline = (RawWord *)arena_alloc(a, sizeof(RawWord));
+    RawWord *next = NULL;
+    for (RawWord *word = words.first; word != NULL; word = next) {
+      next = word->next;
+      String first = word->pieces.first->string;
+      if (first.size > 0 && first.str[0] == '#') {
+        break;
+      }
+      word->next = newline;
+      if (all.last == NULL) {
+        all.first = word;
+      } else {
+        all.last->next = word;
+      }
+      all.last = word;
+    }
+    if (all.last == NULL) {
+      all.first = newline;
+    } else {
+      all.last->next = newline;
+    }
+    all.last = newline;
+    start = end + 1;
+  }
+  return all.first;
+}
+
+// Compiles source into b. A source that ends inside a statement, a quote
+// or a command substitution is SCRIPT_COMPILE_INCOMPLETE, which the caller
+// may complete with more lines. Syntax errors are reported here.
+internal int script_compile(Arena *a, ParseContext *ctx, ScriptBuilder *b,
+                            String source) {
+  TempArenaMemory temp = temp_arena_memory_begin(a);
+  bool open = false;
+  ScriptParser p = {
+      .arena = a, .ctx = ctx, .b = b, .word = script_lex(a, source, &open)};
+  b->image.root = script_parse_list(&p, NULL);
+  temp_arena_memory_end(temp);
+
+  if (p.incomplete || (open && !p.error)) {
+    return SCRIPT_COMPILE_INCOMPLETE;
+  }
+  return p.error ? SCRIPT_COMPILE_ERROR : SCRIPT_COMPILE_OK;
+}
+
+internal void script_eval_word(Arena *a, ParseContext *ctx,
+                               ScriptImage *image, ScriptWord *word,
+                               StringList *out) {
+  if (word->flags & SCRIPT_WORD_LITERAL) {
+    str_list_push(a, out, script_string(image, word->text));
+    return;
+  }
+
+  StringList pieces = {0};
+  for (uint32_t i = 0; i < word->piece_count; i += 1) {
+    uint32_t piece = image->pieces[word->piece_first + i];
+    str_list_push(a, &pieces, script_string(image, piece));
+  }
+  eval_token(a, ctx, &pieces, word->flags & SCRIPT_WORD_ASSIGNMENT, out);
+}
+
+internal StringArray str_list_to_array(Arena *a, StringList *list) {
+  StringArray result = {0};
+  for (StringNode *ptr = list->first; ptr != NULL; ptr = ptr->next) {
+    str_array_push(a, &result, ptr->string);
+  }
+  return result;
+}
+
+// The redirect of a command or node, not set when it has none.
+internal RedirectInfo script_eval_redirect(Arena *a, ParseContext *ctx,
+                                           ScriptImage *image, uint32_t word,
+                                           int fd, int flag, int dup) {
+  RedirectInfo result = {0};
+  if (dup != SCRIPT_REDIR_FILE) {
+    result = (RedirectInfo){.source_fd = fd, .dup = true, .dup_fd = dup};
+  } else if (word != SCRIPT_NONE) {
+    StringList file = {0};
+    script_eval_word(a, ctx, image, &image->words[word], &file);
+    result = (RedirectInfo){
+        .source_fd = fd,
+        .file_name = file.first != NULL ? file.first->string : (String){0},
+        .flag = flag,
+        .input = flag == 0,
+    };
+  }
+  return result;
+}
+
+// The commands of a pipeline: only the dynamic words are evaluated,
+// everything else is used as compiled.
+internal PipedShellCommandList script_build_pipeline(Arena *a,
+                                                     ParseContext *ctx,
+                                                     ScriptImage *image,
+                                                     ScriptPipeline *pipeline) {
+  PipedShellCommandList list = {0};
+  for (uint32_t c = 0; c < pipeline->command_count; c += 1) {
+    ScriptCommand *sc = &image->commands[pipeline->command_first + c];
+    StringList assigns = {0};
+    StringList args = {0};
+    for (uint32_t w = 0; w < sc->word_count; w += 1) {
+      script_eval_word(a, ctx, image, &image->words[sc->word_first + w],
+                       w < sc->assign_count ? &assigns : &args);
+    }
+
+    ShellCommand cmd = {
+        .args = str_list_to_array(a, &args),
+        .assigns = str_list_to_array(a, &assigns),
+    };
+    cmd.exe = cmd.args.count > 0 ? cmd.args.items[0] : (String){0};
+    ScriptWord *name = sc->assign_count < sc->word_count
+                           ? &image->words[sc->word_first + sc->assign_count]
+                           : NULL;
+    if (name != NULL && (name->flags & SCRIPT_WORD_LITERAL)) {
+      cmd.builtin = (name->flags & SCRIPT_WORD_BUILTIN) != 0;
+    } else if (ctx->is_builtin != NULL) {
+      cmd.builtin = ctx->is_builtin(cmd.exe);
+    }
+
+    cmd.redir_info = script_eval_redirect(a, ctx, image, sc->redir_word,
+                                          sc->redir_fd, sc->redir_flag,
+                                          sc->redir_dup);
+    piped_cmd_list_push(a, &list, cmd);
+  }
+  return list;
+}
+
+#endif
@@ -0,0 +1,554 @@
+#ifndef CODECRAFTER_SCRIPT_CACHE_H
+#define CODECRAFTER_SCRIPT_CACHE_H
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "base_string.h"
+
+// A compiled script, or command line: the lexing and the command structure
+// are done once, only expansions are left for run time. The same layout
+// is built in memory by the compiler and mapped straight from the cache
+// file, so it only uses indices and offsets:
+//
+//   ScriptCacheHeader
+//   ScriptPipeline[pipeline_count]  every pipeline of the script
+//   ScriptNode[node_count]          statements, loops and conditionals
+//   ScriptCommand[command_count]    the stages of every pipeline
+//   ScriptWord[word_count]          assignments, arguments, redirect files
+//   uint32_t[piece_count]           raw pieces of the words left dynamic
+//   ScriptString[string_count]      interned strings, each stored once
+//   pool                            their bytes
+#define SCRIPT_CACHE_MAGIC "CCSHSCR1"
+// bumped whenever the format or what a line compiles to changes
+#define SCRIPT_CACHE_VERSION 5
+#define SCRIPT_NONE UINT32_MAX
+// redir_dup of a redirect that opens redir_word, or of no redirect at all
+#define SCRIPT_REDIR_FILE (-2)
+// compound statements nested deeper than this are rejected, which bounds
+// the recursion of the compiler and of the evaluator
+#define SCRIPT_DEPTH_MAX 1000
+
+// Literal words were fully evaluated at compile time and use text. The
+// others keep their raw pieces, quotes included, for eval_token.
+#define SCRIPT_WORD_LITERAL (1u << 0)
+#define SCRIPT_WORD_ASSIGNMENT (1u << 1) // NAME=value, no field splitting
+#define SCRIPT_WORD_BUILTIN (1u << 2)    // literal command name of a builtin
+
+typedef struct ScriptCacheHeader ScriptCacheHeader;
+struct ScriptCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t pipeline_count;
+  uint64_t file_size;
+  // the source this was compiled from
+  uint64_t source_size;
+  uint64_t source_hash;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t command_count;
+  uint32_t word_count;
+  uint32_t piece_count;
+  uint32_t string_count;
+  uint32_t node_count;
+  uint32_t root;
+  uint64_t pool_size;
+};
+
+typedef struct ScriptPipeline ScriptPipeline;
+struct ScriptPipeline {
+  uint32_t command_first;
+  uint32_t command_count;
+};
+
+// Kinds of ScriptNode
+#define SCRIPT_NODE_PIPELINE 0
+#define SCRIPT_NODE_FOR 1
+#define SCRIPT_NODE_WHILE 2
+#define SCRIPT_NODE_UNTIL 3
+#define SCRIPT_NODE_IF 4
+#define SCRIPT_NODE_BREAK 5
+#define SCRIPT_NODE_CONTINUE 6
+#define SCRIPT_NODE_KIND_COUNT 7
+
+// One statement. Statements of a list are chained through next, and every
+// reference points to a later node, so the tree has no cycles.
+typedef struct ScriptNode ScriptNode;
+struct ScriptNode {
+  uint32_t kind;
+  uint32_t next;
+  // the pipeline, the loop variable of a for as a string, or how many
+  // loops a break or continue leaves
+  uint32_t arg;
+  uint32_t word_first; // the words a for loops over
+  uint32_t word_count;
+  uint32_t cond;      // condition list of while, until and if
+  uint32_t body;      // loop body, or the then branch
+  uint32_t else_body; // else branch, an elif is an if node in it
+  // as in ScriptCommand, for the whole of a compound statement
+  uint32_t redir_word;
+  int32_t redir_fd;
+  int32_t redir_flag;
+  int32_t redir_dup;
+};
+
+typedef struct ScriptCommand ScriptCommand;
+struct ScriptCommand {
+  uint32_t word_first;
+  uint32_t word_count;
+  uint32_t assign_count; // leading words that are assignments
+  uint32_t redir_word;   // SCRIPT_NONE without a file to open
+  int32_t redir_fd;      // the descriptor redirected
+  int32_t redir_flag;    // O_TRUNC or O_APPEND to write, 0 to read
+  int32_t redir_dup;     // N of >&N, -1 for >&-, or SCRIPT_REDIR_FILE
+};
+
+
+typedef struct ScriptWord ScriptWord;
+struct ScriptWord {
+  uint32_t flags;
+  uint32_t text; // literal words
+  uint32_t piece_first;
+  uint32_t piece_count;
+};
+
+typedef struct ScriptString ScriptString;
+struct ScriptString {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// A compiled script, either built in memory or mapped from a cache file.
+typedef struct ScriptImage ScriptImage;
+struct ScriptImage {
+  ScriptPipeline *pipelines;
+  ScriptNode *nodes;
+  ScriptCommand *commands;
+  ScriptWord *words;
+  uint32_t *pieces;
+  ScriptString *strings;
+  uint8_t *pool;
+  uint32_t pipeline_count;
+  uint32_t node_count;
+  uint32_t command_count;
+  uint32_t word_count;
+  uint32_t piece_count;
+  uint32_t string_count;
+  uint64_t pool_size;
+  uint32_t root; // first statement, SCRIPT_NONE for an empty script
+
+  uint64_t source_size;
+  uint64_t source_hash;
+  struct timespec mtime;
+
+  uint8_t *map; // the cache file mapping, NULL when built in memory
+  uint64_t map_size;
+};
+
+internal String script_string(ScriptImage *image, uint32_t idx) {
+  ScriptString *s = &image->strings[idx];
+  String result = {.str = image->pool + s->offset, .size = s->size};
+  return result;
+}
+
+internal void script_cache_close(ScriptImage *image) {
+  if (image->map != NULL) {
+    munmap(image->map, image->map_size);
+  }
+  *image = (ScriptImage){0};
+}
+
+internal bool script_range_ok(uint64_t first, uint64_t count, uint64_t total) {
+  return first <= total && count <= total - first;
+}
+
+internal bool script_redirect_ok(ScriptImage *image, uint32_t word,
+                                 int32_t fd, int32_t flag, int32_t dup) {
+  if (fd < 0 || fd > 9 || (flag != 0 && flag != O_TRUNC && flag != O_APPEND)) {
+    return false;
+  }
+  if (dup == SCRIPT_REDIR_FILE) {
+    return word == SCRIPT_NONE || word < image->word_count;
+  }
+  return word == SCRIPT_NONE && dup >= -1 && dup <= 9;
+}
+
+internal bool script_node_ref_ok(ScriptImage *image, uint32_t i,
+                                 uint32_t ref) {
+  return ref == SCRIPT_NONE || (ref > i && ref < image->node_count);
+}
+
+// Node references only point forward, and nesting stays within
+// SCRIPT_DEPTH_MAX. Depths are worked out from the last node back, since a
+// node only refers to later ones.
+internal bool script_nodes_validate(ScriptImage *image) {
+  if (image->root != SCRIPT_NONE && image->root >= image->node_count) {
+    return false;
+  }
+  uint32_t *depths = (uint32_t *)calloc(image->node_count + 1,
+                                        sizeof(uint32_t));
+  bool ok = depths != NULL;
+  for (uint32_t i = image->node_count; ok && i > 0; i -= 1) {
+    ScriptNode *n = &image->nodes[i - 1];
+    ok = n->kind < SCRIPT_NODE_KIND_COUNT &&
+         script_node_ref_ok(image, i - 1, n->next) &&
+         script_node_ref_ok(image, i - 1, n->cond) &&
+         script_node_ref_ok(image, i - 1, n->body) &&
+         script_node_ref_ok(image, i - 1, n->else_body) &&
+         script_redirect_ok(image, n->redir_word, n->redir_fd, n->redir_flag,
+                            n->redir_dup);
+    if (!ok) {
+      break;
+    }
+    if (n->kind == SCRIPT_NODE_PIPELINE) {
+      ok = n->arg < image->pipeline_count;
+    } else if (n->kind == SCRIPT_NODE_FOR) {
+      ok = n->arg < image->string_count &&
+           script_range_ok(n->word_first, n->word_count, image->word_count);
+    }
+
+    // a list is as deep as its deepest statement
+    uint32_t depth = 0;
+    uint32_t children[3] = {n->cond, n->body, n->else_body};
+    for (int c = 0; c < ArrayCount(children); c += 1) {
+      if (children[c] != SCRIPT_NONE && depths[children[c]] + 1 > depth) {
+        depth = depths[children[c]] + 1;
+      }
+    }
+    if (n->next != SCRIPT_NONE && depths[n->next] > depth) {
+      depth = depths[n->next];
+    }
+    depths[i - 1] = depth;
+    ok = ok && depth <= SCRIPT_DEPTH_MAX;
+  }
+  free(depths);
+  return ok;
+}
+
+// Every index and offset must stay inside the image.
+internal bool script_image_validate(ScriptImage *image) {
+  for (uint32_t i = 0; i < image->string_count; i += 1) {
+    ScriptString *s = &image->strings[i];
+    if (!script_range_ok(s->offset, s->size, image->pool_size)) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < image->piece_count; i += 1) {
+    if (image->pieces[i] >= image->string_count) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < image->word_count; i += 1) {
+    ScriptWord *w = &image->words[i];
+    bool ok = w->flags & SCRIPT_WORD_LITERAL
+                  ? w->text < image->string_count
+                  : w->piece_count > 0 && script_range_ok(w->piece_first,
+                                                          w->piece_count,
+                                                          image->piece_count);
+    if (!ok) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < image->command_count; i += 1) {
+    ScriptCommand *c = &image->commands[i];
+    if (!script_range_ok(c->word_first, c->word_count, image->word_count) ||
+        c->assign_count > c->word_count ||
+        !script_redirect_ok(image, c->redir_word, c->redir_fd, c->redir_flag,
+                            c->redir_dup)) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < image->pipeline_count; i += 1) {
+    ScriptPipeline *p = &image->pipelines[i];
+    if (p->command_count == 0 ||
+        !script_range_ok(p->command_first, p->command_count,
+                         image->command_count)) {
+      return false;
+    }
+  }
+  return script_nodes_validate(image);
+}
+
+// Points image into the size bytes of a cache file at data, which must be
+// 8-byte aligned and outlive it. Returns false, leaving image empty, when
+// the bytes are not a valid image; they are trusted in nothing.
+internal bool script_image_load(uint8_t *data, uint64_t size,
+                                ScriptImage *image) {
+  *image = (ScriptImage){0};
+  if (size < sizeof(ScriptCacheHeader)) {
+    return false;
+  }
+
+  ScriptCacheHeader *header = (ScriptCacheHeader *)data;
+  uint64_t expected =
+      sizeof(ScriptCacheHeader) +
+      sizeof(ScriptPipeline) * (uint64_t)header->pipeline_count +
+      sizeof(ScriptNode) * (uint64_t)header->node_count +
+      sizeof(ScriptCommand) * (uint64_t)header->command_count +
+      sizeof(ScriptWord) * (uint64_t)header->word_count +
+      sizeof(uint32_t) * (uint64_t)header->piece_count;
+  // ScriptString holds 64-bit fields
+  uint64_t strings_offset = (expected + 7) & ~(uint64_t)7;
+  expected = strings_offset +
+             sizeof(ScriptString) * (uint64_t)header->string_count +
+             header->pool_size;
+
+  bool valid = memcmp(header->magic, SCRIPT_CACHE_MAGIC, 8) == 0 &&
+               header->version == SCRIPT_CACHE_VERSION &&
+               header->file_size == size && header->pool_size <= size &&
+               expected == size;
+  if (!valid) {
+    return false;
+  }
+
+  uint8_t *ptr = data + sizeof(ScriptCacheHeader);
+  image->pipelines = (ScriptPipeline *)ptr;
+  image->pipeline_count = header->pipeline_count;
+  ptr += sizeof(ScriptPipeline) * image->pipeline_count;
+  image->nodes = (ScriptNode *)ptr;
+  image->node_count = header->node_count;
+  image->root = header->root;
+  ptr += sizeof(ScriptNode) * image->node_count;
+  image->commands = (ScriptCommand *)ptr;
+  image->command_count = header->command_count;
+  ptr += sizeof(ScriptCommand) * image->command_count;
+  image->words = (ScriptWord *)ptr;
+  image->word_count = header->word_count;
+  ptr += sizeof(ScriptWord) * image->word_count;
+  image->pieces = (uint32_t *)ptr;
+  image->piece_count = header->piece_count;
+  image->strings = (ScriptString *)(data + strings_offset);
+  image->string_count = header->string_count;
+  image->pool = (uint8_t *)(image->strings + image->string_count);
+  image->pool_size = header->pool_size;
+
+  image->source_size = header->source_size;
+  image->source_hash = header->source_hash;
+  image->mtime.tv_sec = header->mtime_sec;
+  image->mtime.tv_nsec = header->mtime_nsec;
+  if (!script_image_validate(image)) {
+    *image = (ScriptImage){0};
+    return false;
+  }
+  return true;
+}
+
+// Maps a cache file. Returns false, leaving image empty, for a missing or
+// malformed file, and for one that someone other than the user owns or can
+// write to, since the image is run as is. Whether it matches the script is
+// up to the caller.
+internal bool script_cache_open(const char *path, ScriptImage *image) {
+  *image = (ScriptImage){0};
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      st.st_size < (off_t)sizeof(ScriptCacheHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  if (!script_image_load((uint8_t *)map, st.st_size, image)) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  image->map = (uint8_t *)map;
+  image->map_size = st.st_size;
+  return true;
+}
+
+// An image built in memory has no arrays for what it has none of.
+internal bool script_fwrite(FILE *f, void *items, size_t size,
+                            uint64_t count) {
+  return count == 0 || fwrite(items, size, count, f) == count;
+}
+
+// Writes image to f in the cache file layout.
+internal bool script_image_save(FILE *f, ScriptImage *image) {
+  uint64_t size = sizeof(ScriptCacheHeader) +
+                  sizeof(ScriptPipeline) * (uint64_t)image->pipeline_count +
+                  sizeof(ScriptNode) * (uint64_t)image->node_count +
+                  sizeof(ScriptCommand) * (uint64_t)image->command_count +
+                  sizeof(ScriptWord) * (uint64_t)image->word_count +
+                  sizeof(uint32_t) * (uint64_t)image->piece_count;
+  uint64_t padding = ((size + 7) & ~(uint64_t)7) - size;
+  ScriptCacheHeader header = {
+      .magic = SCRIPT_CACHE_MAGIC,
+      .version = SCRIPT_CACHE_VERSION,
+      .pipeline_count = image->pipeline_count,
+      .file_size = size + padding +
+                   sizeof(ScriptString) * (uint64_t)image->string_count +
+                   image->pool_size,
+      .source_size = image->source_size,
+      .source_hash = image->source_hash,
+      .mtime_sec = image->mtime.tv_sec,
+      .mtime_nsec = image->mtime.tv_nsec,
+      .command_count = image->command_count,
+      .word_count = image->word_count,
+      .piece_count = image->piece_count,
+      .string_count = image->string_count,
+      .node_count = image->node_count,
+      .root = image->root,
+      .pool_size = image->pool_size,
+  };
+
+  uint64_t zero = 0;
+  bool ok =
+      script_fwrite(f, &header, sizeof(header), 1) &&
+      script_fwrite(f, image->pipelines, sizeof(ScriptPipeline),
+                    image->pipeline_count) &&
+      script_fwrite(f, image->nodes, sizeof(ScriptNode), image->node_count) &&
+      script_fwrite(f, image->commands, sizeof(ScriptCommand),
+                    image->command_count) &&
+      script_fwrite(f, image->words, sizeof(ScriptWord), image->word_count) &&
+      script_fwrite(f, image->pieces, sizeof(uint32_t), image->piece_count) &&
+      script_fwrite(f, &zero, 1, padding) &&
+      script_fwrite(f, image->strings, sizeof(ScriptString),
+                    image->string_count) &&
+      script_fwrite(f, image->pool, 1, image->pool_size);
+  return ok;
+}
+
+// Writes image to a temporary file and renames it over path, so readers
+// only ever map a complete cache.
+internal bool script_cache_write(const char *path, ScriptImage *image) {
+  char tmp_path[PATH_MAX_LEN];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+  if (n <= 0 || (size_t)n >= sizeof(tmp_path)) {
+    return false;
+  }
+
+  // private to the user whatever the umask, script_cache_open insists
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (f == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    return false;
+  }
+
+  bool ok = script_image_save(f, image);
+  ok = fclose(f) == 0 && ok;
+  if (ok) {
+    ok = rename(tmp_path, path) == 0;
+  }
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  return ok;
+}
+
+// Growable arrays of a ScriptImage being compiled, and the table that
+// interns its strings.
+typedef struct ScriptBuilder ScriptBuilder;
+struct ScriptBuilder {
+  ScriptImage image;
+  uint32_t pipeline_capacity;
+  uint32_t node_capacity;
+  uint32_t command_capacity;
+  uint32_t word_capacity;
+  uint32_t piece_capacity;
+  uint32_t string_capacity;
+  uint64_t pool_capacity;
+  uint32_t *intern_slots; // string index + 1, 0 for a free slot
+  uint32_t intern_capacity;
+};
+
+// Makes room for one more item in an array growing by doubling.
+internal void *script_grow(void *items, uint32_t count, uint32_t *capacity,
+                           size_t item_size) {
+  if (count < *capacity) {
+    return items;
+  }
+  *capacity = *capacity == 0 ? 64 : *capacity * 2;
+  return realloc(items, item_size * *capacity);
+}
+
+internal void script_builder_free(ScriptBuilder *b) {
+  free(b->image.pipelines);
+  free(b->image.nodes);
+  free(b->image.commands);
+  free(b->image.words);
+  free(b->image.pieces);
+  free(b->image.strings);
+  free(b->image.pool);
+  free(b->intern_slots);
+  *b = (ScriptBuilder){0};
+}
+
+internal void script_intern_insert(ScriptBuilder *b, uint32_t idx) {
+  uint32_t mask = b->intern_capacity - 1;
+  uint32_t i = str_hash(script_string(&b->image, idx)) & mask;
+  for (; b->intern_slots[i] != 0; i = (i + 1) & mask)
+    ;
+  b->intern_slots[i] = idx + 1;
+}
+
+// Index of s in the string table, added the first time it is seen.
+internal uint32_t script_intern(ScriptBuilder *b, String s) {
+  ScriptImage *image = &b->image;
+
+  // keep the table at most half full
+  if ((image->string_count + 1) * 2 > b->intern_capacity) {
+    free(b->intern_slots);
+    b->intern_capacity = b->intern_capacity == 0 ? 256 : b->intern_capacity * 2;
+    b->intern_slots = (uint32_t *)calloc(b->intern_capacity, sizeof(uint32_t));
+    for (uint32_t i = 0; i < image->string_count; i += 1) {
+      script_intern_insert(b, i);
+    }
+  }
+
+  uint32_t mask = b->intern_capacity - 1;
+  for (uint32_t i = str_hash(s) & mask; b->intern_slots[i] != 0;
+       i = (i + 1) & mask) {
+    uint32_t idx = b->intern_slots[i] - 1;
+    if (str_equal(script_string(image, idx), s)) {
+      return idx;
+    }
+  }
+
+  if (image->pool_size + s.size > b->pool_capacity) {
+    uint64_t capacity = b->pool_capacity == 0 ? 4 * KB : b->pool_capacity * 2;
+    for (; capacity < image->pool_size + s.size; capacity *= 2)
+      ;
+    image->pool = (uint8_t *)realloc(image->pool, capacity);
+    b->pool_capacity = capacity;
+  }
+  if (s.size > 0) {
+    memcpy(image->pool + image->pool_size, s.str, s.size);
+  }
+
+  image->strings = (ScriptString *)script_grow(
+      image->strings, image->string_count, &b->string_capacity,
+      sizeof(ScriptString));
+  uint32_t idx = image->string_count;
+  image->strings[idx] = (ScriptString){.offset = image->pool_size,
+                                       .size = s.size};
+  image->string_count += 1;
+  image->pool_size += s.size;
+  script_intern_insert(b, idx);
+  return idx;
+}
+
+#endif
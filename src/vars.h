@@ -0,0 +1,231 @@
+#ifndef CODECRAFTER_VARS_H
+#define CODECRAFTER_VARS_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "base_string.h"
+
+#define VARS_INITIAL_CAPACITY 64
+
+// Names and values are heap allocated: they are replaced one at a time for
+// the whole session, which an arena could only ever grow for.
+typedef struct ShellVar ShellVar;
+struct ShellVar {
+  String name; // empty for a free slot
+  String value;
+  uint64_t hash;
+  bool exported;
+  bool deleted; // tombstone, keeps probe chains intact
+};
+
+// Shell variables in an open addressing table with linear probing. The
+// environment handed to exec is rebuilt from the exported variables only
+// when one of them changed since the last build.
+typedef struct ShellVars ShellVars;
+struct ShellVars {
+  ShellVar *slots;
+  uint64_t capacity; // power of two
+  uint64_t count;
+  uint64_t used; // live entries plus tombstones
+
+  uint64_t env_generation;  // bumped when an exported variable changes
+  uint64_t path_generation; // bumped when PATH changes
+  char **envp;
+  uint64_t envp_generation;
+};
+
+internal bool vars_is_name_start(uint8_t ch) {
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+}
+
+internal bool vars_is_name_char(uint8_t ch) {
+  return vars_is_name_start(ch) || (ch >= '0' && ch <= '9');
+}
+
+internal bool vars_is_valid_name(String name) {
+  if (name.size == 0 || !vars_is_name_start(name.str[0])) {
+    return false;
+  }
+  for (uint64_t i = 1; i < name.size; i += 1) {
+    if (!vars_is_name_char(name.str[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+internal String vars_str_dup(String s) {
+  uint8_t *buf = (uint8_t *)malloc(s.size + 1);
+  memcpy(buf, s.str, s.size);
+  buf[s.size] = '\0';
+  String result = {.str = buf, .size = s.size};
+  return result;
+}
+
+// Slot holding name, or the slot where it would be inserted.
+internal ShellVar *vars_probe(ShellVars *vars, String name, uint64_t hash) {
+  uint64_t mask = vars->capacity - 1;
+  ShellVar *tombstone = NULL;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    ShellVar *slot = &vars->slots[i];
+    if (slot->deleted) {
+      if (tombstone == NULL) {
+        tombstone = slot;
+      }
+    } else if (slot->name.size == 0) {
+      return tombstone != NULL ? tombstone : slot;
+    } else if (slot->hash == hash && str_equal(slot->name, name)) {
+      return slot;
+    }
+  }
+}
+
+internal void vars_grow(ShellVars *vars) {
+  ShellVar *old_slots = vars->slots;
+  uint64_t old_capacity = vars->capacity;
+
+  vars->capacity = old_capacity == 0 ? VARS_INITIAL_CAPACITY : old_capacity * 2;
+  vars->slots = (ShellVar *)calloc(vars->capacity, sizeof(ShellVar));
+  vars->used = vars->count;
+
+  for (uint64_t i = 0; i < old_capacity; i += 1) {
+    ShellVar *var = &old_slots[i];
+    if (var->name.size > 0 && !var->deleted) {
+      *vars_probe(vars, var->name, var->hash) = *var;
+    }
+  }
+  free(old_slots);
+}
+
+internal ShellVar *vars_get(ShellVars *vars, String name) {
+  if (vars->count == 0) {
+    return NULL;
+  }
+  ShellVar *slot = vars_probe(vars, name, str_hash(name));
+  return slot->name.size > 0 && !slot->deleted ? slot : NULL;
+}
+
+internal char *vars_get_cstr(ShellVars *vars, const char *name) {
+  ShellVar *var = vars_get(vars, str_init(name, strlen(name)));
+  return var != NULL ? (char *)var->value.str : NULL;
+}
+
+internal void vars_changed(ShellVars *vars, ShellVar *var) {
+  if (var->exported) {
+    vars->env_generation += 1;
+  }
+  if (str_equal_cstr(var->name, "PATH")) {
+    vars->path_generation += 1;
+  }
+}
+
+internal ShellVar *vars_set(ShellVars *vars, String name, String value) {
+  assert(name.size > 0);
+
+  // keep the load factor, tombstones included, under 3/4
+  if ((vars->used + 1) * 4 > vars->capacity * 3) {
+    vars_grow(vars);
+  }
+
+  uint64_t hash = str_hash(name);
+  ShellVar *slot = vars_probe(vars, name, hash);
+  if (slot->name.size == 0 || slot->deleted) {
+    if (!slot->deleted) {
+      vars->used += 1;
+    }
+    *slot = (ShellVar){.name = vars_str_dup(name), .hash = hash};
+    vars->count += 1;
+  } else if (str_equal(slot->value, value)) {
+    return slot;
+  } else {
+    free(slot->value.str);
+  }
+
+  slot->value = vars_str_dup(value);
+  vars_changed(vars, slot);
+  return slot;
+}
+
+internal void vars_export(ShellVars *vars, ShellVar *var) {
+  if (!var->exported) {
+    var->exported = true;
+    vars_changed(vars, var);
+  }
+}
+
+internal void vars_unset(ShellVars *vars, String name) {
+  ShellVar *var = vars_get(vars, name);
+  if (var == NULL) {
+    return;
+  }
+
+  vars_changed(vars, var);
+  free(var->name.str);
+  free(var->value.str);
+  *var = (ShellVar){.deleted = true};
+  vars->count -= 1;
+}
+
+internal void vars_init(ShellVars *vars, char **environ) {
+  *vars = (ShellVars){0};
+  vars_grow(vars);
+
+  for (char **env = environ; env != NULL && *env != NULL; env += 1) {
+    char *eq = strchr(*env, '=');
+    if (eq == NULL || eq == *env) {
+      continue;
+    }
+    String name = str_init(*env, eq - *env);
+    String value = str_init(eq + 1, strlen(eq + 1));
+    vars_export(vars, vars_set(vars, name, value));
+  }
+}
+
+// NULL terminated "NAME=value" array of the exported variables, rebuilt in
+// a single allocation only when an exported variable changed.
+internal char **vars_envp(ShellVars *vars) {
+  if (vars->envp != NULL && vars->envp_generation == vars->env_generation) {
+    return vars->envp;
+  }
+
+  uint64_t n = 0;
+  uint64_t bytes = 0;
+  for (uint64_t i = 0; i < vars->capacity; i += 1) {
+    ShellVar *var = &vars->slots[i];
+    if (var->name.size > 0 && !var->deleted && var->exported) {
+      n += 1;
+      bytes += var->name.size + var->value.size + 2;
+    }
+  }
+
+  free(vars->envp);
+  char **envp = (char **)malloc(sizeof(char *) * (n + 1) + bytes);
+  char *buf = (char *)(envp + n + 1);
+  uint64_t idx = 0;
+  for (uint64_t i = 0; i < vars->capacity; i += 1) {
+    ShellVar *var = &vars->slots[i];
+    if (var->name.size > 0 && !var->deleted && var->exported) {
+      envp[idx] = buf;
+      idx += 1;
+      memcpy(buf, var->name.str, var->name.size);
+      buf += var->name.size;
+      *buf = '=';
+      memcpy(buf + 1, var->value.str, var->value.size);
+      buf += var->value.size + 1;
+      *buf = '\0';
+      buf += 1;
+    }
+  }
+  envp[n] = NULL;
+
+  vars->envp = envp;
+  vars->envp_generation = vars->env_generation;
+  return envp;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef CODECRAFTER_WILDCARD_H
+#define CODECRAFTER_WILDCARD_H
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "base.h"
+#include "base_string.h"
+
+// Glob patterns use the shell syntax: '*', '?' and '[...]' (with '!' or '^'
+// negation and ranges). A backslash makes the next character literal, which
+// is how the tokenizer marks characters that were quoted.
+
+internal bool glob_is_special(uint8_t ch) {
+  return ch == '*' || ch == '?' || ch == '[' || ch == ']' || ch == BACKSLASH;
+}
+
+// True when s has an unescaped '*', '?' or '['.
+internal bool glob_has_magic(String s) {
+  for (uint64_t i = 0; i < s.size; i += 1) {
+    uint8_t ch = s.str[i];
+    if (ch == BACKSLASH) {
+      i += 1;
+    } else if (ch == '*' || ch == '?' || ch == '[') {
+      return true;
+    }
+  }
+  return false;
+}
+
+internal String glob_unescape(Arena *a, String s) {
+  uint8_t *buf = (uint8_t *)arena_alloc(a, s.size);
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < s.size; i += 1) {
+    if (s.str[i] == BACKSLASH && i + 1 < s.size) {
+      i += 1;
+    }
+    buf[size] = s.str[i];
+    size += 1;
+  }
+  String result = {.str = buf, .size = size};
+  return result;
+}
+
+// Matches ch against the bracket expression starting at p.str[start] == '['.
+// Returns 1 on a match and 0 otherwise, with *end just past the closing ']',
+// or -1 when the bracket is unterminated and must be taken literally.
+internal int glob_match_bracket(String p, uint64_t start, uint8_t ch,
+                                uint64_t *end) {
+  uint64_t i = start + 1;
+  bool negate = false;
+  if (i < p.size && (p.str[i] == '!' || p.str[i] == '^')) {
+    negate = true;
+    i += 1;
+  }
+
+  bool matched = false;
+  uint64_t first = i;
+  for (; i < p.size; i += 1) {
+    uint8_t lo = p.str[i];
+    if (lo == ']' && i > first) {
+      *end = i + 1;
+      return matched != negate ? 1 : 0;
+    }
+    if (lo == BACKSLASH && i + 1 < p.size) {
+      i += 1;
+      lo = p.str[i];
+    }
+
+    uint8_t hi = lo;
+    if (i + 2 < p.size && p.str[i + 1] == '-' && p.str[i + 2] != ']') {
+      i += 2;
+      hi = p.str[i];
+      if (hi == BACKSLASH && i + 1 < p.size) {
+        i += 1;
+        hi = p.str[i];
+      }
+    }
+
+    if (lo <= ch && ch <= hi) {
+      matched = true;
+    }
+  }
+
+  return -1;
+}
+
+// Iterative matcher that only remembers the last '*': on a mismatch it
+// retries from one character further after that star. This is O(n * m) in
+// the worst case and never exponential, however many stars the pattern has.
+internal bool glob_match(String p, String name) {
+  uint64_t pi = 0;
+  uint64_t ni = 0;
+  uint64_t star_pi = UINT64_MAX;
+  uint64_t star_ni = 0;
+
+  while (ni < name.size) {
+    if (pi < p.size) {
+      uint8_t ch = p.str[pi];
+      if (ch == '*') {
+        pi += 1;
+        star_pi = pi;
+        star_ni = ni;
+        continue;
+      } else if (ch == '?') {
+        pi += 1;
+        ni += 1;
+        continue;
+      } else if (ch == '[') {
+        uint64_t end = 0;
+        int r = glob_match_bracket(p, pi, name.str[ni], &end);
+        if (r == 1) {
+          pi = end;
+          ni += 1;
+          continue;
+        } else if (r < 0 && name.str[ni] == '[') {
+          pi += 1;
+          ni += 1;
+          continue;
+        }
+      } else {
+        uint64_t width = 1;
+        if (ch == BACKSLASH && pi + 1 < p.size) {
+          ch = p.str[pi + 1];
+          width = 2;
+        }
+        if (ch == name.str[ni]) {
+          pi += width;
+          ni += 1;
+          continue;
+        }
+      }
+    }
+
+    if (star_pi == UINT64_MAX) {
+      return false;
+    }
+    pi = star_pi;
+    star_ni += 1;
+    ni = star_ni;
+  }
+
+  for (; pi < p.size && p.str[pi] == '*'; pi += 1)
+    ;
+  return pi == p.size;
+}
+
+// Entries of the directory base (a prefix ending in '/', or empty for the
+// current directory) matching component. With want_dir only directories are
+// kept and a '/' is appended, ready for the next component.
+internal void glob_expand_dir(Arena *a, String base, String component,
+                              bool want_dir, StringArray *out) {
+  char *dirpath = base.size == 0 ? "." : to_cstring(a, base);
+  DIR *dir = opendir(dirpath);
+  if (dir == NULL) {
+    return;
+  }
+
+  // a leading dot is only matched by a literal one
+  bool match_hidden = component.size > 0 &&
+                      (component.str[0] == '.' ||
+                       (component.size > 1 && component.str[0] == BACKSLASH &&
+                        component.str[1] == '.'));
+  String slash = str_init("/", want_dir ? 1 : 0);
+
+  struct dirent *de = NULL;
+  while ((de = readdir(dir)) != NULL) {
+    String name = str_init(de->d_name, strlen(de->d_name));
+    if (name.str[0] == '.') {
+      if (!match_hidden || str_equal_cstr(name, ".") ||
+          str_equal_cstr(name, "..")) {
+        continue;
+      }
+    }
+    if (!glob_match(component, name)) {
+      continue;
+    }
+
+    if (want_dir && de->d_type != DT_DIR) {
+      if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) {
+        continue;
+      }
+      struct stat st;
+      char fullpath[PATH_MAX_LEN];
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, de->d_name);
+      if (stat(fullpath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        continue;
+      }
+    }
+
+    String path = str_concat(a, base, name);
+    if (slash.size > 0) {
+      path = str_concat(a, path, slash);
+    }
+    str_array_push(a, out, path);
+  }
+
+  closedir(dir);
+}
+
+// Expands pattern one path component at a time: literal components are
+// appended as they are, wildcard components read each candidate directory
+// once. Returns the matches sorted; none means the caller should keep the
+// word literally.
+internal StringArray glob_expand(Arena *a, String pattern) {
+  StringArray bases = {0};
+  if (!glob_has_magic(pattern)) {
+    return bases;
+  }
+
+  bool absolute = pattern.size > 0 && pattern.str[0] == '/';
+  bool trailing_slash =
+      pattern.size > 0 && pattern.str[pattern.size - 1] == '/';
+  str_array_push(a, &bases, str_init("/", absolute ? 1 : 0));
+
+  StringList components = str_split(a, pattern, str_init("/", 1));
+
+  for (StringNode *ptr = components.first; ptr != NULL && bases.count > 0;
+       ptr = ptr->next) {
+    String component = ptr->string;
+    bool last = ptr->next == NULL;
+    bool want_dir = !last || trailing_slash;
+    StringArray next = {0};
+
+    if (!glob_has_magic(component)) {
+      String literal = glob_unescape(a, component);
+      if (want_dir) {
+        literal = str_concat(a, literal, str_init("/", 1));
+      }
+      for (uint64_t i = 0; i < bases.count; i += 1) {
+        String path = str_concat(a, bases.items[i], literal);
+        // the last component has to exist, earlier ones are checked when
+        // the next wildcard opens them
+        struct stat st;
+        if (!last || lstat(to_cstring(a, path), &st) == 0) {
+          str_array_push(a, &next, path);
+        }
+      }
+    } else {
+      for (uint64_t i = 0; i < bases.count; i += 1) {
+        glob_expand_dir(a, bases.items[i], component, want_dir, &next);
+      }
+    }
+
+    bases = next;
+  }
+
+  if (bases.count > 0) {
+    qsort(bases.items, bases.count, sizeof(String), str_compare_qsort);
+  }
+  return bases;
+}
+
+#endif
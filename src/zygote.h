@@ -0,0 +1,380 @@
+#ifndef CODECRAFTER_ZYGOTE_H
+#define CODECRAFTER_ZYGOTE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base.h"
+
+// A helper process forked before the shell grows, that forks the commands
+// on its behalf. Forking it stays cheap however large the history, arenas
+// and readline state of the shell become.
+//
+// Requests and replies travel over a SOCK_SEQPACKET socket pair, one
+// message each. A request carries the resolved path, argv and envp packed
+// as NUL terminated strings, and the descriptors the child gets (its cwd
+// and fds 0-2 of the shell at that moment, so redirects just work) as
+// SCM_RIGHTS. The zygote answers with the pid right after forking and again
+// with the wait status once the child exits.
+#define ZYGOTE_MAX_FDS 4
+#define ZYGOTE_REQUEST_MAX (256 * KB)
+#define ZYGOTE_CWD_FD (-1) // target meaning fchdir instead of dup2
+
+typedef struct ZygoteRequest ZygoteRequest;
+struct ZygoteRequest {
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t fd_count;
+  uint32_t size; // of the strings following the header
+  int32_t fd_targets[ZYGOTE_MAX_FDS];
+};
+
+typedef struct ZygoteReply ZygoteReply;
+struct ZygoteReply {
+  int32_t pid; // -1 when fork failed
+  int32_t error;
+  int32_t status;
+  uint32_t exited;
+};
+
+typedef struct Zygote Zygote;
+struct Zygote {
+  int sock;
+  pid_t pid;
+  pid_t owner; // forked children of the shell fork for themselves
+  bool running;
+  uint8_t *buf; // request being built, ZYGOTE_REQUEST_MAX bytes
+};
+
+internal bool zygote_send_fds(int sock, void *data, uint64_t size, int *fds,
+                              uint32_t fd_count) {
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    struct cmsghdr align;
+  } control = {0};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+  if (fd_count > 0) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+
+  ssize_t n = 0;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n == (ssize_t)size;
+}
+
+// Returns the message size, 0 at end of file and -1 on error. Received
+// descriptors go to fds, their number to fd_count.
+internal ssize_t zygote_recv_fds(int sock, void *data, uint64_t size,
+                                 int *fds, uint32_t *fd_count) {
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    struct cmsghdr align;
+  } control = {0};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+
+  ssize_t n = 0;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+
+  *fd_count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      uint32_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (uint32_t i = 0; i < count && *fd_count < ZYGOTE_MAX_FDS; i += 1) {
+        memcpy(&fds[*fd_count], CMSG_DATA(cmsg) + sizeof(int) * i,
+               sizeof(int));
+        *fd_count += 1;
+      }
+    }
+  }
+  return n;
+}
+
+// Splits count NUL terminated strings off the front of *data into a NULL
+// terminated array. Returns false when they run past end.
+internal bool zygote_unpack(char **data, char *end, uint32_t count,
+                            char **out) {
+  for (uint32_t i = 0; i < count; i += 1) {
+    char *nul = (char *)memchr(*data, '\0', end - *data);
+    if (nul == NULL) {
+      return false;
+    }
+    out[i] = *data;
+    *data = nul + 1;
+  }
+  out[count] = NULL;
+  return true;
+}
+
+internal void zygote_spawn_child(uint8_t *request, ssize_t size, int *fds,
+                                 uint32_t fd_count, int sock, int sigfd) {
+  ZygoteRequest *header = (ZygoteRequest *)request;
+  ZygoteReply reply = {.pid = -1, .error = EINVAL};
+
+  // every string takes at least its NUL, which bounds the counts
+  bool valid = size >= (ssize_t)sizeof(ZygoteRequest) &&
+               header->fd_count == fd_count && header->argc > 0 &&
+               header->argc < ZYGOTE_REQUEST_MAX &&
+               header->envc < ZYGOTE_REQUEST_MAX;
+  char *data = (char *)request + sizeof(ZygoteRequest);
+  char *end = (char *)request + size;
+  char *path = data;
+  char **argv = NULL;
+  char **envp = NULL;
+  if (valid) {
+    argv = (char **)malloc(sizeof(char *) * (header->argc + 1));
+    envp = (char **)malloc(sizeof(char *) * (header->envc + 1));
+  }
+  valid = valid && argv != NULL && envp != NULL &&
+          zygote_unpack(&data, end, 1, argv) &&
+          zygote_unpack(&data, end, header->argc, argv) &&
+          zygote_unpack(&data, end, header->envc, envp);
+
+  if (valid) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      close(sigfd);
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+      for (uint32_t i = 0; i < fd_count; i += 1) {
+        if (header->fd_targets[i] == ZYGOTE_CWD_FD) {
+          fchdir(fds[i]);
+        } else {
+          dup2(fds[i], header->fd_targets[i]);
+        }
+      }
+      execve(path, argv, envp);
+      perror("execve");
+      _exit(127);
+    }
+    reply.pid = pid;
+    reply.error = pid < 0 ? errno : 0;
+  }
+
+  free(argv);
+  free(envp);
+  for (uint32_t i = 0; i < fd_count; i += 1) {
+    close(fds[i]);
+  }
+  zygote_send_fds(sock, &reply, sizeof(reply), NULL, 0);
+}
+
+// Serves spawn requests until the shell closes its end.
+internal void zygote_main(int sock) {
+  // SIGINT from the terminal is for the foreground command, not for us
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+  int sigfd = signalfd(-1, &chld, SFD_CLOEXEC);
+
+  uint8_t *request = (uint8_t *)malloc(ZYGOTE_REQUEST_MAX);
+  bool running = request != NULL && sigfd >= 0;
+  while (running) {
+    struct pollfd pfds[2] = {
+        {.fd = sock, .events = POLLIN},
+        {.fd = sigfd, .events = POLLIN},
+    };
+    if (poll(pfds, 2, -1) < 0) {
+      running = errno == EINTR;
+      continue;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(sigfd, &info, sizeof(info)) < 0 && errno == EINTR)
+        ;
+      int status = 0;
+      pid_t pid = 0;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        ZygoteReply reply = {.pid = pid, .status = status, .exited = 1};
+        zygote_send_fds(sock, &reply, sizeof(reply), NULL, 0);
+      }
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      int fds[ZYGOTE_MAX_FDS];
+      uint32_t fd_count = 0;
+      ssize_t n =
+          zygote_recv_fds(sock, request, ZYGOTE_REQUEST_MAX, fds, &fd_count);
+      if (n <= 0) {
+        running = false;
+      } else {
+        zygote_spawn_child(request, n, fds, fd_count, sock, sigfd);
+      }
+    }
+  }
+  _exit(0);
+}
+
+// Forks the zygote. Call as early as possible, while the process is small.
+internal bool zygote_start(Zygote *z) {
+  *z = (Zygote){.sock = -1};
+
+  int socks[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) != 0) {
+    return false;
+  }
+  int sndbuf = ZYGOTE_REQUEST_MAX + 4 * KB;
+  setsockopt(socks[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  setsockopt(socks[1], SOL_SOCKET, SO_RCVBUF, &sndbuf, sizeof(sndbuf));
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(socks[0]);
+    close(socks[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(socks[0]);
+    zygote_main(socks[1]);
+  }
+
+  close(socks[1]);
+  // above the descriptors a script can name, so exec 3> cannot replace it
+  z->sock = fcntl(socks[0], F_DUPFD_CLOEXEC, 10);
+  if (z->sock >= 0) {
+    close(socks[0]);
+  } else {
+    z->sock = socks[0];
+  }
+  z->pid = pid;
+  z->owner = getpid();
+  z->buf = (uint8_t *)malloc(ZYGOTE_REQUEST_MAX);
+  z->running = z->buf != NULL;
+  return z->running;
+}
+
+internal void zygote_stop(Zygote *z) {
+  if (z->sock >= 0) {
+    close(z->sock);
+    waitpid(z->pid, NULL, 0);
+  }
+  free(z->buf);
+  *z = (Zygote){.sock = -1};
+}
+
+// Asks the zygote to run path with the shell's cwd and fds 0-2. Returns the
+// pid, or -1 when the request could not be served and the caller should
+// fork itself.
+internal pid_t zygote_spawn(Zygote *z, const char *path, char **argv,
+                            char **envp) {
+  if (!z->running || z->owner != getpid()) {
+    return -1;
+  }
+
+  ZygoteRequest *header = (ZygoteRequest *)z->buf;
+  *header = (ZygoteRequest){0};
+  uint64_t size = sizeof(ZygoteRequest);
+
+  const char *path_list[] = {path, NULL};
+  char *const *lists[] = {(char *const *)path_list, argv, envp};
+  for (int l = 0; l < 3; l += 1) {
+    uint32_t count = 0;
+    for (char *const *s = lists[l]; *s != NULL; s += 1, count += 1) {
+      uint64_t len = strlen(*s) + 1;
+      if (size + len > ZYGOTE_REQUEST_MAX) {
+        return -1;
+      }
+      memcpy(z->buf + size, *s, len);
+      size += len;
+    }
+    if (l == 1) {
+      header->argc = count;
+    } else if (l == 2) {
+      header->envc = count;
+    }
+  }
+  header->size = size - sizeof(ZygoteRequest);
+
+  // a closed descriptor cannot be sent, nor an unreadable cwd; this one
+  // command is forked by the caller and the zygote stays in use
+  int fds[ZYGOTE_MAX_FDS] = {-1, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  for (int i = 1; i < ZYGOTE_MAX_FDS; i += 1) {
+    if (fcntl(fds[i], F_GETFD) < 0) {
+      return -1;
+    }
+  }
+  fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fds[0] < 0) {
+    return -1;
+  }
+  header->fd_targets[0] = ZYGOTE_CWD_FD;
+  for (int i = 1; i < ZYGOTE_MAX_FDS; i += 1) {
+    header->fd_targets[i] = fds[i];
+  }
+  header->fd_count = ZYGOTE_MAX_FDS;
+  bool sent = zygote_send_fds(z->sock, z->buf, size, fds, ZYGOTE_MAX_FDS);
+  close(fds[0]);
+
+  ZygoteReply reply = {0};
+  int unused[ZYGOTE_MAX_FDS];
+  uint32_t unused_count = 0;
+  if (!sent || zygote_recv_fds(z->sock, &reply, sizeof(reply), unused,
+                               &unused_count) != sizeof(reply)) {
+    // the zygote is gone, stop using it
+    z->running = false;
+    return -1;
+  }
+  if (reply.pid < 0) {
+    errno = reply.error;
+  }
+  return reply.pid;
+}
+
+// Blocks until the zygote reports that pid exited, and stores its wait
+// status. Returns false when the zygote went away.
+internal bool zygote_wait(Zygote *z, pid_t pid, int *status) {
+  for (;;) {
+    ZygoteReply reply = {0};
+    int unused[ZYGOTE_MAX_FDS];
+    uint32_t unused_count = 0;
+    if (zygote_recv_fds(z->sock, &reply, sizeof(reply), unused,
+                        &unused_count) != sizeof(reply)) {
+      z->running = false;
+      return false;
+    }
+    if (reply.exited && reply.pid == pid) {
+      *status = reply.status;
+      return true;
+    }
+  }
+}
+
+#endif